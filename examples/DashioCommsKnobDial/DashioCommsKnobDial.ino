@@ -17,14 +17,26 @@ DashDevice *dashDevice;
 
 int dialValue = 0;
 
+// Same as getKnobMessage and getDialMessage, but appended to a message without building a temporary String
+void addValueMessage(String& message, ControlType controlType, const char *controlID, int value) {
+    message += DELIM;
+    message += dashDevice->deviceID;
+    message += DELIM;
+    message += dashDevice->getControlTypeStr(controlType);
+    message += DELIM;
+    message += controlID;
+    message += DELIM;
+    message += value;
+    message += END_DELIM;
+}
+
 void processStatus(ConnectionType connectionType) {
-    String message((char *)0);
-    message.reserve(1024);
+    DashMessageSlot message = dashCommsESP.messagePool.acquire(POOL_SMALL_SIZE - 1); // Returned to the pool at the end of the function
 
-    message = dashDevice->getKnobMessage("KB1", dialValue);
-    message += dashDevice->getDialMessage("DL1", dialValue);
+    addValueMessage(message.str(), knob, "KB1", dialValue);
+    addValueMessage(message.str(), dial, "DL1", dialValue);
 
-    dashCommsESP.sendMessage(message, connectionType);
+    dashCommsESP.sendMessage(message.str(), connectionType);
 }
 
 void processIncomingMessage(MessageData * messageData) {
@@ -35,8 +47,9 @@ void processIncomingMessage(MessageData * messageData) {
     case knob:
         if (messageData->idStr == "KB1") {
             dialValue = messageData->payloadStr.toFloat();
-            String message = dashDevice->getDialMessage("DL1", dialValue);
-            dashCommsESP.sendMessage(message, messageData->connectionType);
+            DashMessageSlot message = dashCommsESP.messagePool.acquire(POOL_SMALL_SIZE - 1);
+            addValueMessage(message.str(), dial, "DL1", dialValue);
+            dashCommsESP.sendMessage(message.str(), messageData->connectionType);
         }
         break;
     }
@@ -0,0 +1,73 @@
+#ifndef DASHIO_COMMS_BOARD_ESP_H
+#define DASHIO_COMMS_BOARD_ESP_H
+
+#include <Arduino.h>
+#include <driver/gpio.h>
+
+enum CommsBoardType {
+    BOARD_ARDUINO,
+    BOARD_ARDUINO_COMMS,
+    BOARD_DASH_DEVICE,
+    BOARD_DASH_DEVICE_MINI
+};
+
+// Board profiles. Add your own by deriving from DashBoardArduino and changing the pins your board uses,
+// then call setBoardProfile<YourBoard>(). DASH_BOARD_PROFILE can only name the profiles below, as the library's
+// own source files are compiled without your sketch's declarations.
+struct DashBoardArduino {
+    static constexpr CommsBoardType boardType = BOARD_ARDUINO;
+    static constexpr gpio_num_t extWakeupPin = GPIO_NUM_NC;
+    static constexpr gpio_num_t bleButtonPin = GPIO_NUM_NC;
+    static constexpr bool ledActiveLow = true;
+    static constexpr gpio_num_t ledPinWiFi = GPIO_NUM_NC;
+    static constexpr gpio_num_t ledPinMQTT = GPIO_NUM_NC;
+    static constexpr gpio_num_t ledPinTCP = GPIO_NUM_NC;
+    static constexpr gpio_num_t ledPinBLE = GPIO_NUM_NC;
+    static constexpr gpio_num_t serialTx = GPIO_NUM_17;
+    static constexpr gpio_num_t serialRx = GPIO_NUM_16;
+    static constexpr gpio_num_t sensorIOenable = GPIO_NUM_NC;
+};
+
+struct DashBoardDashDeviceMini : DashBoardArduino {
+    static constexpr CommsBoardType boardType = BOARD_DASH_DEVICE_MINI;
+    static constexpr gpio_num_t bleButtonPin = GPIO_NUM_1;
+    static constexpr gpio_num_t ledPinMQTT = GPIO_NUM_2;
+    static constexpr gpio_num_t ledPinTCP = GPIO_NUM_3;
+    static constexpr gpio_num_t ledPinBLE = GPIO_NUM_4;
+    static constexpr gpio_num_t sensorIOenable = GPIO_NUM_21; // Dash Sensor IO Board
+};
+
+#ifdef CONFIG_IDF_TARGET_ESP32S3
+struct DashBoardDashDevice : DashBoardArduino {
+    static constexpr CommsBoardType boardType = BOARD_DASH_DEVICE;
+    static constexpr gpio_num_t extWakeupPin = GPIO_NUM_1;
+    static constexpr gpio_num_t bleButtonPin = GPIO_NUM_3;
+    static constexpr gpio_num_t ledPinWiFi = GPIO_NUM_4;
+    static constexpr gpio_num_t ledPinMQTT = GPIO_NUM_5;
+    static constexpr gpio_num_t ledPinTCP = GPIO_NUM_6;
+    static constexpr gpio_num_t ledPinBLE = GPIO_NUM_7;
+    static constexpr gpio_num_t serialTx = GPIO_NUM_43;
+    static constexpr gpio_num_t serialRx = GPIO_NUM_44;
+};
+#endif
+
+// With a library board profile chosen at build time (e.g. -DDASH_BOARD_PROFILE=DashBoardDashDeviceMini), the board pins are constants, so code for absent LEDs, buttons and
+// wake pins is removed by the compiler. Otherwise they are read from DashCommsConfig.
+// The profile belongs to the first instance. Other instances have no board pins, and pins absent from the profile still fold away.
+#ifdef DASH_BOARD_PROFILE
+#define DASH_BOARD(name) ((instanceSlot == 0) ? DASH_BOARD_PROFILE::name : DashBoardArduino::name)
+#else
+#define DASH_BOARD(name) (config.name)
+#endif
+
+static inline uint64_t dashPinMask(gpio_num_t pin) {
+    return (pin == GPIO_NUM_NC) ? 0 : (1ULL << pin);
+}
+
+static inline void dashWritePin(gpio_num_t pin, bool level) {
+    if (pin != GPIO_NUM_NC) {
+        gpio_set_level(pin, level);
+    }
+}
+
+#endif
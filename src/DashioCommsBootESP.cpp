@@ -0,0 +1,24 @@
+#include <DashioCommsBootESP.h>
+#include <DashioESP.h>
+#include <DashioCommsTraceESP.h>
+
+void DashBootTimeline::start(BootPhase phase) {
+    if (phases[phase].startUs == 0) {
+        phases[phase].startUs = (uint32_t)esp_timer_get_time();
+        phases[phase].core = xPortGetCoreID();
+    }
+}
+
+void DashBootTimeline::end(BootPhase phase) {
+    if ((phases[phase].startUs != 0) && (phases[phase].endUs == 0)) {
+        phases[phase].endUs = (uint32_t)esp_timer_get_time();
+    }
+}
+
+void DashBootTimeline::log() {
+    for (uint8_t i = 0; i < NUM_BOOT_PHASES; i++) {
+        if (phases[i].endUs != 0) {
+            DASH_LOGI("Boot %-10s core %u at %6lu ms, %6lu us", BOOT_PHASE_NAMES[i], phases[i].core, phases[i].startUs / 1000, phases[i].endUs - phases[i].startUs);
+        }
+    }
+}
@@ -0,0 +1,44 @@
+#ifndef DASHIO_COMMS_BOOT_ESP_H
+#define DASHIO_COMMS_BOOT_ESP_H
+
+#include <Arduino.h>
+
+enum BootPhase : uint8_t {
+    BOOT_INIT, // All of init()
+    BOOT_BUFFERS,
+    BOOT_PROVISIONING, // Load from NVS
+    BOOT_WIFI_SETUP, // DashWiFi, DashTCP and DashMQTT construction
+    BOOT_STORE_OPEN, // MQTT store recovery
+    BOOT_BLE_SETUP, // DashBLE construction
+    BOOT_BEGIN, // All of begin()
+    BOOT_BLE_START,
+    BOOT_TCP_START,
+    BOOT_MQTT_START,
+    BOOT_WIFI_CONNECTED, // Events, timed from power on
+    BOOT_MQTT_CONNECTED,
+    NUM_BOOT_PHASES
+};
+
+const char * const BOOT_PHASE_NAMES[NUM_BOOT_PHASES] = {"INIT", "BUFFERS", "PROV", "WIFI_SETUP", "STORE", "BLE_SETUP", "BEGIN", "BLE_START", "TCP_START", "MQTT_START", "WIFI_CONN", "MQTT_CONN"};
+
+struct DashBootPhase {
+    uint32_t startUs = 0; // Since power on. 0 if the phase hasn't run
+    uint32_t endUs = 0;
+    uint8_t core = 0;
+};
+
+// Times each startup phase once. Later runs of the same phase (e.g. restarting BLE) are not recorded.
+class DashBootTimeline {
+public:
+    void start(BootPhase phase);
+    void end(BootPhase phase);
+    void mark(BootPhase phase) { start(phase); end(phase); }
+    bool recorded(BootPhase phase) { return phases[phase].endUs != 0; }
+    DashBootPhase get(BootPhase phase) { return phases[phase]; }
+    void log();
+
+private:
+    DashBootPhase phases[NUM_BOOT_PHASES];
+};
+
+#endif
@@ -0,0 +1,121 @@
+#include <DashioCommsDeltaESP.h>
+#include <time.h>
+
+static int8_t deltaDigitValue(char digit) {
+    if ((digit >= 'A') && (digit <= 'Z')) {
+        return digit - 'A';
+    } else if ((digit >= 'a') && (digit <= 'z')) {
+        return digit - 'a' + 26;
+    } else if ((digit >= '0') && (digit <= '9')) {
+        return digit - '0' + 52;
+    } else if (digit == '-') {
+        return 62;
+    } else if (digit == '_') {
+        return 63;
+    }
+    return -1;
+}
+
+bool DashDeltaTable::add(DashRoute *route, uint8_t handle, uint8_t decimals, bool batch, ControlType controlType, const String& prefix) {
+    DashDeltaStream *stream = find(route, handle);
+    if (stream == nullptr) {
+        for (uint8_t i = 0; i < MAX_DELTA_STREAMS; i++) {
+            if (streams[i].route == nullptr) {
+                stream = &streams[i];
+                break;
+            }
+        }
+        if (stream == nullptr) {
+            return false;
+        }
+    }
+
+    stream->route = route;
+    stream->handle = handle;
+    stream->decimals = (decimals > MAX_DELTA_DECIMALS) ? MAX_DELTA_DECIMALS : decimals;
+    stream->batch = batch;
+    stream->controlType = controlType;
+    stream->prefix = prefix;
+    return true;
+}
+
+DashDeltaStream *DashDeltaTable::find(DashRoute *route, uint8_t handle) {
+    for (uint8_t i = 0; i < MAX_DELTA_STREAMS; i++) {
+        if ((streams[i].route == route) && (streams[i].handle == handle)) {
+            return &streams[i];
+        }
+    }
+    return nullptr;
+}
+
+void DashDeltaTable::clear(DashRoute *route) {
+    for (uint8_t i = 0; i < MAX_DELTA_STREAMS; i++) {
+        if (streams[i].route == route) {
+            streams[i].route = nullptr;
+            streams[i].prefix = "";
+        }
+    }
+}
+
+int DashDeltaTable::count(const char *encoded) {
+    int numSamples = 0;
+    while (*encoded) {
+        int8_t digit = deltaDigitValue(*encoded++);
+        if ((digit >= 0) && !(digit & 0x20)) {
+            numSamples++;
+        }
+    }
+    return numSamples;
+}
+
+DashDeltaResult DashDeltaTable::next(const char **encoded, int64_t *value) {
+    if (**encoded == '\0') {
+        return DELTA_END;
+    }
+
+    uint64_t zigzag = 0;
+    uint8_t shift = 0;
+    while (**encoded) {
+        int8_t digit = deltaDigitValue(*(*encoded)++);
+        if ((digit < 0) || (shift > 60)) {
+            return DELTA_ERROR;
+        }
+        zigzag |= (uint64_t)(digit & 0x1F) << shift;
+        if (!(digit & 0x20)) {
+            *value = (int64_t)(zigzag >> 1) ^ -(int64_t)(zigzag & 1);
+            return DELTA_SAMPLE;
+        }
+        shift += 5;
+    }
+    return DELTA_ERROR; // Ended with more groups to follow
+}
+
+int DashDeltaTable::format(int64_t value, uint8_t decimals, char *buffer) {
+    if (decimals == 0) {
+        return sprintf(buffer, "%lld", (long long)value);
+    }
+
+    uint32_t divisor = 1;
+    for (uint8_t i = 0; i < decimals; i++) {
+        divisor *= 10;
+    }
+    uint64_t magnitude = (value < 0) ? -(uint64_t)value : value;
+    return sprintf(buffer, "%s%llu.%0*lu", (value < 0) ? "-" : "", (unsigned long long)(magnitude / divisor), decimals, (unsigned long)(magnitude % divisor));
+}
+
+int DashDeltaTable::formatTime(int64_t timeMs, char *buffer) {
+    if (timeMs < 0) {
+        timeMs = 0;
+    }
+    time_t seconds = timeMs / 1000;
+    uint16_t ms = timeMs % 1000;
+    struct tm timeinfo;
+    gmtime_r(&seconds, &timeinfo);
+    int len = strftime(buffer, DELTA_TIME_LEN, "%Y-%m-%dT%H:%M:%S", &timeinfo);
+    if (ms > 0) {
+        len += sprintf(buffer + len, ".%03u", ms);
+    }
+    buffer[len++] = 'Z';
+    buffer[len] = '\0';
+    return len;
+}
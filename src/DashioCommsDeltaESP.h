@@ -0,0 +1,50 @@
+#ifndef DASHIO_COMMS_DELTA_ESP_H
+#define DASHIO_COMMS_DELTA_ESP_H
+
+#include <Arduino.h>
+#include <DashioESP.h>
+#include <DashioCommsRouteESP.h>
+
+#define MAX_DELTA_STREAMS 16
+#define MAX_DELTA_DECIMALS 6
+#define DELTA_VALUE_LEN 24 // Formatted value, including the terminator
+#define DELTA_TIME_LEN 28 // Formatted timestamp, including the terminator
+
+// Delta encoded samples use a URL safe base 64 alphabet, so they never contain DELIM or END_DELIM.
+// Each sample is a 64 bit zigzag varint in 5 bit groups, least significant first. Bit 5 of a digit is set when more groups follow.
+// The first sample in a message is absolute, and each following sample is the difference from the one before.
+// Time Graph samples are pairs of varints: the timestamp (milliseconds since 1970 UTC), then the value, each delta encoded separately.
+const char DELTA_DIGITS[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789-_";
+
+enum DashDeltaResult : uint8_t {
+    DELTA_END,
+    DELTA_SAMPLE,
+    DELTA_ERROR // Bad digit, or the last varint is cut short
+};
+
+// A registered control for delta encoded samples, identified by the master's route and a small handle
+struct DashDeltaStream {
+    DashRoute *route = nullptr; // nullptr for an empty slot
+    uint8_t handle = 0;
+    uint8_t decimals = 0; // Samples are sent as value * 10^decimals
+    bool batch = false; // All samples in one message, or one message per sample (Time Graphs) or for the newest sample (other controls)
+    ControlType controlType = unknown;
+    String prefix; // controlType DELIM controlID, plus any fixed fields before the value(s)
+};
+
+class DashDeltaTable {
+public:
+    bool add(DashRoute *route, uint8_t handle, uint8_t decimals, bool batch, ControlType controlType, const String& prefix); // Returns false if full
+    DashDeltaStream *find(DashRoute *route, uint8_t handle);
+    void clear(DashRoute *route);
+
+    static int count(const char *encoded); // Number of varints
+    static DashDeltaResult next(const char **encoded, int64_t *value); // Decodes the next zigzag varint
+    static int format(int64_t value, uint8_t decimals, char *buffer); // Returns the length. Buffer must hold DELTA_VALUE_LEN chars
+    static int formatTime(int64_t timeMs, char *buffer); // ISO 8601 UTC. Returns the length. Buffer must hold DELTA_TIME_LEN chars
+
+private:
+    DashDeltaStream streams[MAX_DELTA_STREAMS];
+};
+
+#endif
@@ -1,44 +1,53 @@
 #include <dashioCommsESP.h>
 #include <dashio.h>
 #include <HardwareSerial.h>
+#include <time.h>
+#include <DashioCommsHashESP.h>
+#include <NimBLEDevice.h>
+#if CONFIG_PM_ENABLE
+#include <esp_pm.h>
+#endif
 
 Preferences credentials;
 
-DashCommsConfig DashCommsESP::config;
-
-DashDevice *DashCommsESP::dashDevice = nullptr;
-DashProvision *DashCommsESP::provisioning = nullptr;
-DashWiFi *DashCommsESP::wifi = nullptr;
-DashMQTT *DashCommsESP::mqtt_con = nullptr;
-DashTCP *DashCommsESP::tcp_con = nullptr;
-DashBLE *DashCommsESP::ble_con = nullptr;
-
-void (*DashCommsESP::processIncomingMessage)(MessageData *messageData) = nullptr;
+DashCommsESP *DashCommsESP::instances[MAX_COMMS_INSTANCES] = {nullptr};
+DashCommsESP *DashCommsESP::bleOwner = nullptr;
+DashCommsESP *DashCommsESP::wifiOwner = nullptr;
 
-bool DashCommsESP::initDone = false;
-
-uint8_t DashCommsESP::uiStartupSequenceCounter = 0;
+template <uint8_t slot>
+void DashCommsESP::incomingMessageHook(MessageData *messageData) {
+    if (instances[slot] != nullptr) {
+        instances[slot]->interceptIncomingMessage(messageData);
+    }
+}
 
-uint8_t DashCommsESP::buttonPressCount = 0;
-uint16_t DashCommsESP::bleButtonTimeoutS = 0;
-uint32_t DashCommsESP::bleCountdown = 0;
-bool DashCommsESP::bleSwEnabled = false;
+template <uint8_t slot>
+void DashCommsESP::statusHook(StatusCode statusCode) {
+    if (instances[slot] != nullptr) {
+        instances[slot]->statusCallback(statusCode);
+    }
+}
 
-bool DashCommsESP::ledsEnabled = true;
-uint16_t DashCommsESP::ledsOffTimeoutS = 0;
-uint16_t DashCommsESP::ledsOffCountdown = 0;
+template <uint8_t slot>
+void DashCommsESP::provisionHook(ConnectionType connectionType, const String& message, bool commsChanged) {
+    if (instances[slot] != nullptr) {
+        instances[slot]->onProvisionCallback(connectionType, message, commsChanged);
+    }
+}
 
-bool DashCommsESP::isWiFiRunning = false;
-bool DashCommsESP::isBLE = false;
-bool DashCommsESP::isTCP = false;
-bool DashCommsESP::isMQTT = false;
+static_assert(MAX_COMMS_INSTANCES == 4, "Update the hook tables to match MAX_COMMS_INSTANCES");
 
-CommsModuleMode DashCommsESP::moduleMode = MODULE_MODE_DASH_DEVICE;
-bool DashCommsESP::serialInitDone = false;
-uint8_t DashCommsESP::sendRebootCount = 0;
+void (* const DashCommsESP::incomingMessageHooks[MAX_COMMS_INSTANCES])(MessageData *messageData) = {
+    &incomingMessageHook<0>, &incomingMessageHook<1>, &incomingMessageHook<2>, &incomingMessageHook<3>
+};
 
-uint8_t DashCommsESP::ledTimerCount = 0;
+void (* const DashCommsESP::statusHooks[MAX_COMMS_INSTANCES])(StatusCode statusCode) = {
+    &statusHook<0>, &statusHook<1>, &statusHook<2>, &statusHook<3>
+};
 
+void (* const DashCommsESP::provisionHooks[MAX_COMMS_INSTANCES])(ConnectionType connectionType, const String& message, bool commsChanged) = {
+    &provisionHook<0>, &provisionHook<1>, &provisionHook<2>, &provisionHook<3>
+};
 
 DashCommsESP::DashCommsESP() {
     moduleMode = MODULE_MODE_DASH_SERIAL;
@@ -46,10 +55,10 @@ DashCommsESP::DashCommsESP() {
     dashDevice = new DashDevice(String("Comms Module Type"));
 
     dashDevice->name = "";
+    registerInstance();
 }
 
-DashCommsESP::DashCommsESP(const char *type, const char *name) {
-    DashCommsESP(type, name, NULL, 0);
+DashCommsESP::DashCommsESP(const char *type, const char *name) : DashCommsESP(type, name, NULL, 0) {
 }
 
 DashCommsESP::DashCommsESP(const char *type, const char *name, const char *configC64Str, unsigned int cfgRevision) {
@@ -60,153 +69,546 @@ DashCommsESP::DashCommsESP(const char *type, const char *name, const char *confi
     if (strlen(name) > 0) {
         dashDevice->name = String(name);
     }
+    registerInstance();
+}
+
+DashCommsESP::~DashCommsESP() {
+    if (instanceSlot >= 0) {
+        instances[instanceSlot] = nullptr; // Hooks ignore any late callbacks from here on
+    }
+    joinTasks();
+
+    if (isBLE && (ble_con != nullptr)) {
+        ble_con->end();
+    }
+    if (tcp_con != nullptr) {
+        tcp_con->end();
+    }
+    tcpEgress.stop();
+    if (mqtt_con != nullptr) {
+        mqtt_con->end();
+    }
+    if (isWiFiRunning && (wifi != nullptr)) {
+        wifi->end();
+    }
+    delete ble_con;
+    delete tcp_con;
+    delete mqtt_con;
+    delete wifi;
+    delete provisioning;
+    delete mqttLog;
+    delete firmware;
+
+    if (pipelineBuffers != nullptr) {
+        delete[] pipelineBuffers; // messageBuffer points into it
+    } else {
+        delete[] messageBuffer;
+    }
+    delete[] serialTransmitBuffer;
+    delete[] storeBuffer;
+    delete[] firmwareChunk;
+    delete[] userMessagePool;
+    delete[] userMessageQueuedUs;
+    delete[] userSendPool;
+    QueueHandle_t queues[] = {userFreeQueue, userReadyQueue, userSendFreeQueue, userSendReadyQueue};
+    for (QueueHandle_t queue : queues) {
+        if (queue != nullptr) {
+            vQueueDelete(queue);
+        }
+    }
+
+    delete dashDevice;
+
+    if (bleOwner == this) {
+        bleOwner = nullptr;
+    }
+    if (wifiOwner == this) {
+        wifiOwner = nullptr;
+    }
+}
+
+void DashCommsESP::joinTasks() {
+    TaskHandle_t tasks[] = {uiTaskHandle, userTaskHandle, radioTaskHandle};
+    uint8_t numTasks = 0;
+    for (TaskHandle_t task : tasks) {
+        if (task != nullptr) {
+            numTasks++;
+        }
+    }
+    if (numTasks == 0) {
+        return;
+    }
+
+    stopWaiter = xTaskGetCurrentTaskHandle();
+    stopTasks = true;
+    if (userReadyQueue != nullptr) {
+        uint8_t wake = USER_TASK_STOP; // Waiting for messages
+        xQueueSend(userReadyQueue, &wake, portMAX_DELAY);
+    }
+    for (uint8_t i = 0; i < numTasks; i++) {
+        ulTaskNotifyTake(pdFALSE, portMAX_DELAY);
+    }
+    uiTaskHandle = userTaskHandle = radioTaskHandle = nullptr;
+}
+
+void DashCommsESP::exitTask() {
+    TaskHandle_t waiter = stopWaiter; // The instance may be freed as soon as the waiter is notified
+    xTaskNotifyGive(waiter);
+    vTaskDelete(NULL);
+}
+
+void DashCommsESP::registerInstance() {
+    for (uint8_t i = 0; i < MAX_COMMS_INSTANCES; i++) {
+        if (instances[i] == nullptr) {
+            instances[i] = this;
+            instanceSlot = i;
+            break;
+        }
+    }
+
+#ifdef DASH_BOARD_PROFILE
+    if (instanceSlot == 0) { // The board's pins belong to one instance
+        setBoardProfile<DASH_BOARD_PROFILE>();
+    }
+#endif
 }
 
 void DashCommsESP::setHardwareConfig() {
     if (config.commsBoardType != BOARD_ARDUINO) {
-        if (config.extWakeupPin != GPIO_NUM_NC) {
+        if (DASH_BOARD(extWakeupPin) != GPIO_NUM_NC) {
 #if defined(ARDUINO_ESP32S3_DEV)
-            esp_sleep_enable_ext1_wakeup(1ULL << config.extWakeupPin, ESP_EXT1_WAKEUP_ANY_LOW);
+            esp_sleep_enable_ext1_wakeup(dashPinMask(DASH_BOARD(extWakeupPin)), ESP_EXT1_WAKEUP_ANY_LOW);
 #else
-            esp_sleep_enable_ext1_wakeup(1ULL << config.extWakeupPin, ESP_EXT1_WAKEUP_ALL_LOW);
+            esp_sleep_enable_ext1_wakeup(dashPinMask(DASH_BOARD(extWakeupPin)), ESP_EXT1_WAKEUP_ALL_LOW);
 #endif
-            rtc_gpio_pullup_en(config.extWakeupPin);
-            rtc_gpio_pulldown_dis(config.extWakeupPin);
+            rtc_gpio_pullup_en(DASH_BOARD(extWakeupPin));
+            rtc_gpio_pulldown_dis(DASH_BOARD(extWakeupPin));
         }
         
         // LEDs (and turn off)
-        if (config.ledPinWiFi != GPIO_NUM_NC) {
-            pinMode(config.ledPinWiFi, OUTPUT);
-            digitalWrite(config.ledPinWiFi, config.ledActiveLow);
+        if (DASH_BOARD(ledPinWiFi) != GPIO_NUM_NC) {
+            pinMode(DASH_BOARD(ledPinWiFi), OUTPUT);
+            gpio_set_level(DASH_BOARD(ledPinWiFi), DASH_BOARD(ledActiveLow));
         }
         
-        if (config.ledPinBLE != GPIO_NUM_NC) {
-            pinMode(config.ledPinBLE, OUTPUT);
-            digitalWrite(config.ledPinBLE, config.ledActiveLow);
+        if (DASH_BOARD(ledPinBLE) != GPIO_NUM_NC) {
+            pinMode(DASH_BOARD(ledPinBLE), OUTPUT);
+            gpio_set_level(DASH_BOARD(ledPinBLE), DASH_BOARD(ledActiveLow));
         }
         
-        if (config.ledPinTCP != GPIO_NUM_NC) {
-            pinMode(config.ledPinTCP, OUTPUT);
-            digitalWrite(config.ledPinTCP, config.ledActiveLow);
+        if (DASH_BOARD(ledPinTCP) != GPIO_NUM_NC) {
+            pinMode(DASH_BOARD(ledPinTCP), OUTPUT);
+            gpio_set_level(DASH_BOARD(ledPinTCP), DASH_BOARD(ledActiveLow));
         }
         
-        if (config.ledPinMQTT != GPIO_NUM_NC) {
-            pinMode(config.ledPinMQTT, OUTPUT);
-            digitalWrite(config.ledPinMQTT, config.ledActiveLow);
+        if (DASH_BOARD(ledPinMQTT) != GPIO_NUM_NC) {
+            pinMode(DASH_BOARD(ledPinMQTT), OUTPUT);
+            gpio_set_level(DASH_BOARD(ledPinMQTT), DASH_BOARD(ledActiveLow));
         }
         
         // Push Button
-        if (config.bleButtonPin != GPIO_NUM_NC) {
-            pinMode(config.bleButtonPin, INPUT); //??? Currently has an external pullup, so don't need INPUT_PULLUP
+        if (DASH_BOARD(bleButtonPin) != GPIO_NUM_NC) {
+            pinMode(DASH_BOARD(bleButtonPin), INPUT); //??? Currently has an external pullup, so don't need INPUT_PULLUP
         }
     }
 }
 
 void DashCommsESP::setBoardType(CommsBoardType boardType) {
+    // Only the pins each board has always set. Serial pins and LED polarity are left as configured
     config.commsBoardType = boardType;
     
     if (boardType == BOARD_DASH_DEVICE_MINI) {
-        config.extWakeupPin = GPIO_NUM_NC;
-        
-        config.bleButtonPin = GPIO_NUM_1;
-        
-        // LEDs
-        config.ledPinWiFi = GPIO_NUM_NC;
-        config.ledPinMQTT = GPIO_NUM_2;
-        config.ledPinTCP = GPIO_NUM_3;
-        config.ledPinBLE = GPIO_NUM_4;
-        
-        // Dash Sensor IO Board
-        config.sensorIOenable = GPIO_NUM_21;
+        config.extWakeupPin = DashBoardDashDeviceMini::extWakeupPin;
+        config.bleButtonPin = DashBoardDashDeviceMini::bleButtonPin;
+        config.ledPinWiFi = DashBoardDashDeviceMini::ledPinWiFi;
+        config.ledPinMQTT = DashBoardDashDeviceMini::ledPinMQTT;
+        config.ledPinTCP = DashBoardDashDeviceMini::ledPinTCP;
+        config.ledPinBLE = DashBoardDashDeviceMini::ledPinBLE;
+        config.sensorIOenable = DashBoardDashDeviceMini::sensorIOenable;
     } else if (boardType == BOARD_DASH_DEVICE) {
 #ifdef CONFIG_IDF_TARGET_ESP32S3
-        // Wakeup from sleep EXT1 pin
-        config.extWakeupPin = GPIO_NUM_1;
-
-        config.bleButtonPin = GPIO_NUM_3;
-
-        // Leds
-        config.ledPinWiFi = GPIO_NUM_4;
-        config.ledPinMQTT = GPIO_NUM_5;
-        config.ledPinTCP = GPIO_NUM_6;
-        config.ledPinBLE = GPIO_NUM_7;
-
-        // Serial
-        config.serialTx = GPIO_NUM_43;
-        config.serialRx = GPIO_NUM_44;
+        config.extWakeupPin = DashBoardDashDevice::extWakeupPin;
+        config.bleButtonPin = DashBoardDashDevice::bleButtonPin;
+        config.ledPinWiFi = DashBoardDashDevice::ledPinWiFi;
+        config.ledPinMQTT = DashBoardDashDevice::ledPinMQTT;
+        config.ledPinTCP = DashBoardDashDevice::ledPinTCP;
+        config.ledPinBLE = DashBoardDashDevice::ledPinBLE;
+        config.serialTx = DashBoardDashDevice::serialTx;
+        config.serialRx = DashBoardDashDevice::serialRx;
 #endif
     }
 }
 
+DashDevice * DashCommsESP::init(uint8_t numBLE, uint8_t numTCP, bool dashMQTT, void (*_processIncomingMessage)(MessageData *messageData, void *context), void *context) {
+    processIncomingMessageContext = _processIncomingMessage;
+    processIncomingContext = context;
+    return init(numBLE, numTCP, dashMQTT);
+}
+
 DashDevice * DashCommsESP::init(uint8_t numBLE, uint8_t numTCP, bool dashMQTT, void (*_processIncomingMessage)(MessageData *messageData)) {
-    processIncomingMessage = _processIncomingMessage;
-    
+    if (_processIncomingMessage != nullptr) {
+        processIncomingMessage = _processIncomingMessage;
+    }
+
+    if (instanceSlot < 0) {
+        DASH_LOGE("Too many DashCommsESP instances (max %d)", MAX_COMMS_INSTANCES);
+        return dashDevice;
+    }
+
     if (!initDone) {
-        dashDevice->setup(Network.macAddress());
+        bootTimeline.start(BOOT_INIT);
+        String deviceID = config.deviceID;
+        if (deviceID.length() == 0) {
+            deviceID = Network.macAddress();
+            if (instanceSlot > 0) {
+                deviceID += "-";
+                deviceID += String(instanceSlot);
+            }
+        }
+        dashDevice->setup(deviceID);
+        routes.add(dashDevice->deviceID, true);
         
         initDone = true;
-        dashDevice->statusCallback = &statusCallback;
+        dashDevice->statusCallback = statusHooks[instanceSlot];
         setHardwareConfig();
         
+        bootTimeline.start(BOOT_BUFFERS);
         if (moduleMode != MODULE_MODE_DASH_DEVICE) {
-            serialReceiveBuffer = new char[MAX_BUFFER_SIZE];
-            serialTransmitBuffer = new char[MAX_BUFFER_SIZE];
-            messageBuffer = new char[MAX_BUFFER_SIZE];
-            configC64 = new char[MAX_BUFFER_SIZE];
+            if (config.pipelineSlots > MAX_PIPELINE_SLOTS) {
+                config.pipelineSlots = MAX_PIPELINE_SLOTS;
+            }
+            if (config.pipelineSlots > 0) {
+                pipelineBuffers = new char[(uint32_t)config.pipelineSlots * config.messageBufferSize];
+                for (uint8_t i = 1; i < config.pipelineSlots; i++) {
+                    freeSlots.push(i);
+                }
+                receiveSlot = 0;
+                receiveBuffer = pipelineBuffers;
+            } else {
+                messageBuffer = new char[config.messageBufferSize];
+                receiveBuffer = messageBuffer;
+            }
+            serialTransmitBuffer = new char[config.messageBufferSize + 2]; // Frame with a DELIM added before it, and its terminator
+            logMemoryBudget();
+
+            if (config.firmwareStorage != nullptr) {
+                startFirmware();
+            }
+
+            if (config.storeRegistrySize > 0) {
+                storeRegistry.begin(config.storeRegistrySize, instanceSlot);
+                storeRegistry.load();
+            }
         }
         
+        messagePool.begin(config.poolSmallSlots, config.poolMediumSlots, config.poolLargeSlots, config.poolLargeSize);
+        bootTimeline.end(BOOT_BUFFERS);
+
+        if ((moduleMode == MODULE_MODE_DASH_DEVICE) && (config.userTaskQueueLength > 0)) {
+            startUserTask();
+        }
+
         // Setup task scheduler for LEDs etc.
-        xTaskCreatePinnedToCore(userInterfaceTask, "uiTask", 4096, this, 1, NULL, 1); //??? parameters = this?
+        xTaskCreatePinnedToCore(userInterfaceTask, "uiTask", 4096, this, 1, &uiTaskHandle, 1);
         
+        bootTimeline.start(BOOT_PROVISIONING);
         provisioning = new DashProvision(dashDevice);
-        provisioning->load(onProvisionCallback);
+        provisioning->load(provisionHooks[instanceSlot]);
+        bootTimeline.end(BOOT_PROVISIONING);
         
-        if ((numTCP > 0) or dashMQTT) {
+        bootTimeline.start(BOOT_WIFI_SETUP);
+        if (((numTCP > 0) or dashMQTT) && (wifiOwner != nullptr)) {
+            DASH_LOGW("WiFi is already used by another DashCommsESP instance");
+        } else if ((numTCP > 0) or dashMQTT) {
+            wifiOwner = this; // Only one instance can drive the WiFi station and use the provisioned TCP port and MQTT account
             wifi = new DashWiFi(dashDevice);
             
-            if (numTCP > 0) {
+            if ((numTCP > 0) && (config.tcpEgressSize > 0)) {
+                startTcpEgress(numTCP);
+            } else if (numTCP > 0) {
                 tcp_con = new DashTCP(dashDevice, true, provisioning->tcpPort, numTCP);
-                tcp_con->setCallback(&interceptIncomingMessage);
+                tcp_con->setCallback(incomingMessageHooks[instanceSlot]);
             }
             if (dashMQTT) {
                 mqtt_con = new DashMQTT(dashDevice, false, true);
                 mqtt_con->esp32_mqtt_blocking = false;
-                mqtt_con->setCallback(&interceptIncomingMessage);
+                mqtt_con->setCallback(incomingMessageHooks[instanceSlot]);
+
+                if (config.mqttStorage != nullptr) {
+                    mqttLog = new DashRingLog(config.mqttStorage);
+                    mqttLog->maxAge = config.storeMaxAgeS;
+                    mqttLog->newestOnly = config.storeNewestOnly;
+                    storeBuffer = new char[mqttLog->maxRecordLength() + 1];
+                    if (config.parallelStartup) {
+                        runInParallel(openStoreTask); // Recovery reads the whole store, so overlap it with BLE setup
+                    } else {
+                        openStoreTask(this);
+                    }
+                }
             }
         }
+        bootTimeline.end(BOOT_WIFI_SETUP);
         
-        if (numBLE > 0) {
+        bootTimeline.start(BOOT_BLE_SETUP);
+        if ((numBLE > 0) && (bleOwner != nullptr)) {
+            DASH_LOGW("BLE is already used by another DashCommsESP instance");
+        } else if (numBLE > 0) {
+            bleOwner = this;
             ble_con = new DashBLE(dashDevice, true, numBLE);
-            ble_con->setCallback(&interceptIncomingMessage);
+            ble_con->setCallback(incomingMessageHooks[instanceSlot]);
         }
+        bootTimeline.end(BOOT_BLE_SETUP);
+
+        waitForParallel();
+        bootTimeline.end(BOOT_INIT);
     }
 
     return dashDevice;
 }
 
+void DashCommsESP::runInParallel(TaskFunction_t task) {
+    if (startupDone == nullptr) {
+        startupDone = xSemaphoreCreateBinary();
+    }
+    xTaskCreatePinnedToCore(task, "startupTask", 8192, this, 1, NULL, config.startupTaskCore); // BLE startup needs a large stack
+}
+
+void DashCommsESP::waitForParallel() {
+    if (startupDone != nullptr) {
+        xSemaphoreTake(startupDone, portMAX_DELAY);
+        vSemaphoreDelete(startupDone);
+        startupDone = nullptr;
+    }
+}
+
+void DashCommsESP::openStoreTask(void *parameters) {
+    DashCommsESP *dashComms = (DashCommsESP *)parameters;
+    dashComms->bootTimeline.start(BOOT_STORE_OPEN);
+    dashComms->mqttLog->open();
+    dashComms->bootTimeline.end(BOOT_STORE_OPEN);
+    DASH_LOGI("MQTT store %lu bytes, %lu messages stored", dashComms->config.mqttStorage->size(), dashComms->mqttLog->pending());
+
+    if (dashComms->startupDone != nullptr) {
+        xSemaphoreGive(dashComms->startupDone);
+        vTaskDelete(NULL);
+    }
+}
+
+void DashCommsESP::startBLETask(void *parameters) {
+    DashCommsESP *dashComms = (DashCommsESP *)parameters;
+    dashComms->startBLE();
+    xSemaphoreGive(dashComms->startupDone);
+    vTaskDelete(NULL);
+}
+
+void DashCommsESP::checkBootDone() {
+    // The timeline is logged once, when the last connection that was started comes up
+    if (bootTimeline.recorded(BOOT_MQTT_START) ? bootTimeline.recorded(BOOT_MQTT_CONNECTED) : bootTimeline.recorded(BOOT_WIFI_CONNECTED)) {
+        bootTimeline.log();
+    }
+}
+
+void DashCommsESP::sendBootTimeline() {
+    for (uint8_t i = 0; i < NUM_BOOT_PHASES; i++) {
+        DashBootPhase phase = bootTimeline.get((BootPhase)i);
+        if (phase.endUs != 0) {
+            char payload[48];
+            snprintf(payload, sizeof(payload), "%s\t%u\t%lu\t%lu", BOOT_PHASE_NAMES[i], phase.core, (unsigned long)phase.startUs, (unsigned long)(phase.endUs - phase.startUs));
+            sendControlMessage(BOOT, payload);
+        }
+    }
+}
+
+void DashCommsESP::runPower() {
+    PowerMode mode;
+    for (uint8_t i = 0; i < NUM_POWER_RADIOS; i++) {
+        if (power.update((PowerRadio)i, &mode)) {
+            applyPowerMode((PowerRadio)i, mode);
+        }
+    }
+
+    if (config.autoLightSleep && (moduleMode == MODULE_MODE_DASH_DEVICE)) { // The UART can't receive in light sleep
+        bool anyActive = (power.stats(POWER_WIFI).mode == POWER_ACTIVE) || (power.stats(POWER_BLE).mode == POWER_ACTIVE);
+        if (anyActive == lightSleepEnabled) {
+            setLightSleep(!anyActive);
+        }
+    }
+}
+
+void DashCommsESP::applyPowerMode(PowerRadio radio, PowerMode mode) {
+    DASH_LOGD("%s power %s", (radio == POWER_BLE) ? BLE : WIFI, POWER_MODE_NAMES[mode]);
+    if (radio == POWER_WIFI) {
+        if (!isWiFiRunning) {
+            return;
+        }
+        if (mode == POWER_DOZE) {
+            wifi_config_t wifiConfig;
+            if (esp_wifi_get_config(WIFI_IF_STA, &wifiConfig) == ESP_OK) {
+                wifiConfig.sta.listen_interval = config.wifiListenInterval;
+                esp_wifi_set_config(WIFI_IF_STA, &wifiConfig);
+            }
+            esp_wifi_set_ps(WIFI_PS_MAX_MODEM);
+        } else if ((mode == POWER_IDLE) || isBLE || (bleOwner != nullptr)) {
+            esp_wifi_set_ps(WIFI_PS_MIN_MODEM); // WiFi and BLE coexistence needs modem sleep, so this is the most active mode with BLE
+        } else {
+            esp_wifi_set_ps(WIFI_PS_NONE);
+        }
+    } else if (isBLE && (bleOwner == this)) {
+        uint16_t intervalMs = config.bleAdvActiveMs;
+        if (mode == POWER_IDLE) {
+            intervalMs = config.bleAdvIdleMs;
+        } else if (mode == POWER_DOZE) {
+            intervalMs = config.bleAdvDozeMs;
+        }
+        uint32_t interval = (uint32_t)intervalMs * 8 / 5; // 0.625 ms units
+        if (interval > 0x3333) {
+            interval = 0x3333; // So that the max interval is within the 10.24 s limit
+        }
+        NimBLEAdvertising *advertising = NimBLEDevice::getAdvertising();
+        advertising->setMinInterval(interval);
+        advertising->setMaxInterval(interval + interval / 4);
+        if (advertising->isAdvertising()) { // Restart to use the new interval
+            advertising->stop();
+            advertising->start();
+        }
+    }
+}
+
+void DashCommsESP::setLightSleep(bool enable) {
+#if CONFIG_PM_ENABLE
+    esp_pm_config_t pmConfig;
+    pmConfig.max_freq_mhz = getCpuFrequencyMhz();
+    pmConfig.min_freq_mhz = getXtalFrequencyMhz();
+    pmConfig.light_sleep_enable = enable;
+    if (esp_pm_configure(&pmConfig) == ESP_OK) {
+        lightSleepEnabled = enable;
+    }
+#else
+    if (enable) {
+        DASH_LOGW("Auto light sleep needs CONFIG_PM_ENABLE");
+        config.autoLightSleep = false;
+    }
+#endif
+}
+
+DashPowerStats DashCommsESP::powerStats(PowerRadio radio) {
+    return power.stats(radio);
+}
+
+void DashCommsESP::sendPowerStats() {
+    for (uint8_t i = 0; i < NUM_POWER_RADIOS; i++) {
+        DashPowerStats stats = power.stats((PowerRadio)i);
+        char payload[80];
+        snprintf(payload, sizeof(payload), "%s\t%s\t%lu\t%lu\t%lu\t%lu", (i == POWER_BLE) ? BLE : WIFI, POWER_MODE_NAMES[stats.mode],
+                 (unsigned long)stats.modeMs[POWER_ACTIVE], (unsigned long)stats.modeMs[POWER_IDLE], (unsigned long)stats.modeMs[POWER_DOZE], (unsigned long)stats.changes);
+        sendControlMessage(POWER, payload);
+    }
+}
+
+void DashCommsESP::logMemoryBudget() {
+    uint8_t numMessageBuffers = (config.pipelineSlots > 0) ? config.pipelineSlots : 1;
+    uint32_t poolBytes = (uint32_t)config.poolSmallSlots * POOL_SMALL_SIZE + (uint32_t)config.poolMediumSlots * POOL_MEDIUM_SIZE + (uint32_t)config.poolLargeSlots * config.poolLargeSize;
+    uint32_t bufferBytes = (uint32_t)config.messageBufferSize * (numMessageBuffers + 1) + config.uartRxBufferSize + config.uartTxBufferSize + poolBytes;
+    DASH_LOGI("Memory budget: message %u x %u, transmit %u, UART RX %u, UART TX %u, pool %lu, total %lu bytes", config.messageBufferSize, numMessageBuffers, config.messageBufferSize, config.uartRxBufferSize, config.uartTxBufferSize, poolBytes, bufferBytes);
+    DASH_LOGI("Free heap %lu, largest block %lu bytes", ESP.getFreeHeap(), ESP.getMaxAllocHeap());
+}
+
+DashRoute *DashCommsESP::addRoute(const char *deviceID) {
+    DashRoute *route = routes.add(String(deviceID), false);
+    if (route == nullptr) {
+        DASH_LOGW("Route table full. Device %s ignored", deviceID);
+    } else {
+        DASH_LOGI("Added device %s", deviceID);
+    }
+    return route;
+}
+
+void DashCommsESP::removeRoute(DashRoute *route) {
+    DASH_LOGI("Removed device %s", route->deviceID.c_str());
+    deltaStreams.clear(route);
+    mirror.clear(route->deviceID);
+    routes.remove(route);
+}
+
 void DashCommsESP::interceptIncomingMessage(MessageData *messageData) {
     switch (messageData->control) {
     case deviceName: case wifiSetup: case dashioSetup: case tcpSetup:
+        DASH_TRACE(TRACE_PROVISION, 0);
         provisioning->processMessage(messageData);
         break;
     default:
+        if (config.powerManagement) {
+            power.activity((messageData->connectionType == BLE_CONN) ? POWER_BLE : POWER_WIFI);
+        }
         if (moduleMode == MODULE_MODE_DASH_DEVICE) {
-            if (processIncomingMessage != nullptr) {
-                processIncomingMessage(messageData);
+            if (userReadyQueue != nullptr) {
+                queueUserMessage(messageData);
+            } else {
+                callUserMessage(messageData);
             }
         } else if (moduleMode == MODULE_MODE_DASH_SERIAL) {
-            forwardMessageToSerial(messageData);
+            if (receiveFirmware(messageData)) {
+                // Firmware for the master, staged by the comms module
+            } else if (messageData->control == status) {
+                if (mirrorEnabled && replyFromMirror(messageData)) {
+                    sendControlMessage(JOIN, messageData->getConnectionTypeStr().c_str()); // Let the master know a client has connected
+                } else {
+                    forwardMessageToSerial(messageData);
+                }
+            } else if (!isPrimaryDevice(messageData->deviceID) || filter.isSubscribed(messageData->control, messageData->idStr)) {
+                forwardMessageToSerial(messageData); // CTRL SUB only comes from the primary master, so secondaries are never filtered
+            }
         }
         break;
     } 
 }
 
+bool DashCommsESP::isPrimaryDevice(const String& deviceID) {
+    return (deviceID.length() == 0) || (deviceID == dashDevice->deviceID);
+}
+
+void DashCommsESP::callUserMessage(MessageData *messageData) {
+    if (processIncomingMessageContext != nullptr) {
+        processIncomingMessageContext(messageData, processIncomingContext);
+    } else if (processIncomingMessage != nullptr) {
+        processIncomingMessage(messageData);
+    }
+}
+
+bool DashCommsESP::replyFromMirror(MessageData *messageData) {
+    const String& deviceID = (messageData->deviceID.length() > 0) ? messageData->deviceID : dashDevice->deviceID;
+
+    uint32_t length = mirror.statusLength(deviceID);
+    if (length == 0) {
+        return false; // Nothing mirrored yet, so the master must reply
+    }
+    DashMessageSlot message = messagePool.acquire(length);
+    mirror.getStatus(deviceID, message.str());
+    sendMessage(message.str(), messageData->connectionType);
+    return true;
+}
+
 void DashCommsESP::statusCallback(StatusCode statusCode) {
     if (statusCode == wifiConnected) {
+        if (!bootTimeline.recorded(BOOT_WIFI_CONNECTED)) {
+            bootTimeline.mark(BOOT_WIFI_CONNECTED);
+            checkBootDone();
+        }
+        if (config.powerManagement) {
+            applyPowerMode(POWER_WIFI, power.stats(POWER_WIFI).mode); // WiFi resets its power save mode on connecting
+        }
+        if (isTCP && tcpEgress.active()) {
+            listenTCP();
+        }
         sendControlMessage(WIFI, EN);
     } else if (statusCode == wifiDisconnected) {
+        tcpEgress.stop(); // Clients can't be reached, and the server listens again once reconnected
         sendControlMessage(WIFI, HALT);
     } else if (statusCode == mqttConnected) {
+        if (!bootTimeline.recorded(BOOT_MQTT_CONNECTED)) {
+            bootTimeline.mark(BOOT_MQTT_CONNECTED);
+            checkBootDone();
+        }
         sendControlMessage(MQTT, EN);
     } else if (statusCode == mqttDisconnected) {
         sendControlMessage(MQTT, HALT);
@@ -217,10 +619,14 @@ void DashCommsESP::onProvisionCallback(ConnectionType connectionType, const Stri
     sendMessage(message, connectionType);
 
     if (commsChanged) {
-        if (mqtt_con != nullptr) {
-            mqtt_con->setup(provisioning->dashUserName, provisioning->dashPassword);
+        if ((wifiOwner != nullptr) && (wifiOwner != this)) {
+            wifiOwner->reloadProvisioning(); // Provisioning is stored once for all instances, and WiFi belongs to another instance
+        } else {
+            if (mqtt_con != nullptr) {
+                mqtt_con->setup(provisioning->dashUserName, provisioning->dashPassword);
+            }
+            startWiFi(true);
         }
-        startWiFi(true);
     } else {
         if (mqtt_con != nullptr) {
             mqtt_con->sendWhoAnnounce();
@@ -228,56 +634,224 @@ void DashCommsESP::onProvisionCallback(ConnectionType connectionType, const Stri
     }
 }
 
+void DashCommsESP::reloadProvisioning() {
+    provisioning->load(provisionHooks[instanceSlot]);
+    if (mqtt_con != nullptr) {
+        mqtt_con->setup(provisioning->dashUserName, provisioning->dashPassword);
+    }
+    startWiFi(true);
+}
+
+const String& DashCommsESP::policyMessage(const String& message, PolicyTransport transport, DashMessageSlot& filtered) {
+    if (policies.filter(message, transport, filtered.str())) {
+        return message;
+    }
+    return filtered.str(); // Empty if every line was dropped
+}
+
 void DashCommsESP::sendMessageAll(const String& message) {
+    if (inUserTask()) {
+        queueUserSend(message, ALL_CONN, true);
+        return;
+    }
+
+    DashMessageSlot filtered; // Lines allowed on a transport when some are dropped. Reused for each transport
+    if (policies.count() > 0) {
+        filtered = messagePool.acquire(message.length());
+    }
     if (ble_con != nullptr) {
-        ble_con->sendMessage(message);
+        const String& bleMessage = policyMessage(message, POLICY_BLE, filtered);
+        if (bleMessage.length() > 0) {
+            uint32_t startUs = probeStart();
+            ble_con->sendMessage(bleMessage);
+            sendDone(PROBE_BLE, startUs);
+        }
     }
-    if (tcp_con != nullptr) {
-        tcp_con->sendMessage(message);
+    if (hasTCP()) {
+        const String& tcpMessage = policyMessage(message, POLICY_TCP, filtered);
+        if (tcpMessage.length() > 0) {
+            uint32_t startUs = probeStart();
+            sendTCP(tcpMessage);
+            sendDone(PROBE_TCP, startUs);
+        }
     }
     if (mqtt_con != nullptr) {
-        mqtt_con->sendMessage(message);
+        const String& mqttMessage = policyMessage(message, POLICY_MQTT, filtered);
+        if (mqttMessage.length() > 0) {
+            uint32_t startUs = probeStart();
+            sendMQTT(mqttMessage);
+            sendDone(PROBE_MQTT, startUs);
+        }
     }
 }
 
 void DashCommsESP::sendMessage(const String& message, ConnectionType connectionType) {
-    if (connectionType == BLE_CONN) {
-        if (isBLE){
-            if (ble_con != nullptr) {
-                ble_con->sendMessage(message);
+    if (inUserTask()) {
+        queueUserSend(message, connectionType, false);
+        return;
+    }
+
+    DashMessageSlot filtered; // Lines allowed on a transport when some are dropped. Reused for each transport
+    if (policies.count() > 0) {
+        filtered = messagePool.acquire(message.length());
+    }
+    if ((connectionType == BLE_CONN) || (connectionType == ALL_CONN)) {
+        if (isBLE && (ble_con != nullptr)) {
+            const String& bleMessage = policyMessage(message, POLICY_BLE, filtered);
+            if (bleMessage.length() > 0) {
+                DASH_TRACE(TRACE_SEND_BLE, bleMessage.length());
+                uint32_t startUs = probeStart();
+                ble_con->sendMessage(bleMessage);
+                sendDone(PROBE_BLE, startUs);
             }
         }
-    } else if (connectionType == TCP_CONN) {
-        if (isTCP) {
-            if (tcp_con != nullptr) {
-                tcp_con->sendMessage(message);
+    }
+    if ((connectionType == TCP_CONN) || (connectionType == ALL_CONN)) {
+        if (isTCP && hasTCP()) {
+            const String& tcpMessage = policyMessage(message, POLICY_TCP, filtered);
+            if (tcpMessage.length() > 0) {
+                DASH_TRACE(TRACE_SEND_TCP, tcpMessage.length());
+                uint32_t startUs = probeStart();
+                sendTCP(tcpMessage);
+                sendDone(PROBE_TCP, startUs);
             }
         }
-    } else if (connectionType == MQTT_CONN) {
-        if (isMQTT) {
-            if (mqtt_con != nullptr) {
-                mqtt_con->sendMessage(message);
+    }
+    if ((connectionType == MQTT_CONN) || (connectionType == ALL_CONN)) {
+        if (isMQTT && (mqtt_con != nullptr)) {
+            const String& mqttMessage = policyMessage(message, POLICY_MQTT, filtered);
+            if (mqttMessage.length() > 0) {
+                DASH_TRACE(TRACE_SEND_MQTT, mqttMessage.length());
+                uint32_t startUs = probeStart();
+                sendMQTT(mqttMessage);
+                sendDone(PROBE_MQTT, startUs);
             }
         }
-    } else if (connectionType == ALL_CONN) {
-        if (isBLE){
-            if (ble_con != nullptr) {
-                ble_con->sendMessage(message);
+    }
+}
+
+void DashCommsESP::sendMQTT(const String& message) {
+    if ((mqttLog != nullptr) && ((mqtt_con->state != subscribed) || (mqttLog->pending() > 0))) { // Keep stored messages in order
+        storeMQTT(message);
+    } else {
+        mqtt_con->sendMessage(message);
+    }
+}
+
+void DashCommsESP::storeMQTT(const String& message) {
+    // Controls are identified by DELIM deviceID DELIM controlType DELIM controlID
+    uint32_t keyHash = 0;
+    const char *controlType = strchr(message.c_str() + 1, DELIM);
+    if (controlType != nullptr) {
+        controlType++;
+        int typeLen = strcspn(controlType, DELIMETERS_STR);
+        ControlType control = dashDevice->getControlType(String(controlType, typeLen));
+        if ((control != eventLog) && (control != timeGraph)) { // Logs and time graphs are history, so keep them all
+            int keyLen = typeLen;
+            if (controlType[typeLen] == DELIM) {
+                keyLen += 1 + strcspn(controlType + typeLen + 1, DELIMETERS_STR);
             }
+            keyHash = dashHash(controlType, keyLen);
         }
-        if (isTCP) {
-            if (tcp_con != nullptr) {
-                tcp_con->sendMessage(message);
-            }
+    }
+
+    if (!mqttLog->append(message.c_str(), message.length(), keyHash, time(nullptr))) {
+        DASH_LOGW("MQTT message too long to store");
+    }
+}
+
+void DashCommsESP::replayMQTT() {
+    if ((millis() - lastReplayMs) < config.storeReplayIntervalMs) {
+        return;
+    }
+    lastReplayMs = millis();
+
+    for (uint8_t i = 0; i < config.storeReplayBatch; i++) {
+        int32_t length = mqttLog->peek(storeBuffer, mqttLog->maxRecordLength(), time(nullptr));
+        if (length < 0) {
+            DASH_LOGI("Stored MQTT messages sent. %lu dropped", mqttLog->dropped());
+            break;
         }
-        if (isMQTT) {
-            if (mqtt_con != nullptr) {
-                mqtt_con->sendMessage(message);
-            }
+        storeBuffer[length] = '\0';
+        DashMessageSlot message = messagePool.acquire(length);
+        message.str() += storeBuffer;
+        mqtt_con->sendMessage(message.str());
+        mqttLog->pop();
+    }
+}
+
+bool DashCommsESP::addPolicy(const char *controlType, const char *controlID, uint8_t bleRate, uint8_t tcpRate, uint8_t mqttRate) {
+    return policies.add(controlType, controlID, bleRate, tcpRate, mqttRate);
+}
+
+uint8_t DashCommsESP::parsePolicyRate(const char *token) {
+    if ((token == nullptr) || (!strcmp(token, POLICY_ALL_IDS))) {
+        return POLICY_UNLIMITED;
+    }
+    int rate = atoi(token);
+    if (rate < POLICY_BLOCKED) {
+        return POLICY_BLOCKED;
+    } else if (rate >= POLICY_UNLIMITED) {
+        return POLICY_UNLIMITED - 1;
+    }
+    return rate;
+}
+
+void DashCommsESP::sendPolicyStats() {
+    for (uint8_t i = 0; i < POLICY_TABLE_SIZE; i++) {
+        DashPolicy *policy = policies.get(i);
+        if (policy != nullptr) {
+            String payload = policy->key + String(DELIM) + String(policy->drops);
+            sendControlMessage(POLICY, payload.c_str());
         }
     }
 }
 
+void DashCommsESP::sendDone(ProbeLink link, uint32_t startUs) {
+    if (config.probeRadios) {
+        linkProbes[link].sample((uint32_t)esp_timer_get_time() - startUs);
+    }
+    if (config.powerManagement) {
+        if (link != PROBE_BLE) {
+            power.activity(POWER_WIFI);
+        } else if (ble_con->isConnected()) { // Sends with no BLE client go nowhere, so they aren't activity
+            power.activity(POWER_BLE);
+        }
+    }
+}
+
+void DashCommsESP::sendPing() {
+    uint32_t nowUs = (uint32_t)esp_timer_get_time();
+    uint32_t seq = linkProbes[PROBE_SERIAL].ping(nowUs, config.pingTimeoutMs * 1000);
+    char payload[24];
+    snprintf(payload, sizeof(payload), "%lu\t%lu", (unsigned long)seq, (unsigned long)nowUs);
+    sendControlMessage(PING, payload);
+}
+
+DashLinkStats DashCommsESP::linkStats(ProbeLink link) {
+    return linkProbes[link].stats();
+}
+
+void DashCommsESP::sendLinkStats() {
+    const char *linkNames[NUM_PROBE_LINKS] = {SERIAL_LINK, BLE, TCP, MQTT};
+    for (uint8_t i = 0; i < NUM_PROBE_LINKS; i++) {
+        DashLinkStats stats = linkProbes[i].stats();
+        char payload[112];
+        snprintf(payload, sizeof(payload), "%s\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu", linkNames[i], (unsigned long)stats.sent, (unsigned long)stats.received, (unsigned long)stats.lost,
+                 (unsigned long)stats.lastUs, (unsigned long)stats.minUs, (unsigned long)stats.avgUs, (unsigned long)stats.maxUs, (unsigned long)stats.jitterUs);
+        sendControlMessage(LINK, payload);
+    }
+}
+
+void DashCommsESP::sendPoolStats() {
+    for (uint8_t i = 0; i < NUM_POOL_CLASSES; i++) {
+        DashPoolStats poolStats = messagePool.stats(i);
+        char payload[64];
+        snprintf(payload, sizeof(payload), "%u\t%u\t%u\t%u\t%lu\t%lu", poolStats.slotSize, poolStats.slots, poolStats.inUse, poolStats.peak, (unsigned long)poolStats.acquired, (unsigned long)poolStats.failed);
+        sendControlMessage(POOL, payload);
+    }
+}
+
 void DashCommsESP::enableRebootAlarm(bool enable) {
     if (mqtt_con != nullptr) {
         mqtt_con->sendRebootAlarm = enable && (esp_sleep_get_wakeup_cause() != ESP_SLEEP_WAKEUP_EXT1); // i.e. don't sent alarm if waking
@@ -296,24 +870,124 @@ void DashCommsESP::addDashStore(ControlType controlType, String controlID) {
     }
 }
 
+void DashCommsESP::parseDashStores() {
+    // CTRL STE controlType controlID [controlType controlID ...]
+    char *controlType = strtok(NULL, DELIMETERS_STR);
+    char *controlID = strtok(NULL, DELIMETERS_STR);
+    bool registryFull = false;
+    while (controlType && controlID) {
+        addDashStore(dashDevice->getControlType(controlType), controlID);
+        if (registryActive && !storeRegistry.add(controlType, controlID)) {
+            registryFull = true;
+        }
+        controlType = strtok(NULL, DELIMETERS_STR);
+        controlID = strtok(NULL, DELIMETERS_STR);
+    }
+
+    if (registryFull) {
+        // A partial table would be restored as if complete, so keep none. The next CTRL INIT replies with a count of 0
+        // and the master sends all its registrations again
+        storeRegistry.reset(storeRegistry.revision());
+        storeRegistry.save();
+        registryActive = false; // Until the next CTRL INIT
+        DASH_LOGW("Store registry full. Increase config.storeRegistrySize");
+    } else if (registryActive) {
+        storeRegistry.save(); // Once per frame, however many controls it has
+    }
+}
+
+void DashCommsESP::restoreDashStores(uint32_t revision) {
+    // Replies CTRL STE revision count. With a count of 0 the master must send its CTRL STE registrations
+    uint16_t numRestored = 0;
+    registryActive = (config.storeRegistrySize > 0);
+    if (registryActive) {
+        if ((storeRegistry.revision() == revision) && (storeRegistry.count() > 0)) {
+            String controlType;
+            String controlID;
+            uint16_t pos = 0;
+            while (storeRegistry.get(&pos, controlType, controlID)) {
+                addDashStore(dashDevice->getControlType(controlType), controlID);
+                numRestored++;
+            }
+            DASH_LOGI("Restored %u store registrations for config revision %lu", numRestored, (unsigned long)revision);
+        } else {
+            storeRegistry.reset(revision);
+            storeRegistry.save();
+        }
+    }
+
+    char payload[24];
+    snprintf(payload, sizeof(payload), "%lu\t%u", (unsigned long)revision, numRestored);
+    sendControlMessage(STE, payload);
+}
+
+void DashCommsESP::dumpTrace(ConnectionType connectionType) {
+    DashTraceEntry entries[DASH_TRACE_DUMP_ENTRIES];
+    uint32_t end = DashTrace::end(); // Entries recorded while dumping (including the dump's own sends) aren't included
+    uint32_t index = end - DashTrace::count();
+    uint16_t numRead = DashTrace::read(entries, &index, end, DASH_TRACE_DUMP_ENTRIES);
+    while (numRead > 0) {
+        String payload((char *)0);
+        payload.reserve(numRead * 20);
+        for (uint16_t i = 0; i < numRead; i++) {
+            if (i > 0) {
+                payload += ',';
+            }
+            payload += String(entries[i].timestampUs);
+            payload += ':';
+            payload += String(entries[i].event);
+            payload += ':';
+            payload += String(entries[i].length);
+        }
+
+        if (connectionType == MQTT_CONN) {
+            if (mqtt_con != nullptr) {
+                String message = String(DELIM) + dashDevice->deviceID + String(DELIM) + CTRL + String(DELIM) + TRACE + String(DELIM) + payload + String(END_DELIM);
+                mqtt_con->sendMessage(message);
+            }
+        } else {
+            sendControlMessage(TRACE, payload.c_str());
+        }
+
+        numRead = DashTrace::read(entries, &index, end, DASH_TRACE_DUMP_ENTRIES);
+    }
+}
+
 void DashCommsESP::begin() {
+    bootTimeline.start(BOOT_BEGIN);
+    power.idleMs = config.powerIdleMs;
+    power.dozeMs = config.powerDozeMs;
     if (moduleMode == MODULE_MODE_DASH_DEVICE) {
         setBLEtimeout(bleButtonTimeoutS);
         if (bleButtonTimeoutS > 0) {
             bleSwEnabled = true;
         }
         if (!bleSwEnabled) {
-            startBLE();
+            if (config.parallelStartup && (ble_con != nullptr)) {
+                runInParallel(startBLETask); // BLE and WiFi are independent, so bring them up on both cores
+            } else {
+                startBLE();
+            }
         }
         startTCP();
         startMQTT();
+        waitForParallel();
+        if (wifi == nullptr) {
+            bootTimeline.log(); // No connection to wait for
+        }
     } else {
         // Serial begin
-        config.uart->setRxBufferSize(MAX_BUFFER_SIZE);
+        config.uart->setRxBufferSize(config.uartRxBufferSize);
+        config.uart->setTxBufferSize(config.uartTxBufferSize);
         config.uart->begin(config.baudRate, SERIAL_8N1, config.serialRx, config.serialTx);
         config.uart->flush();
         config.uart->print(END_DELIM_STR);
+
+        if (config.pipelineSlots > 0) {
+            startPipeline();
+        }
     }
+    bootTimeline.end(BOOT_BEGIN);
 }
 
 void DashCommsESP::sendControlMessage(const char* controlID, const char* payload) {
@@ -323,7 +997,14 @@ void DashCommsESP::sendControlMessage(const char* controlID, const char* payload
         char deviceID[devIDlen + 1];
         dashDevice->deviceID.toCharArray(deviceID, devIDlen);
 
-        char str[devIDlen + 60];
+        int strLen = devIDlen + CTRLLEN + 4;
+        if (controlID != nullptr) {
+            strLen += strlen(controlID) + 1;
+        }
+        if (payload != nullptr) {
+            strLen += strlen(payload) + 1;
+        }
+        char str[strLen];
         strcpy(str, DELIM_STR);
         strcat(str, deviceID);
         strcat(str, DELIM_STR);
@@ -339,28 +1020,59 @@ void DashCommsESP::sendControlMessage(const char* controlID, const char* payload
         }
         strcat(str, END_DELIM_STR);
 
-        ESP_LOGI(DTAG, "Outgoing->%s", str);
+        DASH_LOG_FRAME("Outgoing->%s", str);
+        DASH_TRACE(TRACE_SERIAL_TX_CTRL, strlen(str));
 
         config.uart->print(str);
     }
 }
 
 void DashCommsESP::forwardMessageToSerial(MessageData *messageData) {
-    String controlStr = dashDevice->getControlTypeStr(messageData->control);    
-    String message = String(DELIM);
-    message += messageData->getConnectionTypeStr(); // Prefix message with connectionn type
-    message += messageData->getMessageGeneric(controlStr);
+    if ((messageData->deviceID.length() > 0) && (routes.find(messageData->deviceID.c_str()) == nullptr)) {
+        return; // Not for any device behind this comms module
+    }
 
-    ESP_LOGI(DTAG, "Serial Forward->%s", message.c_str());
+    // Built straight into a pool slot, in the same format as MessageData::getMessageGeneric, prefixed with the connection type.
+    // Control and connection types are short enough to be held inside their Strings without allocating
+    String controlStr = dashDevice->getControlTypeStr(messageData->control);
+    String connectionTypeStr = messageData->getConnectionTypeStr();
+    DashMessageSlot message = messagePool.acquire(connectionTypeStr.length() + messageData->deviceID.length() + controlStr.length() + messageData->idStr.length() + messageData->payloadStr.length() + messageData->payloadStr2.length() + 7);
+    message.str() += DELIM;
+    message.str() += connectionTypeStr;
+    message.str() += DELIM;
+    message.str() += messageData->deviceID;
+    message.str() += DELIM;
+    message.str() += controlStr;
+    if (messageData->idStr.length() > 0) {
+        message.str() += DELIM;
+        message.str() += messageData->idStr;
+    }
+    if (messageData->payloadStr.length() > 0) {
+        message.str() += DELIM;
+        message.str() += messageData->payloadStr;
+    }
+    if (messageData->payloadStr2.length() > 0) {
+        message.str() += DELIM;
+        message.str() += messageData->payloadStr2;
+    }
+    message.str() += END_DELIM;
 
-    config.uart->print(message);
+    DASH_LOG_FRAME("Serial Forward->%s", message.str().c_str());
+    DASH_TRACE(TRACE_SERIAL_FORWARD, message.str().length());
+
+    config.uart->print(message.str());
 }
 
 void DashCommsESP::userInterfaceTask(void *parameters) {
-    while(1) {
+    DashCommsESP *dashComms = (DashCommsESP *)parameters;
+    dashComms->userInterface();
+}
+
+void DashCommsESP::userInterface() {
+    while (!stopTasks) {
         // Manage BLE button
-        if ((config.bleButtonPin != GPIO_NUM_NC) && bleSwEnabled) {
-            if (!digitalRead(config.bleButtonPin)) { // i.e. button pressed
+        if ((DASH_BOARD(bleButtonPin) != GPIO_NUM_NC) && bleSwEnabled) {
+            if (!gpio_get_level(DASH_BOARD(bleButtonPin))) { // i.e. button pressed
                 if (buttonPressCount == 1) {
                     if ((!ledsEnabled) && (ledsOffTimeoutS > 0)) {
                         setLEDsTurnoff(ledsOffTimeoutS);
@@ -422,40 +1134,24 @@ void DashCommsESP::userInterfaceTask(void *parameters) {
         if ((config.enableLEDtest) && (uiStartupSequenceCounter < 16)) {
             switch (uiStartupSequenceCounter) {
                 case 0:
-                    if (config.ledPinWiFi != GPIO_NUM_NC) {
-                        digitalWrite(config.ledPinWiFi, !config.ledActiveLow);
-                    }
+                    dashWritePin(DASH_BOARD(ledPinWiFi), !DASH_BOARD(ledActiveLow));
                     break;
                 case 2: 
-                    if (config.ledPinMQTT != GPIO_NUM_NC) {
-                        digitalWrite(config.ledPinMQTT, !config.ledActiveLow);
-                    }
+                    dashWritePin(DASH_BOARD(ledPinMQTT), !DASH_BOARD(ledActiveLow));
                     break;
                 case 4:
-                    if (config.ledPinWiFi != GPIO_NUM_NC) {
-                        digitalWrite(config.ledPinWiFi, config.ledActiveLow);
-                    }
-                    if (config.ledPinTCP != GPIO_NUM_NC) {
-                        digitalWrite(config.ledPinTCP, !config.ledActiveLow);
-                    }
+                    dashWritePin(DASH_BOARD(ledPinWiFi), DASH_BOARD(ledActiveLow));
+                    dashWritePin(DASH_BOARD(ledPinTCP), !DASH_BOARD(ledActiveLow));
                     break;
                 case 6:
-                    if (config.ledPinMQTT != GPIO_NUM_NC) {
-                        digitalWrite(config.ledPinMQTT, config.ledActiveLow);
-                    }
-                    if (config.ledPinBLE != GPIO_NUM_NC) {
-                        digitalWrite(config.ledPinBLE, !config.ledActiveLow);
-                    }
+                    dashWritePin(DASH_BOARD(ledPinMQTT), DASH_BOARD(ledActiveLow));
+                    dashWritePin(DASH_BOARD(ledPinBLE), !DASH_BOARD(ledActiveLow));
                     break;
                 case 8:
-                    if (config.ledPinTCP != GPIO_NUM_NC) {
-                        digitalWrite(config.ledPinTCP, config.ledActiveLow);
-                    }
+                    dashWritePin(DASH_BOARD(ledPinTCP), DASH_BOARD(ledActiveLow));
                     break;
                 case 10:
-                    if (config.ledPinBLE != GPIO_NUM_NC) {
-                        digitalWrite(config.ledPinBLE, config.ledActiveLow);
-                    }
+                    dashWritePin(DASH_BOARD(ledPinBLE), DASH_BOARD(ledActiveLow));
                     break;
                 default:
                     break;
@@ -463,9 +1159,9 @@ void DashCommsESP::userInterfaceTask(void *parameters) {
             uiStartupSequenceCounter++;
         } else if (ledsEnabled) {
             if (wifi == nullptr) {
-                updateLED(config.ledPinWiFi, LED_STATE_OFF);
-                updateLED(config.ledPinMQTT, LED_STATE_OFF);
-                updateLED(config.ledPinTCP, LED_STATE_OFF);
+                updateLED(DASH_BOARD(ledPinWiFi), LED_STATE_OFF);
+                updateLED(DASH_BOARD(ledPinMQTT), LED_STATE_OFF);
+                updateLED(DASH_BOARD(ledPinTCP), LED_STATE_OFF);
             } else {
                 uint8_t ledWiFi_state = LED_STATE_OFF;
                 if (!isWiFiRunning) {
@@ -476,10 +1172,10 @@ void DashCommsESP::userInterfaceTask(void *parameters) {
                     ledWiFi_state = LED_STATE_SEARCHING;
                 }
 
-                updateLED(config.ledPinWiFi, ledWiFi_state);
+                updateLED(DASH_BOARD(ledPinWiFi), ledWiFi_state);
                 if (ledWiFi_state == LED_STATE_OFF) {
-                    updateLED(config.ledPinMQTT, LED_STATE_OFF);
-                    updateLED(config.ledPinTCP, LED_STATE_OFF);
+                    updateLED(DASH_BOARD(ledPinMQTT), LED_STATE_OFF);
+                    updateLED(DASH_BOARD(ledPinTCP), LED_STATE_OFF);
                 } else {
                     if (mqtt_con != nullptr) {
                         uint8_t ledMQTT_state = LED_STATE_OFF;
@@ -490,23 +1186,23 @@ void DashCommsESP::userInterfaceTask(void *parameters) {
                         } else {
                             ledMQTT_state = LED_STATE_SEARCHING;
                         }
-                        updateLED(config.ledPinMQTT, ledMQTT_state);
+                        updateLED(DASH_BOARD(ledPinMQTT), ledMQTT_state);
                     } else {
-                        updateLED(config.ledPinMQTT, LED_STATE_OFF);
+                        updateLED(DASH_BOARD(ledPinMQTT), LED_STATE_OFF);
                     }
 
-                    if (tcp_con != nullptr) {
+                    if (hasTCP()) {
                         uint8_t ledTCP_state = LED_STATE_OFF;
                         if (ledWiFi_state == LED_STATE_SEARCHING) {
                             ledTCP_state = LED_STATE_STARTUP;
-                        } else if (tcp_con->hasClient()) {
+                        } else if ((tcp_con != nullptr) ? tcp_con->hasClient() : (tcpEgress.numClients() > 0)) {
                             ledTCP_state = LED_STATE_CONNECTED;
                         } else {
                             ledTCP_state = LED_STATE_SEARCHING;
                         }
-                        updateLED(config.ledPinTCP, ledTCP_state);
+                        updateLED(DASH_BOARD(ledPinTCP), ledTCP_state);
                     } else {
-                        updateLED(config.ledPinTCP, LED_STATE_OFF);
+                        updateLED(DASH_BOARD(ledPinTCP), LED_STATE_OFF);
                     }
                 }
             }
@@ -520,19 +1216,20 @@ void DashCommsESP::userInterfaceTask(void *parameters) {
                 } else {
                     ledBLE_state = LED_STATE_SEARCHING;
                 }
-                updateLED(config.ledPinBLE, ledBLE_state);
+                updateLED(DASH_BOARD(ledPinBLE), ledBLE_state);
             } else {
-                updateLED(config.ledPinBLE, LED_STATE_OFF);
+                updateLED(DASH_BOARD(ledPinBLE), LED_STATE_OFF);
             }
         } else {
-            digitalWrite(config.ledPinWiFi, config.ledActiveLow);
-            digitalWrite(config.ledPinMQTT, config.ledActiveLow);
-            digitalWrite(config.ledPinTCP, config.ledActiveLow);
-            digitalWrite(config.ledPinBLE, config.ledActiveLow);
+            dashWritePin(DASH_BOARD(ledPinWiFi), DASH_BOARD(ledActiveLow));
+            dashWritePin(DASH_BOARD(ledPinMQTT), DASH_BOARD(ledActiveLow));
+            dashWritePin(DASH_BOARD(ledPinTCP), DASH_BOARD(ledActiveLow));
+            dashWritePin(DASH_BOARD(ledPinBLE), DASH_BOARD(ledActiveLow));
         }
 
         vTaskDelay(500 / MAX_LED_STATES / portTICK_PERIOD_MS);
     }
+    exitTask();
 }
 
 void DashCommsESP::setBLEtimeout(uint16_t timeout) {
@@ -563,9 +1260,11 @@ void DashCommsESP::setBLEpassKey(uint32_t passKey) {
 void DashCommsESP::startBLE() {
     if (ble_con != nullptr) {
         if (!isBLE) { // Don't restart BLE if already running
-            ESP_LOGI(DTAG, "Starting BLE with %lu second timeout set\r\n", bleCountdown / 2);
+            DASH_LOGI("Starting BLE with %lu second timeout set\r\n", bleCountdown / 2);
             isBLE = true;
+            bootTimeline.start(BOOT_BLE_START);
             ble_con->begin();
+            bootTimeline.end(BOOT_BLE_START);
             sendControlMessage(BLE, EN);
         }
     }
@@ -585,11 +1284,11 @@ void DashCommsESP::stopBLE() {
 void DashCommsESP::startWiFi(bool allowRestart) {
     if ((wifi != nullptr) && (!isWiFiRunning || allowRestart)) {
         if (strlen(provisioning->wifiSSID) > 0) {
-            ESP_LOGI(DTAG, "Starting WiFI: %s %s\n", provisioning->wifiSSID, provisioning->wifiPassword);
+            DASH_LOGI("Starting WiFI: %s %s\n", provisioning->wifiSSID, provisioning->wifiPassword);
             isWiFiRunning = true;
             wifi->begin(provisioning->wifiSSID, provisioning->wifiPassword);
         } else {
-            ESP_LOGI(DTAG, "WiFi SSID missing");
+            DASH_LOGI("WiFi SSID missing");
         }
     }
 }
@@ -602,11 +1301,18 @@ void DashCommsESP::stopWiFi() {
 }
 
 void DashCommsESP::startTCP() {
-    if ((wifi != nullptr) && (tcp_con != nullptr)) {
+    if ((wifi != nullptr) && hasTCP()) {
         isTCP = true;
-        tcp_con->tcpPort = provisioning->tcpPort;
-        wifi->attachConnection(tcp_con);
+        bootTimeline.start(BOOT_TCP_START);
+        if (tcp_con != nullptr) {
+            tcp_con->tcpPort = provisioning->tcpPort;
+            wifi->attachConnection(tcp_con);
+        }
         startWiFi();
+        if (tcpEgress.active() && (WiFi.status() == WL_CONNECTED)) {
+            listenTCP(); // Otherwise once WiFi connects
+        }
+        bootTimeline.end(BOOT_TCP_START);
         sendControlMessage(TCP, EN);
     }
 }
@@ -616,6 +1322,7 @@ void DashCommsESP::stopTCP() {
     if (tcp_con != nullptr) {
         tcp_con->end();
     }
+    tcpEgress.stop();
     sendControlMessage(TCP, HALT);
     if (wifi != nullptr) {
         wifi->detachTcp();
@@ -629,9 +1336,11 @@ void DashCommsESP::startMQTT() {
     if ((wifi != nullptr) && (mqtt_con != nullptr)) {
         isMQTT = true;
         if (mqtt_con->state != subscribed) {
+            bootTimeline.start(BOOT_MQTT_START);
             mqtt_con->setup(provisioning->dashUserName, provisioning->dashPassword);
             wifi->attachConnection(mqtt_con);
             startWiFi();
+            bootTimeline.end(BOOT_MQTT_START);
         }
         sendControlMessage(MQTT, EN);
     }
@@ -651,15 +1360,74 @@ void DashCommsESP::stopMQTT() {
     }
 }
 
-void DashCommsESP::sleep() {
-    ESP_LOGI(DTAG, "Going to sleep");
+void DashCommsESP::shutdown(ShutdownAction action) {
+    if ((shutdownStage == SHUTDOWN_IDLE) && (action != SHUTDOWN_NONE)) {
+        DASH_LOGI("Shutdown started");
+        shutdownAction = action;
+        shutdownStage = SHUTDOWN_DRAIN;
+        shutdownStartMs = millis();
+        drainTimedOut = false;
+    }
+}
 
-    if (mqtt_con != nullptr) {
-        mqtt_con->sendMessage(dashDevice->getOfflineMessage());
+bool DashCommsESP::outboundPending() { // Outbound messages still held by this class
+    if (isTCP && tcpEgress.pending()) {
+        return true;
+    }
+    if ((mqttLog != nullptr) && (mqttLog->pending() > 0)) {
+        return isMQTT && (mqtt_con->state == subscribed); // Otherwise they stay stored
     }
+    return false;
+}
+
+void DashCommsESP::runShutdown() {
+    unsigned long elapsedMs = millis() - shutdownStartMs;
+
+    if (shutdownStage == SHUTDOWN_DRAIN) {
+        if (outboundPending() && (elapsedMs < config.shutdownDrainMs)) {
+            return;
+        }
+        drainTimedOut = outboundPending();
+
+        if ((mqtt_con != nullptr) && isMQTT) {
+            mqtt_con->sendMessage(dashDevice->getOfflineMessage());
+        }
+        shutdownStage = SHUTDOWN_SETTLE;
+        settleStartMs = millis();
+    } else if (shutdownStage == SHUTDOWN_SETTLE) {
+        if (((mqtt_con != nullptr) && isMQTT) && (millis() - settleStartMs < config.shutdownSettleMs)) { // Timed from the offline message, even after a drain timeout
+            return;
+        }
+
+        const char *result = DRAIN_OK;
+        if (drainTimedOut) {
+            result = DRAIN_TIMEOUT;
+        }
+        if (shutdownAction == SHUTDOWN_REBOOT) {
+            sendControlMessage(REBOOT, result);
+        } else {
+            sendControlMessage(SLEEP, result);
+        }
+        if (moduleMode != MODULE_MODE_DASH_DEVICE) {
+            config.uart->flush();
+        }
+
+        if (shutdownAction == SHUTDOWN_REBOOT) {
+            DASH_LOGI("Rebooting");
+            ESP.restart();
+        } else {
+            sleep();
+        }
+    }
+}
+
+void DashCommsESP::sleep() {
+    DASH_LOGI("Going to sleep");
+
     if (tcp_con != nullptr) {
         tcp_con->end();
     }
+    tcpEgress.stop();
 
     esp_wifi_stop();
     esp_bt_controller_disable();
@@ -667,6 +1435,20 @@ void DashCommsESP::sleep() {
 }
 
 void DashCommsESP::run() {
+    if (radioTaskHandle != nullptr) {
+        if (shutdownStage == SHUTDOWN_IDLE) {
+            readSerial();
+        }
+        return;
+    }
+
+    runConnections();
+    if ((shutdownStage == SHUTDOWN_IDLE) && (moduleMode != MODULE_MODE_DASH_DEVICE)) {
+        readSerial();
+    }
+}
+
+void DashCommsESP::runConnections() {
     //handles running connections and monitoring connection timeouts
     if (isWiFiRunning) {
         if (wifi != nullptr) {
@@ -674,26 +1456,82 @@ void DashCommsESP::run() {
         }
     }
 
+    if (isTCP && tcpEgress.active()) {
+        tcpEgress.run(millis());
+    }
+
+    if (userSendReadyQueue != nullptr) {
+        runUserSends();
+    }
+
     if (isBLE) {
         if (ble_con != nullptr) {
             ble_con->run();
         }
     }
 
-    if (moduleMode != MODULE_MODE_DASH_DEVICE) {
-        while (config.uart->available() > 0) {
-            currentChar = config.uart->read();
-            if (currentChar == END_DELIM) {
-                serialReceiveBuffer[serialRecieveBufferIndex++] = END_DELIM;
-                serialReceiveBuffer[serialRecieveBufferIndex++] = '\0';
-                if (serialReceiveBuffer[0] != 0) {
-                    memcpy(messageBuffer, serialReceiveBuffer, serialRecieveBufferIndex);
-                    parseMessage();
-                }
-                serialRecieveBufferIndex = 0;
+    if ((mqttLog != nullptr) && isMQTT && (mqtt_con->state == subscribed) && (mqttLog->pending() > 0)) {
+        replayMQTT();
+    }
+
+    if (config.powerManagement) {
+        runPower();
+    }
+
+    if ((moduleMode != MODULE_MODE_DASH_DEVICE) && (config.pingIntervalMs > 0) && (shutdownStage == SHUTDOWN_IDLE) && ((millis() - lastPingMs) >= config.pingIntervalMs)) {
+        lastPingMs = millis();
+        sendPing();
+    }
+
+    if ((moduleMode == MODULE_MODE_DASH_SERIAL) && (config.routeExpiryMs > 0)) {
+        DashRoute *route = routes.findIdle(millis(), config.routeExpiryMs);
+        if (route != nullptr) {
+            removeRoute(route);
+        }
+    }
+
+    if ((firmware != nullptr) && (firmware->state() == FIRMWARE_SENDING) && (shutdownStage == SHUTDOWN_IDLE)) {
+        sendFirmware();
+    }
+
+    if (shutdownStage != SHUTDOWN_IDLE) {
+        runShutdown();
+    }
+}
+
+void DashCommsESP::readSerial() {
+    while ((shutdownStage == SHUTDOWN_IDLE) && (config.uart->available() > 0)) { // Stop at the frame that started a shutdown
+        if ((radioTaskHandle != nullptr) && (receiveBuffer == nullptr)) {
+            uint8_t slot;
+            if (!freeSlots.pop(&slot)) {
+                return; // Radio task is behind, so leave the rest in the UART buffer
+            }
+            receiveSlot = slot;
+            receiveBuffer = &pipelineBuffers[(uint32_t)slot * config.messageBufferSize];
+        }
+
+        currentChar = config.uart->read();
+        if (currentChar == END_DELIM) {
+            if (serialReceiveOverflow) {
+                DASH_LOGW("Serial message exceeds %u bytes. Discarded", config.messageBufferSize);
             } else {
-                serialReceiveBuffer[serialRecieveBufferIndex++] = currentChar;
+                receiveBuffer[serialRecieveBufferIndex++] = END_DELIM;
+                receiveBuffer[serialRecieveBufferIndex++] = '\0';
+                if (receiveBuffer[0] != 0) {
+                    if (radioTaskHandle != nullptr) {
+                        readySlots.push(receiveSlot);
+                        receiveBuffer = nullptr;
+                    } else {
+                        parseMessage();
+                    }
+                }
             }
+            serialRecieveBufferIndex = 0;
+            serialReceiveOverflow = false;
+        } else if (serialRecieveBufferIndex < config.messageBufferSize - 2) { // Leave room for END_DELIM and terminator
+            receiveBuffer[serialRecieveBufferIndex++] = currentChar;
+        } else {
+            serialReceiveOverflow = true;
         }
     }
 }
@@ -703,19 +1541,19 @@ void DashCommsESP::updateLED(gpio_num_t pin, uint8_t state) {
         switch (ledTimerCount) {
             case LED_STATE_OFF:
                 if (state == LED_STATE_OFF) {
-                    digitalWrite(pin, config.ledActiveLow);
+                    gpio_set_level(pin, DASH_BOARD(ledActiveLow));
                 } else {
-                    digitalWrite(pin, !config.ledActiveLow);
+                    gpio_set_level(pin, !DASH_BOARD(ledActiveLow));
                 }
                 break;
             case LED_STATE_STARTUP:
                 if (state == LED_STATE_STARTUP) {
-                    digitalWrite(pin, config.ledActiveLow);
+                    gpio_set_level(pin, DASH_BOARD(ledActiveLow));
                 }
                 break;
             case LED_STATE_SEARCHING:
                 if (state == LED_STATE_SEARCHING) {
-                    digitalWrite(pin, config.ledActiveLow);
+                    gpio_set_level(pin, DASH_BOARD(ledActiveLow));
                 }
                 break;
         }
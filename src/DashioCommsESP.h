@@ -1,20 +1,51 @@
 #include <Arduino.h>
+#include <atomic>
 #include <DashioESP.h>
 #include <DashioProvisionESP.h>
 #include <esp_wifi.h>
 #include <esp_mac.h>
 #include <driver/rtc_io.h>
+#include <DashioCommsTraceESP.h>
+#include <DashioCommsBoardESP.h>
+#include <DashioCommsRouteESP.h>
+#include <DashioCommsMirrorESP.h>
+#include <DashioCommsFilterESP.h>
+#include <DashioCommsPolicyESP.h>
+#include <DashioCommsStoreESP.h>
+#include <DashioCommsPipelineESP.h>
+#include <DashioCommsPoolESP.h>
+#include <DashioCommsProbeESP.h>
+#include <DashioCommsDeltaESP.h>
+#include <DashioCommsBootESP.h>
+#include <DashioCommsPowerESP.h>
+#include <DashioCommsFirmwareESP.h>
+#include <DashioCommsRegistryESP.h>
+#include <DashioCommsEgressESP.h>
+
+enum UserQueueOverflow {
+    USER_QUEUE_DROP_OLDEST,
+    USER_QUEUE_DROP_NEWEST,
+    USER_QUEUE_RUN_INLINE // Call processIncomingMessage from the connection callback
+};
 
-enum CommsBoardType {
-    BOARD_ARDUINO,
-    BOARD_ARDUINO_COMMS,
-    BOARD_DASH_DEVICE,
-    BOARD_DASH_DEVICE_MINI
+// Updated from the connection callbacks and the user task, so each field is atomic
+struct DashUserTaskStats {
+    std::atomic<uint32_t> processed{0};
+    std::atomic<uint32_t> dropped{0};
+    std::atomic<uint32_t> ranInline{0}; // Processed from the connection callback because the queue was full
+    std::atomic<uint32_t> maxLatencyUs{0}; // Time from queueing to processing
+    std::atomic<uint32_t> avgLatencyUs{0}; // Moving average
+    std::atomic<uint8_t> maxQueueDepth{0};
+    std::atomic<uint32_t> sendsQueued{0}; // Messages sent from the user task, passed to run() to send
+    std::atomic<uint32_t> sendsDropped{0}; // No free send slot within userSendWaitMs
 };
 
 struct DashCommsConfig {
     CommsBoardType commsBoardType = BOARD_ARDUINO;
 
+    // Device ID. Defaults to the WiFi mac address (with the instance number appended for additional instances)
+    String deviceID = "";
+
     // Wakeup from sleep EXT1 pin
     gpio_num_t extWakeupPin = GPIO_NUM_NC;
 
@@ -34,8 +65,84 @@ struct DashCommsConfig {
     gpio_num_t serialRx = GPIO_NUM_16;
     HardwareSerial *uart = &Serial2;
 
-    // Buffers
-    uint16_t messageBufferSize = 10000;
+    // Buffers (serial mode only)
+    uint16_t messageBufferSize = 10000; // Largest message frame from the master. Also sets the transmit buffer size
+    uint16_t uartRxBufferSize = 4096;
+    uint16_t uartTxBufferSize = 0; // 0 for writes to wait for the UART FIFO
+
+    // Serial mode pipeline. When pipelineSlots > 0, BLE, WiFi and message parsing run in a radio task on radioTaskCore,
+    // and run() only reads the UART, passing complete messages to the radio task in pipelineSlots message buffers
+    uint8_t pipelineSlots = 0; // Up to MAX_PIPELINE_SLOTS
+    BaseType_t radioTaskCore = 0;
+    uint32_t radioTaskStackSize = 8192;
+
+    // TCP egress. When tcpEgressSize > 0, the comms module runs its own TCP server instead of DashTCP. Each client has
+    // a non-blocking socket and a buffer of this many bytes, so a slow or stalled client can't hold up the loop
+    // (and with it the serial link and BLE) or the other clients
+    uint32_t tcpEgressSize = 0;
+    uint16_t tcpMaxWrite = 1436; // Largest write. Queued messages are combined up to this size
+    uint32_t tcpDegradeMs = 1000; // New messages for a TCP client are dropped while it has been stalled for longer than this
+    uint32_t tcpEvictMs = 5000; // A TCP client is disconnected after being stalled for longer than this
+
+    // Message pool. Outgoing messages are built in pooled Strings, reserved at init, instead of on the heap
+    uint8_t poolSmallSlots = 8; // POOL_SMALL_SIZE bytes each
+    uint8_t poolMediumSlots = 4; // POOL_MEDIUM_SIZE bytes each
+    uint8_t poolLargeSlots = 2; // poolLargeSize bytes each
+    uint16_t poolLargeSize = 2048;
+
+    // Link probe
+    uint32_t pingIntervalMs = 0; // Serial mode. Time between CTRL PING messages to the master. 0 for none
+    uint32_t pingTimeoutMs = 2000; // PING without a PONG after this time is counted as lost
+    bool probeRadios = false; // Measure the time taken to send each message on BLE, TCP and MQTT
+
+    // Routing
+    uint32_t routeExpiryMs = 0; // Serial mode. Secondary masters are removed after this long without a message. 0 to keep them
+
+    // Startup
+    bool parallelStartup = false; // Overlap BLE with WiFi startup, and the MQTT store recovery with connection setup
+    BaseType_t startupTaskCore = 0; // Core for the steps run in parallel
+
+    // Power management. Each radio moves to idle, then doze, as its traffic stops, and back to active on the next message
+    bool powerManagement = false;
+    uint32_t powerIdleMs = 5000;
+    uint32_t powerDozeMs = 60000;
+    uint16_t wifiListenInterval = 10; // Beacon intervals between wakes in doze. Used from the next WiFi connection
+    uint16_t bleAdvActiveMs = 100; // BLE advertising interval in each mode
+    uint16_t bleAdvIdleMs = 500;
+    uint16_t bleAdvDozeMs = 2000;
+    bool autoLightSleep = false; // DashDevice mode. Light sleep between events when no radio is active. Needs CONFIG_PM_ENABLE
+
+    // Sleep and reboot
+    uint16_t shutdownDrainMs = 2000; // Max time to drain outbound messages before sleep or reboot
+    uint16_t shutdownSettleMs = 500; // Time allowed for the MQTT offline message to be published
+
+    // MQTT store and forward. Set mqttStorage to store MQTT messages while the broker is unreachable
+    DashLogStorage *mqttStorage = nullptr; // e.g. new DashMemoryLogStorage(65536) or new DashPartitionLogStorage("dashlog")
+    uint32_t storeMaxAgeS = 0; // Stored messages older than this are discarded. 0 for no limit
+    bool storeNewestOnly = false; // Only keep the newest stored message for each control (except logs and time graphs)
+    uint8_t storeReplayBatch = 10; // Stored messages sent per replay interval once the broker is reachable
+    uint16_t storeReplayIntervalMs = 100;
+
+    // Dash store registrations (serial mode). When the master sends CTRL INIT with its config revision, CTRL STE registrations
+    // are kept in NVS and restored on the next CTRL INIT with the same revision, so the master doesn't have to send them again
+    uint16_t storeRegistrySize = 512; // Bytes. 0 to not keep registrations
+
+    // Master firmware update (serial mode). Set firmwareStorage to stage images sent to the FWU control over TCP or MQTT,
+    // then stream them to the master in acknowledged chunks
+    DashLogStorage *firmwareStorage = nullptr; // e.g. new DashPartitionLogStorage("dashfw")
+    uint16_t firmwareChunkSize = 512; // Image bytes per CTRL FWU DATA message
+    uint8_t firmwareWindow = 4; // Chunks sent ahead of the master's last ACK
+    uint32_t firmwareAckTimeoutMs = 1000;
+
+    // User message task (MODULE_MODE_DASH_DEVICE). When userTaskQueueLength > 0, processIncomingMessage is called from its own
+    // task instead of from the BLE, TCP and MQTT callbacks, so slow message processing doesn't hold up the connections
+    uint8_t userTaskQueueLength = 0;
+    UserQueueOverflow userQueueOverflow = USER_QUEUE_DROP_OLDEST;
+    BaseType_t userTaskCore = 0;
+    uint32_t userTaskStackSize = 4096;
+    UBaseType_t userTaskPriority = 1;
+    uint8_t userSendQueueLength = 8; // Messages sent from processIncomingMessage in the user task, waiting for run() to send them
+    uint32_t userSendWaitMs = 100; // Time the user task waits for a free send slot before dropping the message
 
     // Dash Sensor IO Board
     gpio_num_t sensorIOenable = GPIO_NUM_NC;
@@ -45,7 +152,8 @@ struct DashCommsConfig {
 // Defines
 #define MIN_BLE_TIMEOUT 20
 #define MAX_WORD 64
-#define MAX_BUFFER_SIZE 10000
+#define MAX_BUFFER_SIZE 10000 // Deprecated and no longer used. Buffers are sized from config.messageBufferSize
+#define MAX_COMMS_INSTANCES 4 // Number of DashCommsESP instances (e.g. one per serial master)
 
 // LED Defines
 #define MAX_LED_STATES 8
@@ -97,6 +205,50 @@ const char CLK[] = "CLK";
 const int CLKLEN = 3;
 const char DASHLEDS[] = "LED";
 const int DASHLEDSLEN = 3;
+const char DRAIN_OK[] = "OK";
+const int DRAIN_OKLEN = 2;
+const char DRAIN_TIMEOUT[] = "TIMEOUT";
+const int DRAIN_TIMEOUTLEN = 7;
+const char MIRROR[] = "MIR";
+const int MIRRORLEN = 3;
+const char JOIN[] = "JOIN";
+const int JOINLEN = 4;
+const char SUBSCRIBE[] = "SUB";
+const int SUBSCRIBELEN = 3;
+const char POLICY[] = "POL";
+const int POLICYLEN = 3;
+const char TRACE[] = "TRC";
+const int TRACELEN = 3;
+const char CLEAR[] = "CLR";
+const int CLEARLEN = 3;
+const char POOL[] = "POOL";
+const int POOLLEN = 4;
+const char PING[] = "PING";
+const int PINGLEN = 4;
+const char PONG[] = "PONG";
+const int PONGLEN = 4;
+const char LINK[] = "LINK";
+const int LINKLEN = 4;
+const char SERIAL_LINK[] = "SER";
+const int SERIAL_LINKLEN = 3;
+const char DELTA[] = "DLT";
+const int DELTALEN = 3;
+const char BOOT[] = "BOOT";
+const int BOOTLEN = 4;
+const char POWER[] = "PWR";
+const int POWERLEN = 3;
+const char EGRESS[] = "EGR";
+const int EGRESSLEN = 3;
+const char EGRESS_CLIENT[] = "CLNT";
+const char FIRMWARE[] = "FWU";
+const int FIRMWARELEN = 3;
+const char FIRMWARE_BEGIN[] = "BEGIN";
+const char FIRMWARE_DATA[] = "DATA";
+const char FIRMWARE_END[] = "END";
+const char FIRMWARE_OFFER[] = "OFFER";
+const char FIRMWARE_ACK[] = "ACK";
+const char FIRMWARE_ABORT[] = "ABORT";
+const char FIRMWARE_DONE[] = "DONE";
 
 const char DELIM_STR[] = "\t";
 const char END_DELIM_STR[] = "\n";
@@ -107,95 +259,289 @@ enum CommsModuleMode {
     MODULE_MODE_DASH_SERIAL
 };
 
+enum ShutdownAction {
+    SHUTDOWN_NONE,
+    SHUTDOWN_SLEEP,
+    SHUTDOWN_REBOOT
+};
+
+enum ShutdownStage {
+    SHUTDOWN_IDLE,
+    SHUTDOWN_DRAIN, // Waiting for outbound messages to be sent
+    SHUTDOWN_SETTLE // Offline message sent, waiting for it to be published
+};
+
+// Up to MAX_COMMS_INSTANCES instances can run together, e.g. one per serial master on separate UARTs.
+// BLE and WiFi (TCP and MQTT) each have a single owner: the first instance to ask for them in init(). Later instances
+// don't get their own BLE, TCP or MQTT connections, so in practice a second instance is a serial bridge for BLE or WiFi
+// only when the first doesn't use it. A build time board profile also belongs to the first instance only.
+// Destroying an instance stops its tasks, ends its connections and frees everything it allocated.
 class DashCommsESP {
 public:    
-    static DashCommsConfig config;
+    DashCommsConfig config;
 
-    static DashDevice *dashDevice;
-    static DashProvision *provisioning;
-    static DashWiFi *wifi;
-    static DashMQTT *mqtt_con;
-    static DashTCP *tcp_con;
-    static DashBLE *ble_con;
+    DashDevice *dashDevice = nullptr;
+    DashProvision *provisioning = nullptr;
+    DashWiFi *wifi = nullptr;
+    DashMQTT *mqtt_con = nullptr;
+    DashTCP *tcp_con = nullptr;
+    DashBLE *ble_con = nullptr;
 
     char currentChar = 0;
 
-    static bool isWiFiRunning;
-    static bool isBLE;
-    static bool isTCP;
-    static bool isMQTT;
+    bool isWiFiRunning = false;
+    bool isBLE = false;
+    bool isTCP = false;
+    bool isMQTT = false;
+
+    DashRingLog *mqttLog = nullptr; // Stored MQTT messages, when config.mqttStorage is set
+    DashUserTaskStats userTaskStats;
+    DashMessagePool messagePool;
+    DashBootTimeline bootTimeline;
 
     DashCommsESP();
     DashCommsESP(const char *type, const char *name);
     DashCommsESP(const char *type, const char *name, const char *configC64Str, unsigned int cfgRevision);
+    ~DashCommsESP();
 
-    static void sendControlMessage(const char* controlID = nullptr, const char* Payload = nullptr);
-    static void forwardMessageToSerial(MessageData *messageData);
+    void sendControlMessage(const char* controlID = nullptr, const char* Payload = nullptr);
+    void forwardMessageToSerial(MessageData *messageData);
 
     void sendMessageAll(const String& message);
-    static void sendMessage(const String& message, ConnectionType connectionType);
+    void sendMessage(const String& message, ConnectionType connectionType);
 
     static bool timerStopBLE(void *opaque);
 
     DashDevice * init(uint8_t numBLE, uint8_t numTCP, bool dashMQTT, void (*_processIncomingMessage)(MessageData *messageData) = nullptr);
-    static void setBLEtimeout(uint16_t timeout);
-    static void setLEDsTurnoff(uint16_t timeout);
+    DashDevice * init(uint8_t numBLE, uint8_t numTCP, bool dashMQTT, void (*_processIncomingMessage)(MessageData *messageData, void *context), void *context);
+    void setBLEtimeout(uint16_t timeout);
+    void setLEDsTurnoff(uint16_t timeout);
     void setBoardType(CommsBoardType boardType);
+
+    template <class Profile> void setBoardProfile() {
+        config.commsBoardType = Profile::boardType;
+        config.extWakeupPin = Profile::extWakeupPin;
+        config.bleButtonPin = Profile::bleButtonPin;
+        config.ledActiveLow = Profile::ledActiveLow;
+        config.ledPinWiFi = Profile::ledPinWiFi;
+        config.ledPinMQTT = Profile::ledPinMQTT;
+        config.ledPinTCP = Profile::ledPinTCP;
+        config.ledPinBLE = Profile::ledPinBLE;
+        config.serialTx = Profile::serialTx;
+        config.serialRx = Profile::serialRx;
+        config.sensorIOenable = Profile::sensorIOenable;
+    }
     void setBLEpassKey(uint32_t passKey);
     void begin();
     void run();
+    void shutdown(ShutdownAction action); // Graceful sleep or reboot. Completes from run()
 
     void enableRebootAlarm(bool enable);
     void sendAlarm(const String& controlID, const String& title, const String& description);
     void addDashStore(ControlType controlType, String controlID);
+    void dumpTrace(ConnectionType connectionType = SERIAL_CONN);
+    bool addPolicy(const char *controlType, const char *controlID, uint8_t bleRate, uint8_t tcpRate, uint8_t mqttRate);
+    void sendPolicyStats();
+    void sendPoolStats();
+    DashLinkStats linkStats(ProbeLink link);
+    void sendBootTimeline();
+    DashPowerStats powerStats(PowerRadio radio);
+    void sendPowerStats();
+    void sendLinkStats();
+    DashEgressStats tcpEgressStats(uint8_t client) { return tcpEgress.stats(client, millis()); }
+    void sendEgressStats();
+    FirmwareState firmwareState() { return (firmware != nullptr) ? firmware->state() : FIRMWARE_EMPTY; }
 
 private:
-    static bool initDone;
+    // The DashioESP connection callbacks have no context pointer, so each instance is given a slot with its own set of callback hooks
+    static DashCommsESP *instances[MAX_COMMS_INSTANCES];
+    static DashCommsESP *bleOwner; // NimBLE only supports one server, so only one instance may use BLE
+    static DashCommsESP *wifiOwner; // Only one instance may use WiFi (TCP and MQTT), as there is one station and one set of provisioning
+    int8_t instanceSlot = -1;
 
-    uint16_t mqttPORT;
-
-    static uint8_t uiStartupSequenceCounter;
-
-    static bool bleSwEnabled;
-    static uint16_t bleButtonTimeoutS;
-    static uint32_t bleCountdown;
-    static uint8_t buttonPressCount;
-
-    static bool ledsEnabled;
-    static uint16_t ledsOffTimeoutS;
-    static uint16_t ledsOffCountdown;
+    // Tasks check stopTasks at the top of their loop, so they never exit holding a lock, then notify stopWaiter
+    std::atomic<bool> stopTasks{false};
+    TaskHandle_t stopWaiter = nullptr;
+    void joinTasks();
+    void exitTask();
 
-    static uint8_t ledTimerCount;
+    bool initDone = false;
 
-    static CommsModuleMode moduleMode;
-    static bool serialInitDone;
-    static uint8_t sendRebootCount;
+    uint16_t mqttPORT;
 
-    static void (*processIncomingMessage)(MessageData *messageData);
-    static void interceptIncomingMessage(MessageData *messageData);
+    uint8_t uiStartupSequenceCounter = 0;
+
+    bool bleSwEnabled = false;
+    uint16_t bleButtonTimeoutS = 0;
+    uint32_t bleCountdown = 0;
+    uint8_t buttonPressCount = 0;
+
+    bool ledsEnabled = true;
+    uint16_t ledsOffTimeoutS = 0;
+    uint16_t ledsOffCountdown = 0;
+
+    uint8_t ledTimerCount = 0;
+
+    CommsModuleMode moduleMode = MODULE_MODE_DASH_DEVICE;
+    bool serialInitDone = false;
+    uint8_t sendRebootCount = 0;
+
+    void (*processIncomingMessage)(MessageData *messageData) = nullptr;
+    void (*processIncomingMessageContext)(MessageData *messageData, void *context) = nullptr;
+    void *processIncomingContext = nullptr;
+    void interceptIncomingMessage(MessageData *messageData);
+    void callUserMessage(MessageData *messageData);
+    bool isPrimaryDevice(const String& deviceID);
+
+    MessageData *userMessagePool = nullptr; // Preallocated, so queueing reuses their String buffers
+    uint32_t *userMessageQueuedUs = nullptr;
+    QueueHandle_t userFreeQueue = nullptr; // Indexes of free userMessagePool slots
+    QueueHandle_t userReadyQueue = nullptr; // Indexes of userMessagePool slots waiting for the user task
+    TaskHandle_t userTaskHandle = nullptr;
+    static const uint8_t USER_TASK_STOP = 0xFF; // Sent to userReadyQueue to wake the task so it can exit
+    void startUserTask();
+    void queueUserMessage(MessageData *messageData);
+    void runUserTask();
+
+    // Messages sent from the user task are passed to run(), so the connections are only used from one task
+    struct DashUserSend {
+        String message;
+        ConnectionType connectionType;
+        bool all; // sendMessageAll
+    };
+    DashUserSend *userSendPool = nullptr; // Preallocated, so queueing reuses their String buffers
+    QueueHandle_t userSendFreeQueue = nullptr;
+    QueueHandle_t userSendReadyQueue = nullptr;
+    bool inUserTask() { return (userTaskHandle != nullptr) && (xTaskGetCurrentTaskHandle() == userTaskHandle); }
+    void queueUserSend(const String& message, ConnectionType connectionType, bool all);
+    void runUserSends();
+    static void userMessageTask(void *parameters);
 
     int serialRecieveBufferIndex = 0;
-    char *serialReceiveBuffer;
-    char *serialTransmitBuffer;
-    char *messageBuffer; // For incoming messages
-    char *configC64; // For storing the config to memory when provided by the master
-
+    bool serialReceiveOverflow = false;
+    char *receiveBuffer = nullptr; // Where incoming UART bytes are written
+    char *messageBuffer = nullptr; // For incoming messages. Parsed in place once END_DELIM is received
+    uint32_t messageLength = 0; // Of messageBuffer, before parseMessage() splits it into tokens
+    void readSerial();
+    void runConnections();
+
+    // Pipeline. The radio task owns the connections and everything parseMessage() uses. run() only owns receiveBuffer
+    char *pipelineBuffers = nullptr; // pipelineSlots message buffers
+    uint8_t receiveSlot = 0;
+    DashSlotQueue freeSlots; // Radio task -> run()
+    DashSlotQueue readySlots; // run() -> radio task
+    TaskHandle_t radioTaskHandle = nullptr;
+    void startPipeline();
+    void runRadio();
+    static void radioTask(void *parameters);
+
+    // TCP egress. Used in place of tcp_con (which is then nullptr) when config.tcpEgressSize > 0. Owned by the same task
+    // as the other connections, so it needs no locks
+    DashTcpEgress tcpEgress;
+    MessageData tcpReceived[MAX_EGRESS_CLIENTS]; // Incoming message for each client
+    void startTcpEgress(uint8_t numTCP);
+    bool hasTCP();
+    void listenTCP();
+    void sendTCP(const String& message);
+    static void tcpReceive(uint8_t client, const char *data, uint32_t len, void *context);
+    static void tcpEvent(uint8_t client, DashEgressEvent event, void *context);
+
+    char *serialTransmitBuffer = nullptr;
+
+    bool mirrorEnabled = false; // Set by the master (CTRL MIR) to have STATUS requests answered from the mirror
+    DashControlMirror mirror;
+    bool replyFromMirror(MessageData *messageData);
+
+    DashPolicyTable policies; // Outbound transports and rate limits per control
+    static uint8_t parsePolicyRate(const char *token);
+
+    DashSubscriptionFilter filter; // Set by the master (CTRL SUB) to limit what is forwarded to it
+
+    DashRouteTable routes; // Devices (serial masters) behind this comms module. The first is always dashDevice's device ID
+    DashRoute *addRoute(const char *deviceID);
+    void removeRoute(DashRoute *route);
+
+    void registerInstance();
     void setHardwareConfig();
-    static void onProvisionCallback(ConnectionType connectionType, const String& message, bool commsChanged);
-    static void statusCallback(StatusCode statusCode);
+    void logMemoryBudget();
+    void reloadProvisioning();
+    void onProvisionCallback(ConnectionType connectionType, const String& message, bool commsChanged);
+    void statusCallback(StatusCode statusCode);
     void parseMessage();
-    void sendNmlMessage(char *token, char *deviceID, ConnectionType connectionType);
-
-    static void startBLE();
-    static void stopBLE();
-    static void startWiFi(bool alowRestart = false);
-    static void stopWiFi();
-    static void startTCP();
-    static void stopTCP();
-    static void startMQTT();
-    static void stopMQTT();
-    static void sleep();
-
-    static void updateLED(gpio_num_t pin, uint8_t state);
+    void sendNmlMessage(char *token, DashRoute *route, ConnectionType connectionType);
+    void sendRoutedMessage(const String& message, ConnectionType connectionType, bool isPrimary);
+
+    void startBLE();
+    void stopBLE();
+    void startWiFi(bool alowRestart = false);
+    void stopWiFi();
+    void startTCP();
+    void stopTCP();
+    void startMQTT();
+    void stopMQTT();
+    ShutdownAction shutdownAction = SHUTDOWN_NONE;
+    ShutdownStage shutdownStage = SHUTDOWN_IDLE;
+    unsigned long shutdownStartMs = 0;
+    unsigned long settleStartMs = 0;
+    bool drainTimedOut = false;
+
+    char *storeBuffer = nullptr; // For replaying stored MQTT messages
+
+    SemaphoreHandle_t startupDone = nullptr;
+    void runInParallel(TaskFunction_t task);
+    void waitForParallel();
+    static void openStoreTask(void *parameters);
+    static void startBLETask(void *parameters);
+    void checkBootDone();
+
+    DashDeltaTable deltaStreams;
+    void addDeltaStream(DashRoute *route);
+    void sendDeltaMessage(DashRoute *route, ConnectionType connectionType);
+
+    DashLinkProbe linkProbes[NUM_PROBE_LINKS];
+    uint32_t lastPingMs = 0;
+    void sendPing();
+    uint32_t probeStart() { return config.probeRadios ? (uint32_t)esp_timer_get_time() : 0; }
+    void sendDone(ProbeLink link, uint32_t startUs);
+
+    DashStoreRegistry storeRegistry;
+    bool registryActive = false; // The master gave a config revision with CTRL INIT
+    void parseDashStores();
+    void restoreDashStores(uint32_t revision);
+
+    DashFirmwareTransfer *firmware = nullptr; // When config.firmwareStorage is set
+    uint8_t *firmwareChunk = nullptr;
+    void startFirmware();
+    bool receiveFirmware(MessageData *messageData);
+    void replyFirmware(const char *result, ConnectionType connectionType);
+    void offerFirmware();
+    void parseFirmwareCommand();
+    void sendFirmware();
+
+    DashPowerManager power;
+    bool lightSleepEnabled = false;
+    void runPower();
+    void applyPowerMode(PowerRadio radio, PowerMode mode);
+    void setLightSleep(bool enable);
+    unsigned long lastReplayMs = 0;
+    const String& policyMessage(const String& message, PolicyTransport transport, DashMessageSlot& filtered); // The lines of message allowed on transport
+    void sendMQTT(const String& message);
+    void storeMQTT(const String& message);
+    void replayMQTT();
+
+    bool outboundPending();
+    void runShutdown();
+    void sleep();
+
+    void updateLED(gpio_num_t pin, uint8_t state);
+    void userInterface();
+    TaskHandle_t uiTaskHandle = nullptr;
     static void userInterfaceTask(void *parameters);
+
+    template <uint8_t slot> static void incomingMessageHook(MessageData *messageData);
+    template <uint8_t slot> static void statusHook(StatusCode statusCode);
+    template <uint8_t slot> static void provisionHook(ConnectionType connectionType, const String& message, bool commsChanged);
+    static void (* const incomingMessageHooks[MAX_COMMS_INSTANCES])(MessageData *messageData);
+    static void (* const statusHooks[MAX_COMMS_INSTANCES])(StatusCode statusCode);
+    static void (* const provisionHooks[MAX_COMMS_INSTANCES])(ConnectionType connectionType, const String& message, bool commsChanged);
 };
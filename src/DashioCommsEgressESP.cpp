@@ -0,0 +1,298 @@
+#include <DashioCommsEgressESP.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+
+#ifdef MSG_NOSIGNAL
+#define EGRESS_SEND_FLAGS (MSG_DONTWAIT | MSG_NOSIGNAL) // A closed client is an error, not SIGPIPE
+#else
+#define EGRESS_SEND_FLAGS MSG_DONTWAIT
+#endif
+
+DashEgressBuffer::~DashEgressBuffer() {
+    delete[] buffer;
+}
+
+void DashEgressBuffer::begin(uint32_t size) {
+    buffer = new char[size];
+    bufferSize = size;
+}
+
+bool DashEgressBuffer::push(const char *data, uint32_t len) {
+    if (backlog() + len > bufferSize) {
+        return false;
+    }
+
+    uint32_t offset = head % bufferSize;
+    uint32_t firstLen = bufferSize - offset;
+    if (firstLen > len) {
+        firstLen = len;
+    }
+    memcpy(&buffer[offset], data, firstLen);
+    memcpy(buffer, data + firstLen, len - firstLen);
+    head += len;
+    return true;
+}
+
+const char *DashEgressBuffer::peek(uint32_t *len) {
+    uint32_t offset = tail % bufferSize;
+    *len = backlog();
+    if (*len > bufferSize - offset) {
+        *len = bufferSize - offset; // The rest has wrapped to the start of the buffer
+    }
+    return &buffer[offset];
+}
+
+void DashEgressBuffer::consume(uint32_t len) {
+    tail += len;
+}
+
+void DashEgressBuffer::clear() {
+    tail = head;
+}
+
+DashTcpEgress::~DashTcpEgress() {
+    stop();
+}
+
+void DashTcpEgress::begin(uint8_t numClients, uint32_t bufferSize) {
+    maxClients = (numClients < MAX_EGRESS_CLIENTS) ? numClients : MAX_EGRESS_CLIENTS;
+    for (uint8_t i = 0; i < maxClients; i++) {
+        clients[i].buffer.begin(bufferSize);
+    }
+}
+
+void DashTcpEgress::setCallbacks(void (*receive)(uint8_t client, const char *data, uint32_t len, void *context),
+                                 void (*event)(uint8_t client, DashEgressEvent event, void *context), void *context) {
+    receiveCallback = receive;
+    eventCallback = event;
+    callbackContext = context;
+}
+
+bool DashTcpEgress::listen(uint16_t port) {
+    if (serverFd >= 0) {
+        return true;
+    }
+
+    serverFd = socket(AF_INET, SOCK_STREAM, 0);
+    if (serverFd < 0) {
+        return false;
+    }
+    int enable = 1;
+    setsockopt(serverFd, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable));
+
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_ANY);
+    address.sin_port = htons(port);
+    if ((bind(serverFd, (struct sockaddr *)&address, sizeof(address)) < 0) || (::listen(serverFd, maxClients) < 0)) {
+        ::close(serverFd);
+        serverFd = -1;
+        return false;
+    }
+    fcntl(serverFd, F_SETFL, fcntl(serverFd, F_GETFL, 0) | O_NONBLOCK);
+    return true;
+}
+
+uint16_t DashTcpEgress::port() {
+    struct sockaddr_in address;
+    socklen_t addressLen = sizeof(address);
+    if ((serverFd < 0) || (getsockname(serverFd, (struct sockaddr *)&address, &addressLen) < 0)) {
+        return 0;
+    }
+    return ntohs(address.sin_port);
+}
+
+void DashTcpEgress::stop() {
+    for (uint8_t i = 0; i < maxClients; i++) {
+        if (clients[i].fd >= 0) {
+            close(i, EGRESS_DISCONNECTED);
+        }
+    }
+    if (serverFd >= 0) {
+        ::close(serverFd);
+        serverFd = -1;
+    }
+}
+
+void DashTcpEgress::run(uint32_t nowMs) {
+    if (serverFd < 0) {
+        return;
+    }
+
+    acceptClients(nowMs);
+    for (uint8_t i = 0; i < maxClients; i++) {
+        Client& client = clients[i];
+        if (client.fd < 0) {
+            continue;
+        }
+        if (!receive(i)) {
+            close(i, EGRESS_DISCONNECTED);
+            continue;
+        }
+        if (client.fd < 0) {
+            continue; // Closed while handling what it sent
+        }
+        if (!write(client, nowMs)) {
+            close(i, EGRESS_DISCONNECTED);
+        } else if (stallMs(client, nowMs) > evictMs) {
+            numEvictions++;
+            close(i, EGRESS_EVICTED);
+        }
+    }
+}
+
+void DashTcpEgress::send(const char *data, uint32_t len, uint32_t nowMs) {
+    for (uint8_t i = 0; i < maxClients; i++) {
+        Client& client = clients[i];
+        if (client.fd < 0) {
+            continue;
+        }
+        if (client.buffer.backlog() == 0) {
+            client.lastProgressMs = nowMs; // Stall time only counts while there is something to write
+        }
+        if ((stallMs(client, nowMs) > degradeMs) || !client.buffer.push(data, len)) {
+            client.stats.droppedMessages++;
+            continue;
+        }
+        if (client.buffer.backlog() > client.stats.peakBacklog) {
+            client.stats.peakBacklog = client.buffer.backlog();
+        }
+        if (!write(client, nowMs)) {
+            close(i, EGRESS_DISCONNECTED);
+        }
+    }
+}
+
+void DashTcpEgress::acceptClients(uint32_t nowMs) {
+    while (true) {
+        int fd = accept(serverFd, nullptr, nullptr);
+        if (fd < 0) {
+            return; // No more waiting
+        }
+
+        uint8_t i = 0;
+        while ((i < maxClients) && (clients[i].fd >= 0)) {
+            i++;
+        }
+        if (i >= maxClients) {
+            ::close(fd); // All client slots in use
+            continue;
+        }
+
+        fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+        int enable = 1;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &enable, sizeof(enable)); // Writes are already combined
+        Client& client = clients[i];
+        client.fd = fd;
+        client.buffer.clear();
+        client.lastProgressMs = nowMs;
+        client.stats = DashEgressStats();
+        client.stats.connected = true;
+        if (eventCallback != nullptr) {
+            eventCallback(i, EGRESS_CONNECTED, callbackContext);
+        }
+    }
+}
+
+bool DashTcpEgress::receive(uint8_t client) {
+    char data[256];
+    while (true) {
+        ssize_t len = recv(clients[client].fd, data, sizeof(data), MSG_DONTWAIT);
+        if (len > 0) {
+            if (receiveCallback != nullptr) {
+                receiveCallback(client, data, len, callbackContext);
+            }
+        } else if (len == 0) {
+            return false; // Closed by the client
+        } else {
+            return (errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR);
+        }
+        if (clients[client].fd < 0) {
+            return true; // Closed from the callback
+        }
+    }
+}
+
+bool DashTcpEgress::write(Client& client, uint32_t nowMs) {
+    while (client.buffer.backlog() > 0) {
+        uint32_t len;
+        const char *data = client.buffer.peek(&len);
+        if (len > maxWrite) {
+            len = maxWrite;
+        }
+        ssize_t sent = ::send(client.fd, data, len, EGRESS_SEND_FLAGS);
+        if (sent < 0) {
+            if ((errno == EAGAIN) || (errno == EWOULDBLOCK) || (errno == EINTR)) {
+                break; // Socket full. The rest is written from a later run() or send()
+            }
+            return false;
+        }
+        client.buffer.consume(sent);
+        client.lastProgressMs = nowMs;
+        client.stats.sentBytes += sent;
+        client.stats.writes++;
+        if ((uint32_t)sent < len) {
+            break;
+        }
+    }
+
+    uint32_t stall = stallMs(client, nowMs);
+    if (stall > client.stats.maxStallMs) {
+        client.stats.maxStallMs = stall;
+    }
+    return true;
+}
+
+uint32_t DashTcpEgress::stallMs(Client& client, uint32_t nowMs) {
+    return (client.buffer.backlog() > 0) ? nowMs - client.lastProgressMs : 0;
+}
+
+void DashTcpEgress::close(uint8_t client, DashEgressEvent event) {
+    if (event == EGRESS_EVICTED) {
+        struct linger abort = {1, 0}; // Reset rather than wait for the unsent data
+        setsockopt(clients[client].fd, SOL_SOCKET, SO_LINGER, &abort, sizeof(abort));
+    }
+    ::close(clients[client].fd);
+    clients[client].fd = -1;
+    clients[client].buffer.clear();
+    clients[client].stats.connected = false;
+    if (eventCallback != nullptr) {
+        eventCallback(client, event, callbackContext);
+    }
+}
+
+uint8_t DashTcpEgress::numClients() {
+    uint8_t count = 0;
+    for (uint8_t i = 0; i < maxClients; i++) {
+        if (clients[i].fd >= 0) {
+            count++;
+        }
+    }
+    return count;
+}
+
+bool DashTcpEgress::pending() {
+    for (uint8_t i = 0; i < maxClients; i++) {
+        if ((clients[i].fd >= 0) && (clients[i].buffer.backlog() > 0)) {
+            return true;
+        }
+    }
+    return false;
+}
+
+DashEgressStats DashTcpEgress::stats(uint8_t client, uint32_t nowMs) {
+    DashEgressStats clientStats;
+    if (client < maxClients) {
+        clientStats = clients[client].stats;
+        clientStats.backlog = clients[client].buffer.backlog();
+        clientStats.stallMs = stallMs(clients[client], nowMs);
+        clientStats.degraded = clientStats.connected && (clientStats.stallMs > degradeMs);
+    }
+    return clientStats;
+}
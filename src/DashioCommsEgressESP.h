@@ -0,0 +1,101 @@
+#ifndef DASHIO_COMMS_EGRESS_ESP_H
+#define DASHIO_COMMS_EGRESS_ESP_H
+
+// TCP server with a bounded outbound buffer per client, so a slow or stalled client can't hold up the caller or the other
+// clients. Sockets are non-blocking. Messages are queued for each client and written out in aggregated chunks whenever
+// that client's socket has room. Only depends on the C library and BSD sockets (lwIP on the ESP32), so it also builds on a host.
+// Not thread safe. send() and run() must be called from the same task.
+
+#include <stdint.h>
+
+#define MAX_EGRESS_CLIENTS 4
+
+struct DashEgressStats { // For one client
+    bool connected = false;
+    uint32_t backlog = 0; // Bytes waiting to be written
+    uint32_t peakBacklog = 0;
+    uint32_t sentBytes = 0;
+    uint32_t writes = 0;
+    uint32_t droppedMessages = 0; // Buffer full, or degraded
+    uint32_t stallMs = 0; // Time since the socket last took any data, while there is a backlog
+    uint32_t maxStallMs = 0;
+    bool degraded = false; // Stalled for longer than degradeMs, so new messages are dropped
+};
+
+enum DashEgressEvent {
+    EGRESS_CONNECTED,
+    EGRESS_DISCONNECTED, // Closed by the client, or a socket error
+    EGRESS_EVICTED // Stalled for longer than evictMs
+};
+
+// Ring of whole messages for one client
+class DashEgressBuffer {
+public:
+    ~DashEgressBuffer();
+
+    void begin(uint32_t size);
+    bool push(const char *data, uint32_t len); // Whole message or nothing. Returns false if full
+    const char *peek(uint32_t *len); // Oldest bytes that are contiguous in the buffer
+    void consume(uint32_t len);
+    void clear();
+    uint32_t backlog() { return head - tail; }
+
+private:
+    char *buffer = nullptr;
+    uint32_t bufferSize = 0;
+    uint32_t head = 0; // Free running byte counts
+    uint32_t tail = 0;
+};
+
+class DashTcpEgress {
+public:
+    ~DashTcpEgress();
+
+    void begin(uint8_t numClients, uint32_t bufferSize); // Allocates bufferSize bytes per client
+    bool active() { return maxClients > 0; }
+    void setCallbacks(void (*receive)(uint8_t client, const char *data, uint32_t len, void *context),
+                      void (*event)(uint8_t client, DashEgressEvent event, void *context), void *context);
+
+    bool listen(uint16_t port); // Port 0 picks a free port. Returns false if the server socket can't be opened
+    bool listening() { return serverFd >= 0; }
+    uint16_t port(); // That the server is listening on
+    void stop(); // Closes the server and all clients
+
+    void run(uint32_t nowMs); // Accepts clients, reads from them, writes their backlogs and evicts stalled clients
+    void send(const char *data, uint32_t len, uint32_t nowMs); // Queues for every client, then writes what each socket takes. Never blocks
+
+    uint8_t numClients();
+    bool pending(); // Any client has a backlog
+    DashEgressStats stats(uint8_t client, uint32_t nowMs);
+    uint8_t clientCount() { return maxClients; } // Client slots, for stats()
+    uint32_t evictions() { return numEvictions; }
+
+    uint16_t maxWrite = 1436; // Largest write. Queued messages are combined up to this size
+    uint32_t degradeMs = 1000; // New messages for a client are dropped while it has been stalled for longer than this
+    uint32_t evictMs = 5000; // A client is disconnected after being stalled for longer than this
+
+private:
+    struct Client {
+        int fd = -1;
+        DashEgressBuffer buffer;
+        uint32_t lastProgressMs = 0; // Last write, or when the backlog started
+        DashEgressStats stats;
+    };
+
+    Client clients[MAX_EGRESS_CLIENTS];
+    uint8_t maxClients = 0;
+    int serverFd = -1;
+    uint32_t numEvictions = 0;
+
+    void (*receiveCallback)(uint8_t client, const char *data, uint32_t len, void *context) = nullptr;
+    void (*eventCallback)(uint8_t client, DashEgressEvent event, void *context) = nullptr;
+    void *callbackContext = nullptr;
+
+    void acceptClients(uint32_t nowMs);
+    bool receive(uint8_t client);
+    bool write(Client& client, uint32_t nowMs); // Returns false on a socket error
+    uint32_t stallMs(Client& client, uint32_t nowMs);
+    void close(uint8_t client, DashEgressEvent event);
+};
+
+#endif
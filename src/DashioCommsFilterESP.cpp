@@ -0,0 +1,75 @@
+#include <DashioCommsFilterESP.h>
+#include <DashioCommsHashESP.h>
+
+uint32_t DashSubscriptionFilter::controlHash(ControlType controlType, const char *controlID, int len) {
+    uint32_t hashVal = dashHash(controlID, len, 2166136261UL ^ ((uint32_t)controlType * 16777619UL));
+    if (hashVal == 0) {
+        hashVal = 1; // 0 marks an empty slot
+    }
+    return hashVal;
+}
+
+void DashSubscriptionFilter::addType(ControlType controlType) {
+    if ((uint32_t)controlType < 64) {
+        enabled = true;
+        typeMask |= (1ULL << controlType);
+    }
+}
+
+bool DashSubscriptionFilter::addControl(ControlType controlType, const char *controlID) {
+    if ((uint32_t)controlType >= 64) {
+        return false;
+    }
+    enabled = true;
+    idTypeMask |= (1ULL << controlType);
+
+    uint32_t hashVal = controlHash(controlType, controlID, strlen(controlID));
+    for (uint8_t i = 0; i < FILTER_TABLE_SIZE; i++) {
+        uint8_t index = (hashVal + i) & (FILTER_TABLE_SIZE - 1);
+        if (idHashes[index] == hashVal) {
+            return true;
+        }
+        if (idHashes[index] == 0) {
+            if (numControlIDs >= MAX_FILTER_CONTROL_IDS) {
+                return false;
+            }
+            idHashes[index] = hashVal;
+            numControlIDs++;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool DashSubscriptionFilter::isSubscribed(ControlType controlType, const String& controlID) {
+    if (!enabled) {
+        return true;
+    }
+    if ((uint32_t)controlType >= 64) {
+        return false;
+    }
+    if (typeMask & (1ULL << controlType)) {
+        return true;
+    }
+    if (idTypeMask & (1ULL << controlType)) {
+        uint32_t hashVal = controlHash(controlType, controlID.c_str(), controlID.length());
+        for (uint8_t i = 0; i < FILTER_TABLE_SIZE; i++) {
+            uint8_t index = (hashVal + i) & (FILTER_TABLE_SIZE - 1);
+            if (idHashes[index] == hashVal) {
+                return true;
+            }
+            if (idHashes[index] == 0) {
+                return false;
+            }
+        }
+    }
+    return false;
+}
+
+void DashSubscriptionFilter::clear() {
+    enabled = false;
+    typeMask = 0;
+    idTypeMask = 0;
+    memset(idHashes, 0, sizeof(idHashes));
+    numControlIDs = 0;
+}
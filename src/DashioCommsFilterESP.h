@@ -0,0 +1,29 @@
+#ifndef DASHIO_COMMS_FILTER_ESP_H
+#define DASHIO_COMMS_FILTER_ESP_H
+
+#include <Arduino.h>
+#include <DashioESP.h>
+
+#define MAX_FILTER_CONTROL_IDS 64
+#define FILTER_TABLE_SIZE 128 // Must be a power of 2, and at least twice MAX_FILTER_CONTROL_IDS
+
+// Control types and control IDs the serial master wants forwarded. Until something is added, everything is forwarded.
+class DashSubscriptionFilter {
+public:
+    void addType(ControlType controlType);
+    bool addControl(ControlType controlType, const char *controlID); // Returns false if the table is full
+    bool isSubscribed(ControlType controlType, const String& controlID);
+    void clear();
+    bool isEnabled() { return enabled; }
+
+private:
+    bool enabled = false;
+    uint64_t typeMask = 0; // Types with all control IDs subscribed
+    uint64_t idTypeMask = 0; // Types with only some control IDs subscribed
+    uint32_t idHashes[FILTER_TABLE_SIZE] = {0}; // 0 for an empty slot. Hash collisions just forward an extra message
+    uint8_t numControlIDs = 0;
+
+    static uint32_t controlHash(ControlType controlType, const char *controlID, int len);
+};
+
+#endif
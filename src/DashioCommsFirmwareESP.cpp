@@ -0,0 +1,419 @@
+#include <DashioCommsFirmwareESP.h>
+
+#ifdef ESP_PLATFORM
+#include <mbedtls/base64.h>
+#endif
+
+// ---------------------------------------- SHA-256 ----------------------------------------
+
+#ifdef ESP_PLATFORM
+
+DashSha256::DashSha256() {
+    mbedtls_sha256_init(&context);
+    reset();
+}
+
+DashSha256::~DashSha256() {
+    mbedtls_sha256_free(&context);
+}
+
+void DashSha256::reset() {
+    mbedtls_sha256_starts(&context, 0); // 0 for SHA-256, not SHA-224
+}
+
+void DashSha256::update(const uint8_t *data, uint32_t len) {
+    mbedtls_sha256_update(&context, data, len);
+}
+
+void DashSha256::finish(uint8_t *hash) {
+    mbedtls_sha256_finish(&context, hash);
+}
+
+#else
+
+DashSha256::DashSha256() {
+    reset();
+}
+
+DashSha256::~DashSha256() {
+}
+
+static const uint32_t SHA256_K[64] = {
+    0x428a2f98, 0x71374491, 0xb5c0fbcf, 0xe9b5dba5, 0x3956c25b, 0x59f111f1, 0x923f82a4, 0xab1c5ed5,
+    0xd807aa98, 0x12835b01, 0x243185be, 0x550c7dc3, 0x72be5d74, 0x80deb1fe, 0x9bdc06a7, 0xc19bf174,
+    0xe49b69c1, 0xefbe4786, 0x0fc19dc6, 0x240ca1cc, 0x2de92c6f, 0x4a7484aa, 0x5cb0a9dc, 0x76f988da,
+    0x983e5152, 0xa831c66d, 0xb00327c8, 0xbf597fc7, 0xc6e00bf3, 0xd5a79147, 0x06ca6351, 0x14292967,
+    0x27b70a85, 0x2e1b2138, 0x4d2c6dfc, 0x53380d13, 0x650a7354, 0x766a0abb, 0x81c2c92e, 0x92722c85,
+    0xa2bfe8a1, 0xa81a664b, 0xc24b8b70, 0xc76c51a3, 0xd192e819, 0xd6990624, 0xf40e3585, 0x106aa070,
+    0x19a4c116, 0x1e376c08, 0x2748774c, 0x34b0bcb5, 0x391c0cb3, 0x4ed8aa4a, 0x5b9cca4f, 0x682e6ff3,
+    0x748f82ee, 0x78a5636f, 0x84c87814, 0x8cc70208, 0x90befffa, 0xa4506ceb, 0xbef9a3f7, 0xc67178f2
+};
+
+static inline uint32_t rotr(uint32_t x, uint8_t n) {
+    return (x >> n) | (x << (32 - n));
+}
+
+void DashSha256::reset() {
+    const uint32_t initial[8] = {0x6a09e667, 0xbb67ae85, 0x3c6ef372, 0xa54ff53a, 0x510e527f, 0x9b05688c, 0x1f83d9ab, 0x5be0cd19};
+    memcpy(state, initial, sizeof(state));
+    numBytes = 0;
+}
+
+void DashSha256::transform(const uint8_t *data) {
+    uint32_t w[64];
+    for (uint8_t i = 0; i < 16; i++) {
+        w[i] = ((uint32_t)data[i * 4] << 24) | ((uint32_t)data[i * 4 + 1] << 16) | ((uint32_t)data[i * 4 + 2] << 8) | data[i * 4 + 3];
+    }
+    for (uint8_t i = 16; i < 64; i++) {
+        uint32_t s0 = rotr(w[i - 15], 7) ^ rotr(w[i - 15], 18) ^ (w[i - 15] >> 3);
+        uint32_t s1 = rotr(w[i - 2], 17) ^ rotr(w[i - 2], 19) ^ (w[i - 2] >> 10);
+        w[i] = w[i - 16] + s0 + w[i - 7] + s1;
+    }
+
+    uint32_t a = state[0], b = state[1], c = state[2], d = state[3], e = state[4], f = state[5], g = state[6], h = state[7];
+    for (uint8_t i = 0; i < 64; i++) {
+        uint32_t t1 = h + (rotr(e, 6) ^ rotr(e, 11) ^ rotr(e, 25)) + ((e & f) ^ (~e & g)) + SHA256_K[i] + w[i];
+        uint32_t t2 = (rotr(a, 2) ^ rotr(a, 13) ^ rotr(a, 22)) + ((a & b) ^ (a & c) ^ (b & c));
+        h = g;
+        g = f;
+        f = e;
+        e = d + t1;
+        d = c;
+        c = b;
+        b = a;
+        a = t1 + t2;
+    }
+    state[0] += a;
+    state[1] += b;
+    state[2] += c;
+    state[3] += d;
+    state[4] += e;
+    state[5] += f;
+    state[6] += g;
+    state[7] += h;
+}
+
+void DashSha256::update(const uint8_t *data, uint32_t len) {
+    uint8_t used = numBytes & 63;
+    numBytes += len;
+    while (len > 0) {
+        uint32_t copyLen = 64 - used;
+        if (copyLen > len) {
+            copyLen = len;
+        }
+        memcpy(block + used, data, copyLen);
+        used += copyLen;
+        data += copyLen;
+        len -= copyLen;
+        if (used == 64) {
+            transform(block);
+            used = 0;
+        }
+    }
+}
+
+void DashSha256::finish(uint8_t *hash) {
+    uint64_t numBits = numBytes * 8;
+    uint8_t pad = 0x80;
+    update(&pad, 1);
+    pad = 0;
+    while ((numBytes & 63) != 56) {
+        update(&pad, 1);
+    }
+    uint8_t length[8];
+    for (uint8_t i = 0; i < 8; i++) {
+        length[i] = numBits >> (56 - i * 8);
+    }
+    update(length, 8);
+    for (uint8_t i = 0; i < 32; i++) {
+        hash[i] = state[i / 4] >> (24 - (i % 4) * 8);
+    }
+}
+
+#endif
+
+// ---------------------------------------- Base 64 and Hex ----------------------------------------
+
+#ifdef ESP_PLATFORM
+
+uint32_t dashBase64Encode(const uint8_t *data, uint32_t len, char *text) {
+    size_t textLen = 0;
+    if (mbedtls_base64_encode((unsigned char *)text, 4 * ((len + 2) / 3) + 1, &textLen, data, len) != 0) {
+        textLen = 0;
+    }
+    text[textLen] = '\0';
+    return textLen;
+}
+
+int32_t dashBase64Decode(const char *text, uint8_t *data, uint32_t maxLen) {
+    size_t len = 0;
+    if (mbedtls_base64_decode(data, maxLen, &len, (const unsigned char *)text, strlen(text)) != 0) {
+        return -1;
+    }
+    return len;
+}
+
+#else
+
+static const char BASE64_DIGITS[] = "ABCDEFGHIJKLMNOPQRSTUVWXYZabcdefghijklmnopqrstuvwxyz0123456789+/";
+
+uint32_t dashBase64Encode(const uint8_t *data, uint32_t len, char *text) {
+    uint32_t textLen = 0;
+    for (uint32_t i = 0; i < len; i += 3) {
+        uint32_t group = (uint32_t)data[i] << 16;
+        if (i + 1 < len) {
+            group |= (uint32_t)data[i + 1] << 8;
+        }
+        if (i + 2 < len) {
+            group |= data[i + 2];
+        }
+        text[textLen++] = BASE64_DIGITS[(group >> 18) & 0x3F];
+        text[textLen++] = BASE64_DIGITS[(group >> 12) & 0x3F];
+        text[textLen++] = (i + 1 < len) ? BASE64_DIGITS[(group >> 6) & 0x3F] : '=';
+        text[textLen++] = (i + 2 < len) ? BASE64_DIGITS[group & 0x3F] : '=';
+    }
+    text[textLen] = '\0';
+    return textLen;
+}
+
+int32_t dashBase64Decode(const char *text, uint8_t *data, uint32_t maxLen) {
+    uint32_t len = 0;
+    uint32_t group = 0;
+    uint8_t numDigits = 0;
+    for (; *text && (*text != '='); text++) {
+        const char *digit = strchr(BASE64_DIGITS, *text);
+        if (digit == nullptr) {
+            return -1;
+        }
+        group = (group << 6) | (digit - BASE64_DIGITS);
+        if (++numDigits == 4) {
+            if (len + 3 > maxLen) {
+                return -1;
+            }
+            data[len++] = group >> 16;
+            data[len++] = group >> 8;
+            data[len++] = group;
+            group = 0;
+            numDigits = 0;
+        }
+    }
+    if (numDigits == 1) {
+        return -1;
+    } else if (numDigits > 1) {
+        if (len + numDigits - 1 > maxLen) {
+            return -1;
+        }
+        group <<= 6 * (4 - numDigits);
+        data[len++] = group >> 16;
+        if (numDigits == 3) {
+            data[len++] = group >> 8;
+        }
+    }
+    return len;
+}
+
+#endif
+
+void dashHexEncode(const uint8_t *data, uint32_t len, char *text) {
+    const char hexDigits[] = "0123456789abcdef";
+    for (uint32_t i = 0; i < len; i++) {
+        text[i * 2] = hexDigits[data[i] >> 4];
+        text[i * 2 + 1] = hexDigits[data[i] & 0x0F];
+    }
+    text[len * 2] = '\0';
+}
+
+bool dashHexDecode(const char *text, uint8_t *data, uint32_t len) {
+    if (strlen(text) != len * 2) {
+        return false;
+    }
+    for (uint32_t i = 0; i < len * 2; i++) {
+        char c = text[i];
+        uint8_t nibble;
+        if ((c >= '0') && (c <= '9')) {
+            nibble = c - '0';
+        } else if ((c >= 'a') && (c <= 'f')) {
+            nibble = c - 'a' + 10;
+        } else if ((c >= 'A') && (c <= 'F')) {
+            nibble = c - 'A' + 10;
+        } else {
+            return false;
+        }
+        data[i / 2] = (i & 1) ? (data[i / 2] | nibble) : (nibble << 4);
+    }
+    return true;
+}
+
+// ---------------------------------------- Firmware Transfer ----------------------------------------
+
+DashFirmwareTransfer::DashFirmwareTransfer(DashLogStorage *storage) : storage(storage) {
+    memset(&header, 0, sizeof(header));
+}
+
+void DashFirmwareTransfer::open() {
+    firmwareState = FIRMWARE_EMPTY;
+    if ((storage->size() > LOG_SECTOR_SIZE) && storage->read(0, &header, sizeof(header))) {
+        if ((header.magic == FIRMWARE_MAGIC) && (header.state == FIRMWARE_HEADER_STAGED) && (header.size <= maxSize())) {
+            firmwareState = FIRMWARE_STAGED;
+            receivedBytes = header.size;
+            return;
+        }
+    }
+    memset(&header, 0, sizeof(header));
+}
+
+bool DashFirmwareTransfer::begin(uint32_t size, const uint8_t *hash) {
+    if ((size == 0) || (size > maxSize())) {
+        return false;
+    }
+
+    storage->eraseSector(0);
+    header.magic = FIRMWARE_MAGIC;
+    header.state = FIRMWARE_HEADER_RECEIVING;
+    header.reserved = 0xFF;
+    header.size = size;
+    memcpy(header.hash, hash, FIRMWARE_HASH_SIZE);
+    storage->write(0, &header, sizeof(header));
+
+    firmwareState = FIRMWARE_RECEIVING;
+    receivedBytes = 0;
+    ackedBytes = 0;
+    sentBytes = 0;
+    return true;
+}
+
+bool DashFirmwareTransfer::write(uint32_t offset, const uint8_t *data, uint32_t len) {
+    if ((firmwareState != FIRMWARE_RECEIVING) || (offset != receivedBytes) || (offset + len > header.size)) {
+        return false;
+    }
+
+    while (len > 0) {
+        uint32_t address = LOG_SECTOR_SIZE + receivedBytes;
+        if ((address % LOG_SECTOR_SIZE) == 0) {
+            storage->eraseSector(address); // Sectors are erased as the image reaches them
+        }
+        uint32_t writeLen = LOG_SECTOR_SIZE - (address % LOG_SECTOR_SIZE);
+        if (writeLen > len) {
+            writeLen = len;
+        }
+        if (!storage->write(address, data, writeLen)) {
+            return false;
+        }
+        receivedBytes += writeLen;
+        data += writeLen;
+        len -= writeLen;
+    }
+    return true;
+}
+
+bool DashFirmwareTransfer::finish() {
+    if ((firmwareState != FIRMWARE_RECEIVING) || (receivedBytes != header.size)) {
+        return false;
+    }
+
+    // Hash what was written to storage, rather than what was received
+    DashSha256 sha;
+    uint8_t buffer[256];
+    for (uint32_t offset = 0; offset < header.size; offset += sizeof(buffer)) {
+        uint32_t len = header.size - offset;
+        if (len > sizeof(buffer)) {
+            len = sizeof(buffer);
+        }
+        storage->read(LOG_SECTOR_SIZE + offset, buffer, len);
+        sha.update(buffer, len);
+    }
+    uint8_t hash[FIRMWARE_HASH_SIZE];
+    sha.finish(hash);
+
+    if (memcmp(hash, header.hash, FIRMWARE_HASH_SIZE)) {
+        storage->eraseSector(0);
+        memset(&header, 0, sizeof(header));
+        firmwareState = FIRMWARE_EMPTY;
+        receivedBytes = 0;
+        return false;
+    }
+
+    uint8_t staged = FIRMWARE_HEADER_STAGED;
+    storage->write(offsetof(DashFirmwareHeader, state), &staged, 1);
+    header.state = FIRMWARE_HEADER_STAGED;
+    firmwareState = FIRMWARE_STAGED;
+    return true;
+}
+
+void DashFirmwareTransfer::ack(uint32_t offset, uint32_t nowMs) {
+    if ((firmwareState == FIRMWARE_EMPTY) || (firmwareState == FIRMWARE_RECEIVING)) {
+        return;
+    }
+    if (offset > header.size) {
+        offset = header.size;
+    }
+
+    if ((firmwareState == FIRMWARE_STAGED) || (firmwareState == FIRMWARE_PAUSED) || (firmwareState == FIRMWARE_SENT)) {
+        sentBytes = offset; // Start, or resume from where the host got to
+        if (firmwareState != FIRMWARE_PAUSED) {
+            highestSentBytes = offset;
+        }
+    } else if (offset == ackedBytes) {
+        // Repeated ACK. Chunks still in flight also repeat it, so only go back once several arrive
+        if (++dupAcks >= dupAckThreshold) {
+            sentBytes = offset;
+            dupAcks = 0;
+        }
+        return;
+    } else if ((offset < ackedBytes) || (offset > sentBytes)) {
+        sentBytes = offset; // The host restarted from an earlier offset, or is ahead of us
+    }
+    ackedBytes = offset;
+    lastAckMs = nowMs;
+    retries = 0;
+    dupAcks = 0;
+    firmwareState = (ackedBytes >= header.size) ? FIRMWARE_SENT : FIRMWARE_SENDING;
+}
+
+int32_t DashFirmwareTransfer::next(uint32_t nowMs, uint32_t *offset, uint8_t *data) {
+    if (firmwareState != FIRMWARE_SENDING) {
+        return -1;
+    }
+
+    if ((sentBytes > ackedBytes) && ((nowMs - lastAckMs) > ackTimeoutMs)) {
+        if (++retries > maxRetries) {
+            firmwareState = FIRMWARE_PAUSED;
+            return -1;
+        }
+        sentBytes = ackedBytes; // Go back to the last ACK
+        lastAckMs = nowMs;
+        dupAcks = 0;
+    }
+
+    if ((sentBytes >= header.size) || (sentBytes >= ackedBytes + (uint32_t)window * chunkSize)) {
+        return -1;
+    }
+
+    uint32_t len = header.size - sentBytes;
+    if (len > chunkSize) {
+        len = chunkSize;
+    }
+    if (!storage->read(LOG_SECTOR_SIZE + sentBytes, data, len)) {
+        return -1;
+    }
+    if (sentBytes < highestSentBytes) {
+        numRetransmits++;
+    }
+    *offset = sentBytes;
+    sentBytes += len;
+    if (sentBytes > highestSentBytes) {
+        highestSentBytes = sentBytes;
+    }
+    return len;
+}
+
+void DashFirmwareTransfer::abort() {
+    if ((firmwareState == FIRMWARE_SENDING) || (firmwareState == FIRMWARE_PAUSED)) {
+        firmwareState = FIRMWARE_STAGED;
+    } else if (firmwareState == FIRMWARE_RECEIVING) {
+        storage->eraseSector(0);
+        memset(&header, 0, sizeof(header));
+        firmwareState = FIRMWARE_EMPTY;
+        receivedBytes = 0;
+    }
+}
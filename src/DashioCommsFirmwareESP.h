@@ -0,0 +1,111 @@
+#ifndef DASHIO_COMMS_FIRMWARE_ESP_H
+#define DASHIO_COMMS_FIRMWARE_ESP_H
+
+// Staging and transfer of firmware images for the serial master (host MCU).
+// An image is received in order, staged in a DashLogStorage with a SHA-256 check, then sent to the host in chunks
+// using go back N with cumulative acknowledgements, so an interrupted transfer resumes from the host's last ACK.
+// SHA-256 and base 64 use mbedtls on the ESP32. Elsewhere the code only depends on the C library, so transfers can
+// also be run on a host with DashFileLogStorage.
+
+#include <DashioCommsStoreESP.h>
+
+#ifdef ESP_PLATFORM
+#include <mbedtls/sha256.h>
+#endif
+
+#define FIRMWARE_HASH_SIZE 32
+
+class DashSha256 {
+public:
+    DashSha256();
+    ~DashSha256();
+    void reset();
+    void update(const uint8_t *data, uint32_t len);
+    void finish(uint8_t *hash); // FIRMWARE_HASH_SIZE bytes
+
+private:
+#ifdef ESP_PLATFORM
+    mbedtls_sha256_context context;
+#else
+    uint32_t state[8];
+    uint64_t numBytes;
+    uint8_t block[64];
+    void transform(const uint8_t *data);
+#endif
+};
+
+// Base 64 (RFC 4648) and hex helpers
+uint32_t dashBase64Encode(const uint8_t *data, uint32_t len, char *text); // Returns the text length. Text must hold 4 * ((len + 2) / 3) + 1 chars
+int32_t dashBase64Decode(const char *text, uint8_t *data, uint32_t maxLen); // Returns the data length, or -1 if invalid or too long
+void dashHexEncode(const uint8_t *data, uint32_t len, char *text); // Text must hold 2 * len + 1 chars
+bool dashHexDecode(const char *text, uint8_t *data, uint32_t len);
+
+enum FirmwareState : uint8_t {
+    FIRMWARE_EMPTY,
+    FIRMWARE_RECEIVING, // Being staged
+    FIRMWARE_STAGED, // Hash checked, ready for the host
+    FIRMWARE_SENDING,
+    FIRMWARE_PAUSED, // No ACK from the host after maxRetries. Resumes on the next ACK
+    FIRMWARE_SENT, // Every byte acknowledged by the host
+    NUM_FIRMWARE_STATES
+};
+
+const char * const FIRMWARE_STATE_NAMES[NUM_FIRMWARE_STATES] = {"EMPTY", "RECEIVING", "STAGED", "SENDING", "PAUSED", "SENT"};
+
+const uint16_t FIRMWARE_MAGIC = 0xDAF1;
+const uint8_t FIRMWARE_HEADER_RECEIVING = 0xFF;
+const uint8_t FIRMWARE_HEADER_STAGED = 0x0F;
+
+struct DashFirmwareHeader { // In the first sector. The image starts at the second sector
+    uint16_t magic;
+    uint8_t state;
+    uint8_t reserved;
+    uint32_t size;
+    uint8_t hash[FIRMWARE_HASH_SIZE];
+};
+
+class DashFirmwareTransfer {
+public:
+    DashFirmwareTransfer(DashLogStorage *storage);
+
+    void open(); // Recovers a staged image from storage
+
+    // Staging
+    bool begin(uint32_t size, const uint8_t *hash); // Returns false if the image doesn't fit
+    bool write(uint32_t offset, const uint8_t *data, uint32_t len); // Offset must be received(). Returns false otherwise
+    bool finish(); // Checks the hash. Returns false (and discards the image) if it doesn't match
+
+    // Transfer to the host
+    void ack(uint32_t offset, uint32_t nowMs); // Host has every byte before offset. Also starts or resumes the transfer
+    int32_t next(uint32_t nowMs, uint32_t *offset, uint8_t *data); // Next chunk to send (up to chunkSize bytes), or -1 if none now
+    void abort();
+
+    FirmwareState state() { return firmwareState; }
+    uint32_t size() { return header.size; }
+    const uint8_t *hash() { return header.hash; }
+    uint32_t received() { return receivedBytes; }
+    uint32_t acked() { return ackedBytes; }
+    uint32_t retransmits() { return numRetransmits; }
+    uint32_t maxSize() { return (storage->size() > LOG_SECTOR_SIZE) ? storage->size() - LOG_SECTOR_SIZE : 0; }
+
+    uint16_t chunkSize = 512;
+    uint8_t window = 4; // Chunks sent ahead of the last ACK
+    uint32_t ackTimeoutMs = 1000; // Go back to the last ACK after this time without one
+    uint8_t maxRetries = 5;
+    uint8_t dupAckThreshold = 3; // Repeated ACKs for the same offset before going back without waiting for ackTimeoutMs
+
+private:
+    DashLogStorage *storage;
+    DashFirmwareHeader header;
+    FirmwareState firmwareState = FIRMWARE_EMPTY;
+    uint32_t receivedBytes = 0;
+    uint32_t ackedBytes = 0;
+    uint32_t sentBytes = 0;
+    uint32_t highestSentBytes = 0;
+    uint32_t lastAckMs = 0;
+    uint8_t retries = 0;
+    uint8_t dupAcks = 0;
+    uint32_t numRetransmits = 0;
+};
+
+#endif
@@ -0,0 +1,15 @@
+#ifndef DASHIO_COMMS_HASH_ESP_H
+#define DASHIO_COMMS_HASH_ESP_H
+
+#include <stdint.h>
+
+// FNV-1a hash used by the comms lookup tables
+static inline uint32_t dashHash(const char *str, int len, uint32_t hashVal = 2166136261UL) {
+    for (int i = 0; i < len; i++) {
+        hashVal ^= (uint8_t)str[i];
+        hashVal *= 16777619UL;
+    }
+    return hashVal;
+}
+
+#endif
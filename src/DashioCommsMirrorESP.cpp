@@ -0,0 +1,112 @@
+#include <DashioCommsMirrorESP.h>
+#include <DashioESP.h>
+#include <DashioCommsHashESP.h>
+
+bool DashControlMirror::update(const char *message) {
+    // Key is everything up to the end of the control ID i.e. DELIM deviceID DELIM controlType DELIM controlID.
+    // Graphs and maps have a message per line or track, so their key also has the line or track ID
+    int keyLen = 0;
+    int numDelims = 0;
+    int keyDelims = 3;
+    while ((message[keyLen] != '\0') && (message[keyLen] != END_DELIM)) {
+        if (message[keyLen] == DELIM) {
+            numDelims++;
+            if (numDelims == 3) {
+                const char *controlType = strchr(message + 1, DELIM) + 1;
+                if (!strncmp(controlType, MIRROR_GRAPH, strlen(MIRROR_GRAPH)) || !strncmp(controlType, MIRROR_MAP, strlen(MIRROR_MAP))) {
+                    keyDelims = 4;
+                }
+            }
+            if (numDelims > keyDelims) {
+                break;
+            }
+        }
+        keyLen++;
+    }
+    if (numDelims < keyDelims) {
+        return true; // No control ID (or line ID), so nothing to mirror
+    }
+
+    uint32_t hashVal = dashHash(message, keyLen);
+    for (uint8_t i = 0; i < MIRROR_TABLE_SIZE; i++) {
+        uint8_t index = (hashVal + i) & (MIRROR_TABLE_SIZE - 1);
+        String *entry = &messages[index];
+        if (entry->length() == 0) {
+            if (numControls >= MAX_MIRRORED_CONTROLS) {
+                return false;
+            }
+            numControls++;
+            hashes[index] = hashVal;
+            *entry = message;
+            return true;
+        }
+        if ((hashes[index] == hashVal) && (entry->length() > (unsigned int)keyLen) && !strncmp(entry->c_str(), message, keyLen) && ((*entry)[keyLen] == DELIM || (*entry)[keyLen] == END_DELIM)) {
+            *entry = message;
+            return true;
+        }
+    }
+    return false;
+}
+
+bool DashControlMirror::isForDevice(uint8_t index, const String& deviceID) {
+    int idLen = deviceID.length();
+    const char *message = messages[index].c_str();
+    return (messages[index].length() > (unsigned int)idLen + 1) && !strncmp(message + 1, deviceID.c_str(), idLen) && (message[idLen + 1] == DELIM);
+}
+
+uint32_t DashControlMirror::statusLength(const String& deviceID) {
+    uint32_t length = 0;
+    for (uint8_t i = 0; i < MIRROR_TABLE_SIZE; i++) {
+        if (isForDevice(i, deviceID)) {
+            length += messages[i].length();
+        }
+    }
+    return length;
+}
+
+void DashControlMirror::getStatus(const String& deviceID, String& status) {
+    for (uint8_t i = 0; i < MIRROR_TABLE_SIZE; i++) {
+        if (isForDevice(i, deviceID)) {
+            status += messages[i];
+        }
+    }
+}
+
+void DashControlMirror::clear() {
+    for (uint8_t i = 0; i < MIRROR_TABLE_SIZE; i++) {
+        messages[i] = "";
+    }
+    numControls = 0;
+}
+
+void DashControlMirror::clear(const String& deviceID) {
+    uint8_t i = 0;
+    while (i < MIRROR_TABLE_SIZE) {
+        if (isForDevice(i, deviceID)) {
+            removeAt(i); // May move another entry into i, so check it again
+        } else {
+            i++;
+        }
+    }
+}
+
+void DashControlMirror::removeAt(uint8_t index) {
+    // Move later entries in the probe sequence back into the hole, so update doesn't stop early
+    uint8_t hole = index;
+    messages[hole] = "";
+    numControls--;
+    for (uint8_t i = 1; i < MIRROR_TABLE_SIZE; i++) {
+        uint8_t next = (hole + i) & (MIRROR_TABLE_SIZE - 1);
+        if (messages[next].length() == 0) {
+            break;
+        }
+        uint8_t home = hashes[next] & (MIRROR_TABLE_SIZE - 1);
+        if (((next - home) & (MIRROR_TABLE_SIZE - 1)) >= ((next - hole) & (MIRROR_TABLE_SIZE - 1))) {
+            messages[hole] = messages[next];
+            hashes[hole] = hashes[next];
+            messages[next] = "";
+            hole = next;
+            i = 0;
+        }
+    }
+}
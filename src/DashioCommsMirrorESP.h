@@ -0,0 +1,31 @@
+#ifndef DASHIO_COMMS_MIRROR_ESP_H
+#define DASHIO_COMMS_MIRROR_ESP_H
+
+#include <Arduino.h>
+
+#define MAX_MIRRORED_CONTROLS 64
+#define MIRROR_TABLE_SIZE 128 // Must be a power of 2, and at least twice MAX_MIRRORED_CONTROLS
+
+// Control types mirrored per line or track ID, as well as control ID
+const char MIRROR_GRAPH[] = "GRPH\t";
+const char MIRROR_MAP[] = "MAP\t";
+
+// Last message sent by the master for each control, keyed by device ID, control type and control ID (and line or track ID).
+class DashControlMirror {
+public:
+    bool update(const char *message); // Message must start with DELIM. Returns false if the table is full
+    uint32_t statusLength(const String& deviceID);
+    void getStatus(const String& deviceID, String& status); // Appends all mirrored messages for the device
+    void clear();
+    void clear(const String& deviceID);
+    uint8_t count() { return numControls; }
+
+private:
+    String messages[MIRROR_TABLE_SIZE];
+    uint32_t hashes[MIRROR_TABLE_SIZE];
+    uint8_t numControls = 0;
+    bool isForDevice(uint8_t index, const String& deviceID);
+    void removeAt(uint8_t index);
+};
+
+#endif
@@ -1,10 +1,15 @@
 #include <dashioCommsESP.h>
 
 void DashCommsESP::parseMessage() { // Parse and act on the contents of the internal messageBuffer
-    ESP_LOGI(DTAG, "Incoming->%s", messageBuffer);
+    DASH_LOG_FRAME("Incoming->%s", messageBuffer);
+    messageLength = strlen(messageBuffer);
+    DASH_TRACE(TRACE_SERIAL_RX, messageLength);
     
     char *token = strtok(messageBuffer, DELIM_STR);
-    
+    if (!token) {
+        return;
+    }
+
     // Check for connection prefix in the message
     ConnectionType prefixConnectionType = SERIAL_CONN;
     if (!strncmp(token, BLE, BLELEN)) {
@@ -24,44 +29,77 @@ void DashCommsESP::parseMessage() { // Parse and act on the contents of the inte
     }
 
     // Need to remember to check token isnt NULL before trying to get message length or the esp will crash
-    int tokenLength = 0;
-    if (token) {
-        tokenLength = strlen(token);
+    if (!token) {
+        return;
     }
-
-    int idLen = dashDevice->deviceID.length() + 1;
-    char deviceID[idLen];
-    dashDevice->deviceID.toCharArray(deviceID, idLen);
+    int tokenLength = strlen(token);
 
     if (!strncmp(token, CTRL, CTRLLEN)) {
         token = strtok(NULL, DELIMETERS_STR);
         if (token == nullptr) {
             sendControlMessage();
         }
-    } else if (!strncmp(token, deviceID, tokenLength)) {
-        // If an actual value exists, and its the same as our device name, we can begin parsing in earnest
+    } else {
+        // Find the device this message is from. Messages for unknown devices are ignored, except for CTRL DVCE which adds a new device
+        char *deviceID = token;
+        DashRoute *route = routes.find(deviceID);
+        if (route != nullptr) {
+            route->lastSeenMs = millis(); // For expiry of idle secondary masters
+        }
+
         token = strtok(NULL, DELIMETERS_STR);
-        if ((!strncmp(token, CTRL, CTRLLEN))) {
+        if ((token) && (!strncmp(token, CTRL, CTRLLEN))) {
             // control function
             token = strtok(NULL, DELIMETERS_STR);
-            if (token) {
-                tokenLength = strlen(token);
+            if (!token) {
+                return;
+            }
+            tokenLength = strlen(token);
+
+            if ((route == nullptr) && (!strncmp(token, DEVICE, DEVICELEN))) {
+                route = addRoute(deviceID);
             }
+            if (route == nullptr) {
+                return;
+            }
+            bool isPrimary = route->primary;
 
             if (!strncmp(token, DEVICE, DEVICELEN)) {
+                // Secondary masters are only routed, so only the primary's type and name are used (for WHO replies)
                 token = strtok(NULL, DELIMETERS_STR);
-                if (token) {
+                if (token && !isPrimary && !strncmp(token, HALT, HALTLEN)) {
+                    removeRoute(route);
+                } else if (token && isPrimary) {
                     tokenLength = strlen(token);
                     dashDevice->type = String(token, tokenLength);
 
                     token = strtok(NULL, DELIMETERS_STR);
                     if (token) {
-                        if (dashDevice->name == DEFAULT_DEVICE_NAME) {
+                        if (dashDevice->name == DEFAULT_DEVICE_NAME) { // Only set the device name if it hasn't been provisioned
                             tokenLength = strlen(token);
                             dashDevice->name = String(token, tokenLength);
                         }
                     }
                 }
+            } else if (!strncmp(token, DELTA, DELTALEN)) {
+                addDeltaStream(route);
+            } else if (!isPrimary) {
+                // Only the primary master controls the comms module
+            } else if ((!strncmp(token, CFG, CFGLEN))) {
+                token = strtok(NULL, DELIMETERS_STR);
+                if (token) {
+                    tokenLength = strlen(token);
+                    delete[] route->configC64;
+                    route->configC64 = new char[tokenLength + 1];
+                    memcpy(route->configC64, token, tokenLength + 1);
+                    dashDevice->configC64Str = route->configC64;
+                    DASH_LOGI("Config stored to RAM");
+
+                    token = strtok(NULL, DELIMETERS_STR);
+                    if (token) {
+                        dashDevice->cfgRevision = atoi(token); // try cast to integer and store as the config revision
+                    }
+                }
             } else if (!strncmp(token, DASHLEDS, DASHLEDSLEN)) {
                 token = strtok(NULL, DELIMETERS_STR);
                 if (token) { // If there is a token, it should be a timeout value
@@ -79,7 +117,7 @@ void DashCommsESP::parseMessage() { // Parse and act on the contents of the inte
                 } else { // If there is a token, and its not a halt, it should be a timeout value
                     setBLEtimeout(atoi(token));
                     bleSwEnabled = true;
-                    if (config.bleButtonPin == GPIO_NUM_NC) {
+                    if (DASH_BOARD(bleButtonPin) == GPIO_NUM_NC) {
                         startBLE();
                     }
                 }
@@ -106,12 +144,17 @@ void DashCommsESP::parseMessage() { // Parse and act on the contents of the inte
                     stopMQTT();
                 }
             } else if (!strncmp(token, REBOOT, REBOOTLEN)) {
-                ESP_LOGI(DTAG, "Rebooting");
-                ESP.restart();
+                shutdown(SHUTDOWN_REBOOT);
             } else if (!strncmp(token, SLEEP, SLEEPLEN)) {
-                sleep();
+                shutdown(SHUTDOWN_SLEEP);
             } else if (!strncmp(token, INIT, INITLEN)) {
                 serialInitDone = true;
+                token = strtok(NULL, DELIMETERS_STR);
+                if (token) { // Config revision, for restoring the master's store registrations
+                    restoreDashStores(strtoul(token, NULL, 10));
+                } else {
+                    registryActive = false;
+                }
             } else if (!strncmp(token, CNCTN, CNCTNLEN)) {
                 // Wants active connections, give all in a tab delineated response
                 char respMsg[128] = "\0";
@@ -141,53 +184,259 @@ void DashCommsESP::parseMessage() { // Parse and act on the contents of the inte
                 }
                 strcat(respMsg, "\0");
                 sendControlMessage(CNCTN, respMsg);
-                ESP_LOGI(DTAG, "%s\r\n", respMsg);
-            } else if ((!strncmp(token, CFG, CFGLEN))) {
+                DASH_LOGI("%s\r\n", respMsg);
+            } else if (!strncmp(token, MIRROR, MIRRORLEN)) {
                 token = strtok(NULL, DELIMETERS_STR);
-                if (token) {
-                    tokenLength = strlen(token);
-                    token[tokenLength] = '\0';
-                    memcpy(configC64, token, tokenLength+1);
-                    dashDevice->configC64Str = configC64;
-                    ESP_LOGI(DTAG, "Config stored to RAM");
+                if ((!token) || (!strncmp(token, EN, ENLEN))) {
+                    mirrorEnabled = true;
+                } else if (!strncmp(token, HALT, HALTLEN)) {
+                    mirrorEnabled = false;
+                    mirror.clear();
+                }
+            } else if (!strncmp(token, SUBSCRIBE, SUBSCRIBELEN)) {
+                token = strtok(NULL, DELIMETERS_STR);
+                if ((token) && (!strncmp(token, CLEAR, CLEARLEN))) {
+                    filter.clear();
+                } else if (token) {
+                    ControlType controlType = dashDevice->getControlType(token);
 
                     token = strtok(NULL, DELIMETERS_STR);
-                    if (token) {
-                        dashDevice->cfgRevision = atoi(token); // try cast to integer and store as the config revision
+                    if (!token) {
+                        filter.addType(controlType);
+                    }
+                    while (token) {
+                        if (!filter.addControl(controlType, token)) {
+                            DASH_LOGW("Subscription filter full");
+                        }
+                        token = strtok(NULL, DELIMETERS_STR);
                     }
                 }
-            } else if ((!strncmp(token, STE, STELEN))) {
+            } else if (!strncmp(token, PING, PINGLEN)) { // Echo the master's sequence number and timestamp
+                char *seq = strtok(NULL, DELIMETERS_STR);
+                char *timestamp = strtok(NULL, DELIMETERS_STR);
+                if (seq && timestamp) {
+                    char payload[strlen(seq) + strlen(timestamp) + 2];
+                    snprintf(payload, sizeof(payload), "%s\t%s", seq, timestamp);
+                    sendControlMessage(PONG, payload);
+                } else {
+                    sendControlMessage(PONG, seq);
+                }
+            } else if (!strncmp(token, PONG, PONGLEN)) {
                 token = strtok(NULL, DELIMETERS_STR);
                 if (token) {
-                    ControlType controlType = dashDevice->getControlType(token);
-
-                    token = strtok(NULL, DELIMETERS_STR);
-                    if (token) {
-                        if (mqtt_con != nullptr) {
-                            mqtt_con->addDashStore(controlType, token);
+                    if (!linkProbes[PROBE_SERIAL].pong(strtoul(token, NULL, 10), (uint32_t)esp_timer_get_time())) {
+                        DASH_LOGD("Unexpected PONG %s", token);
+                    }
+                }
+            } else if (!strncmp(token, LINK, LINKLEN)) {
+                token = strtok(NULL, DELIMETERS_STR);
+                if (!token) {
+                    sendLinkStats();
+                } else if (!strncmp(token, CLEAR, CLEARLEN)) {
+                    for (uint8_t i = 0; i < NUM_PROBE_LINKS; i++) {
+                        linkProbes[i].clear();
+                    }
+                }
+            } else if (!strncmp(token, POOL, POOLLEN)) {
+                sendPoolStats();
+            } else if (!strncmp(token, EGRESS, EGRESSLEN)) {
+                sendEgressStats();
+            } else if (!strncmp(token, POLICY, POLICYLEN)) {
+                token = strtok(NULL, DELIMETERS_STR);
+                if (!token) {
+                    sendPolicyStats();
+                } else if (!strncmp(token, CLEAR, CLEARLEN)) {
+                    policies.clear();
+                } else {
+                    char *controlType = token;
+                    char *controlID = strtok(NULL, DELIMETERS_STR);
+                    if (controlID) {
+                        uint8_t bleRate = parsePolicyRate(strtok(NULL, DELIMETERS_STR));
+                        uint8_t tcpRate = parsePolicyRate(strtok(NULL, DELIMETERS_STR));
+                        uint8_t mqttRate = parsePolicyRate(strtok(NULL, DELIMETERS_STR));
+                        if (!policies.add(controlType, controlID, bleRate, tcpRate, mqttRate)) {
+                            DASH_LOGW("Policy table full");
                         }
                     }
                 }
+            } else if (!strncmp(token, POWER, POWERLEN)) {
+                sendPowerStats();
+            } else if (!strncmp(token, BOOT, BOOTLEN)) {
+                sendBootTimeline();
+            } else if (!strncmp(token, FIRMWARE, FIRMWARELEN)) {
+                parseFirmwareCommand();
+            } else if (!strncmp(token, TRACE, TRACELEN)) {
+                token = strtok(NULL, DELIMETERS_STR);
+                if (!token) {
+                    dumpTrace(SERIAL_CONN);
+                } else if (!strncmp(token, MQTT, MQTTLEN)) {
+                    dumpTrace(MQTT_CONN);
+                } else if (!strncmp(token, CLEAR, CLEARLEN)) {
+                    DashTrace::clear();
+                }
+            } else if ((!strncmp(token, STE, STELEN))) {
+                parseDashStores();
             }
-        } else { // Must be a message that requires forwarding, with this deviceID.
-            sendNmlMessage(token, deviceID, prefixConnectionType);
+        } else if ((token) && (route != nullptr) && (!strcmp(token, DELTA))) {
+            sendDeltaMessage(route, prefixConnectionType);
+        } else if ((token) && (route != nullptr)) { // Must be a message that requires forwarding, with this deviceID.
+            sendNmlMessage(token, route, prefixConnectionType);
         }
     }
 }
 
-void DashCommsESP::sendNmlMessage(char *token, char *deviceID, ConnectionType connectionType) {
-    serialTransmitBuffer[0] = '\0';
+void DashCommsESP::addDeltaStream(DashRoute *route) {
+    // CTRL DLT handle decimals batch controlType controlID [fields...], or CTRL DLT CLR
+    char *token = strtok(NULL, DELIMETERS_STR);
+    if (!token) {
+        return;
+    }
+    if (!strncmp(token, CLEAR, CLEARLEN)) {
+        deltaStreams.clear(route);
+        return;
+    }
 
-    if (deviceID != nullptr) {
-        strcat(serialTransmitBuffer, DELIM_STR);
-        strcat(serialTransmitBuffer, deviceID);
+    uint8_t handle = atoi(token);
+    char *decimals = strtok(NULL, DELIMETERS_STR);
+    char *batch = strtok(NULL, DELIMETERS_STR);
+    char *controlType = strtok(NULL, DELIMETERS_STR);
+    char *controlID = strtok(NULL, DELIMETERS_STR);
+    if (!controlID) {
+        return;
+    }
+    String prefix = controlType;
+    prefix += DELIM;
+    prefix += controlID;
+    token = strtok(NULL, DELIMETERS_STR);
+    while (token) {
+        prefix += DELIM;
+        prefix += token;
+        token = strtok(NULL, DELIMETERS_STR);
+    }
+
+    if (!deltaStreams.add(route, handle, atoi(decimals), atoi(batch) != 0, dashDevice->getControlType(controlType), prefix)) {
+        DASH_LOGW("Delta stream table full");
+    }
+}
+
+void DashCommsESP::sendDeltaMessage(DashRoute *route, ConnectionType connectionType) {
+    // deviceID DLT handle samples
+    char *token = strtok(NULL, DELIMETERS_STR);
+    char *encoded = strtok(NULL, DELIMETERS_STR);
+    if (!encoded) {
+        return;
+    }
+    DashDeltaStream *stream = deltaStreams.find(route, atoi(token));
+    if (stream == nullptr) {
+        DASH_LOGW("Unknown delta stream %s", token);
+        return;
+    }
+
+    // Time Graphs get one message per point (or one for all points in batch mode). Other controls show their
+    // newest value, so without batch mode only the last sample is sent
+    bool timed = (stream->controlType == timeGraph);
+    bool messagePerSample = timed && !stream->batch;
+    bool newestOnly = !timed && !stream->batch;
+    int numSamples = DashDeltaTable::count(encoded);
+    if (timed) {
+        numSamples /= 2;
+    }
+    int headerLen = route->deviceID.length() + stream->prefix.length() + 2;
+    int sampleLen = DELTA_VALUE_LEN + (timed ? DELTA_TIME_LEN : 0);
+    int length = messagePerSample ? numSamples * (headerLen + sampleLen + 1) : headerLen + (newestOnly ? 1 : numSamples) * sampleLen + 1;
+    DashMessageSlot message = messagePool.acquire(length);
+
+    const char *next = encoded;
+    uint64_t value = 0; // Unsigned, so overflow wraps
+    uint64_t timeMs = 0;
+    int64_t delta;
+    int numDecoded = 0;
+    char valueStr[DELTA_VALUE_LEN];
+    char timeStr[DELTA_TIME_LEN];
+    DashDeltaResult result;
+    while ((result = DashDeltaTable::next(&next, &delta)) == DELTA_SAMPLE) {
+        if (timed) {
+            timeMs = (numDecoded == 0) ? (uint64_t)delta : timeMs + (uint64_t)delta;
+            if (DashDeltaTable::next(&next, &delta) != DELTA_SAMPLE) {
+                result = DELTA_ERROR; // Timestamp without a value
+                break;
+            }
+        }
+        value = (numDecoded == 0) ? (uint64_t)delta : value + (uint64_t)delta;
+        numDecoded++;
+        if (newestOnly) {
+            continue;
+        }
+
+        if ((numDecoded == 1) || messagePerSample) {
+            message.str() += DELIM;
+            message.str() += route->deviceID;
+            message.str() += DELIM;
+            message.str() += stream->prefix;
+        }
+        message.str() += DELIM;
+        if (timed) {
+            DashDeltaTable::formatTime((int64_t)timeMs, timeStr);
+            message.str() += timeStr;
+            message.str() += ',';
+        }
+        DashDeltaTable::format((int64_t)value, stream->decimals, valueStr);
+        message.str() += valueStr;
+        if (messagePerSample) {
+            message.str() += END_DELIM;
+        }
+    }
+    if (result == DELTA_ERROR) {
+        DASH_LOGW("Bad delta encoding for stream %u. Message dropped", stream->handle); // Later samples depend on every earlier one
+        return;
+    }
+    if (numDecoded == 0) {
+        return;
     }
 
-    if ((!strncmp(token, CLK, CLKLEN))) { // CLK messages to announce topic
+    if (newestOnly) {
+        message.str() += DELIM;
+        message.str() += route->deviceID;
+        message.str() += DELIM;
+        message.str() += stream->prefix;
+        message.str() += DELIM;
+        DashDeltaTable::format((int64_t)value, stream->decimals, valueStr);
+        message.str() += valueStr;
+    }
+    if (!messagePerSample) {
+        message.str() += END_DELIM;
+    }
+    if (mirrorEnabled && !timed && (stream->controlType != eventLog)) { // One line, as for sendNmlMessage
+        if (!mirror.update(message.str().c_str())) {
+            DASH_LOGW("Mirror full");
+        }
+    }
+    sendRoutedMessage(message.str(), connectionType, route->primary);
+}
+
+void DashCommsESP::sendRoutedMessage(const String& message, ConnectionType connectionType, bool isPrimary) {
+    // Secondary masters are reached over BLE and TCP. MQTT topics belong to the comms module's (primary) device ID
+    if (isPrimary) {
+        sendMessage(message, connectionType);
+    } else if (connectionType == ALL_CONN) {
+        sendMessage(message, BLE_CONN);
+        sendMessage(message, TCP_CONN);
+    } else if (connectionType != MQTT_CONN) {
+        sendMessage(message, connectionType);
+    }
+}
+
+void DashCommsESP::sendNmlMessage(char *token, DashRoute *route, ConnectionType connectionType) {
+    bool isPrimary = route->primary;
+    serialTransmitBuffer[0] = '\0';
+    strcat(serialTransmitBuffer, DELIM_STR);
+    strcat(serialTransmitBuffer, route->deviceID.c_str());
+
+    if ((!isPrimary) && ((!strncmp(token, CLK, CLKLEN)) || (!strncmp(token, ALM, ALMLEN)))) {
+        // MQTT only messages. The MQTT connection only publishes for the primary device
+    } else if ((!strncmp(token, CLK, CLKLEN))) { // CLK messages to announce topic
         strcat(serialTransmitBuffer, DELIM_STR);
         strcat(serialTransmitBuffer, CLK);
-        int tokenLength = strlen(serialTransmitBuffer);
-        serialTransmitBuffer[tokenLength+1] = '\0';
         if (isMQTT) {
             if (mqtt_con != nullptr) {
                 mqtt_con->sendMessage(serialTransmitBuffer, announce_topic);
@@ -206,14 +455,22 @@ void DashCommsESP::sendNmlMessage(char *token, char *deviceID, ConnectionType co
                 mqtt_con->sendMessage(serialTransmitBuffer, alarm_topic);
             }
         }
-    } else { // All other messages to data topic
+    } else { // All other messages to data topic, built straight into a pool slot
+        ControlType controlType = dashDevice->getControlType(token);
+        uint32_t remainingLength = messageLength - (token - messageBuffer); // strtok only replaces delimiters, so this is the rest of the message
+        DashMessageSlot message = messagePool.acquire(route->deviceID.length() + 1 + remainingLength);
+        message.str() += DELIM;
+        message.str() += route->deviceID;
         while (token) {
-            strcat(serialTransmitBuffer, DELIM_STR);
-            strcat(serialTransmitBuffer, token);
+            message.str() += DELIM;
+            message.str() += token;
             token = strtok(NULL, DELIM_STR);
         }
-        int tokenLength = strlen(serialTransmitBuffer);
-        serialTransmitBuffer[tokenLength+1] = '\0';
-        sendMessage(serialTransmitBuffer, connectionType);
+        if (mirrorEnabled && (controlType != eventLog) && (controlType != timeGraph)) { // Logs and time graphs are history, not state
+            if (!mirror.update(message.str().c_str())) {
+                DASH_LOGW("Mirror full");
+            }
+        }
+        sendRoutedMessage(message.str(), connectionType, isPrimary);
     }
 }
@@ -0,0 +1,37 @@
+#include <dashioCommsESP.h>
+
+// Pipeline ownership:
+//   run() (Arduino loop task, core 1) - the UART receive side, receiveBuffer and the slot it is filling.
+//   Radio task (radioTaskCore)        - wifi, tcp_con, tcpEgress, mqtt_con, ble_con, provisioning, routes, mirror, filter,
+//                                       policies, the MQTT store and the shutdown state. parseMessage() and
+//                                       everything it calls, including UART writes, only run in the radio task.
+// Slots only change owner through freeSlots and readySlots.
+
+void DashCommsESP::startPipeline() {
+    xTaskCreatePinnedToCore(radioTask, "radioTask", config.radioTaskStackSize, this, 1, &radioTaskHandle, config.radioTaskCore);
+}
+
+void DashCommsESP::radioTask(void *parameters) {
+    DashCommsESP *dashComms = (DashCommsESP *)parameters;
+    dashComms->runRadio();
+}
+
+void DashCommsESP::runRadio() {
+    uint8_t slot;
+    while (!stopTasks) {
+        runConnections();
+
+        bool parsed = false;
+        while ((shutdownStage == SHUTDOWN_IDLE) && readySlots.pop(&slot)) {
+            messageBuffer = &pipelineBuffers[(uint32_t)slot * config.messageBufferSize];
+            parseMessage();
+            freeSlots.push(slot);
+            parsed = true;
+        }
+
+        if (!parsed) {
+            vTaskDelay(1); // Let the idle task run
+        }
+    }
+    exitTask();
+}
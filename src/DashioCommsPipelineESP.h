@@ -0,0 +1,38 @@
+#ifndef DASHIO_COMMS_PIPELINE_ESP_H
+#define DASHIO_COMMS_PIPELINE_ESP_H
+
+#include <stdint.h>
+#include <atomic>
+
+#define MAX_PIPELINE_SLOTS 16 // Must be a power of 2
+
+// Lock free single producer, single consumer queue of slot indexes.
+class DashSlotQueue {
+public:
+    bool push(uint8_t slot) { // Producer only
+        uint8_t head = pushIndex.load(std::memory_order_relaxed);
+        if ((uint8_t)(head - popIndex.load(std::memory_order_acquire)) >= MAX_PIPELINE_SLOTS) {
+            return false;
+        }
+        slots[head & (MAX_PIPELINE_SLOTS - 1)] = slot;
+        pushIndex.store(head + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool pop(uint8_t *slot) { // Consumer only
+        uint8_t tail = popIndex.load(std::memory_order_relaxed);
+        if (tail == pushIndex.load(std::memory_order_acquire)) {
+            return false;
+        }
+        *slot = slots[tail & (MAX_PIPELINE_SLOTS - 1)];
+        popIndex.store(tail + 1, std::memory_order_release);
+        return true;
+    }
+
+private:
+    uint8_t slots[MAX_PIPELINE_SLOTS];
+    std::atomic<uint8_t> pushIndex{0};
+    std::atomic<uint8_t> popIndex{0};
+};
+
+#endif
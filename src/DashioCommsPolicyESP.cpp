@@ -0,0 +1,206 @@
+#include <DashioCommsPolicyESP.h>
+#include <DashioCommsHashESP.h>
+#include <DashioESP.h>
+
+uint32_t DashPolicyTable::policyHash(const char *controlType, int typeLen, const char *controlID, int idLen) {
+    uint32_t hashVal = dashHash(controlID, idLen, dashHash(controlType, typeLen));
+    if (hashVal == 0) {
+        hashVal = 1; // 0 marks an empty slot
+    }
+    return hashVal;
+}
+
+DashPolicy *DashPolicyTable::lookup(uint32_t hashVal, const char *controlType, int typeLen, const char *controlID, int idLen) {
+    for (uint8_t i = 0; i < POLICY_TABLE_SIZE; i++) {
+        DashPolicy *policy = &policies[(hashVal + i) & (POLICY_TABLE_SIZE - 1)];
+        if (policy->hash == 0) {
+            return nullptr;
+        }
+        if ((policy->hash == hashVal) && (policy->key.length() == (unsigned int)(typeLen + idLen + 1)) && !strncmp(policy->key.c_str(), controlType, typeLen) && !strncmp(policy->key.c_str() + typeLen + 1, controlID, idLen)) {
+            return policy;
+        }
+    }
+    return nullptr;
+}
+
+bool DashPolicyTable::add(const char *controlType, const char *controlID, uint8_t bleRate, uint8_t tcpRate, uint8_t mqttRate) {
+    int typeLen = strlen(controlType);
+    int idLen = strlen(controlID);
+    uint32_t hashVal = policyHash(controlType, typeLen, controlID, idLen);
+
+    DashPolicy *policy = lookup(hashVal, controlType, typeLen, controlID, idLen);
+    if (policy == nullptr) {
+        if (numPolicies >= MAX_POLICIES) {
+            return false;
+        }
+        for (uint8_t i = 0; i < POLICY_TABLE_SIZE; i++) {
+            policy = &policies[(hashVal + i) & (POLICY_TABLE_SIZE - 1)];
+            if (policy->hash == 0) {
+                break;
+            }
+        }
+        numPolicies++;
+        policy->hash = hashVal;
+        policy->key = String(controlType) + String(DELIM) + String(controlID);
+        policy->drops = 0;
+    }
+
+    policy->rate[POLICY_BLE] = bleRate;
+    policy->rate[POLICY_TCP] = tcpRate;
+    policy->rate[POLICY_MQTT] = mqttRate;
+    fillBucket(policy, &policy->bucket);
+    clearBuckets(); // Control ID buckets start again with the new rates
+    return true;
+}
+
+void DashPolicyTable::fillBucket(DashPolicy *policy, DashPolicyBucket *bucket) {
+    bucket->lastMs = millis();
+    for (uint8_t i = 0; i < NUM_POLICY_TRANSPORTS; i++) {
+        bucket->tokensMs[i] = (uint32_t)policy->rate[i] * 1000; // Start with a full bucket
+    }
+}
+
+DashPolicyBucket *DashPolicyTable::idBucket(DashPolicy *policy, uint32_t hashVal) {
+    for (uint8_t i = 0; i < POLICY_BUCKET_TABLE_SIZE; i++) {
+        DashPolicyBucket *bucket = &buckets[(hashVal + i) & (POLICY_BUCKET_TABLE_SIZE - 1)];
+        if (bucket->hash == hashVal) {
+            return bucket;
+        }
+        if (bucket->hash == 0) {
+            if (numBuckets >= MAX_POLICY_BUCKETS) {
+                break;
+            }
+            numBuckets++;
+            bucket->hash = hashVal;
+            fillBucket(policy, bucket);
+            return bucket;
+        }
+    }
+    return &policy->bucket; // Table full, so remaining control IDs share the policy's bucket
+}
+
+void DashPolicyTable::clearBuckets() {
+    for (uint8_t i = 0; i < POLICY_BUCKET_TABLE_SIZE; i++) {
+        buckets[i].hash = 0;
+    }
+    numBuckets = 0;
+}
+
+DashPolicyMatch DashPolicyTable::find(const char *line, size_t length) {
+    DashPolicyMatch match;
+    if ((numPolicies == 0) || (length < 2)) {
+        return match;
+    }
+
+    // Line is DELIM deviceID DELIM controlType DELIM controlID ... END_DELIM. Searches stop at the end of the line
+    const char *end = line + length;
+    const char *lineEnd = (const char *)memchr(line, END_DELIM, length);
+    if (lineEnd != nullptr) {
+        end = lineEnd;
+    }
+    const char *controlType = (const char *)memchr(line + 1, DELIM, end - (line + 1));
+    if (controlType == nullptr) {
+        return match;
+    }
+    controlType++;
+    const char *controlID = (const char *)memchr(controlType, DELIM, end - controlType);
+    if (controlID == nullptr) {
+        return match; // No control ID
+    }
+    int typeLen = controlID - controlType;
+    controlID++;
+    const char *idEnd = (const char *)memchr(controlID, DELIM, end - controlID);
+    int idLen = ((idEnd != nullptr) ? idEnd : end) - controlID;
+    if (idLen == 0) {
+        return match;
+    }
+
+    uint32_t hashVal = policyHash(controlType, typeLen, controlID, idLen);
+    match.policy = lookup(hashVal, controlType, typeLen, controlID, idLen);
+    if (match.policy != nullptr) {
+        match.bucket = &match.policy->bucket;
+    } else {
+        match.policy = lookup(policyHash(controlType, typeLen, POLICY_ALL_IDS, 1), controlType, typeLen, POLICY_ALL_IDS, 1);
+        if (match.policy != nullptr) {
+            match.bucket = idBucket(match.policy, hashVal);
+        }
+    }
+    return match;
+}
+
+bool DashPolicyTable::allow(DashPolicyMatch match, PolicyTransport transport) {
+    DashPolicy *policy = match.policy;
+    if (policy == nullptr) {
+        return true;
+    }
+
+    uint8_t rate = policy->rate[transport];
+    if (rate == POLICY_UNLIMITED) {
+        return true;
+    }
+    if (rate != POLICY_BLOCKED) {
+        DashPolicyBucket *bucket = match.bucket;
+        uint32_t nowMs = millis();
+        uint32_t elapsedMs = nowMs - bucket->lastMs;
+        bucket->lastMs = nowMs;
+        for (uint8_t i = 0; i < NUM_POLICY_TRANSPORTS; i++) {
+            if ((policy->rate[i] != POLICY_BLOCKED) && (policy->rate[i] != POLICY_UNLIMITED)) {
+                uint32_t maxTokensMs = (uint32_t)policy->rate[i] * 1000;
+                uint32_t tokensMs = bucket->tokensMs[i] + elapsedMs * policy->rate[i];
+                if ((tokensMs > maxTokensMs) || (elapsedMs > 1000)) {
+                    tokensMs = maxTokensMs;
+                }
+                bucket->tokensMs[i] = tokensMs;
+            }
+        }
+        if (bucket->tokensMs[transport] >= 1000) {
+            bucket->tokensMs[transport] -= 1000;
+            return true;
+        }
+    }
+    policy->drops++;
+    return false;
+}
+
+bool DashPolicyTable::filter(const String& message, PolicyTransport transport, String& allowed) {
+    if (numPolicies == 0) {
+        return true;
+    }
+
+    // A message can hold several controls, one per line (e.g. a STATUS reply)
+    const char *start = message.c_str();
+    const char *end = start + message.length();
+    const char *line = start;
+    bool allAllowed = true;
+    while (line < end) {
+        const char *next = (const char *)memchr(line, END_DELIM, end - line);
+        next = (next != nullptr) ? next + 1 : end;
+        if (allow(find(line, next - line), transport)) {
+            if (!allAllowed) {
+                allowed.concat(line, next - line);
+            }
+        } else if (allAllowed) {
+            allAllowed = false;
+            allowed = "";
+            allowed.concat(start, line - start); // The lines before this one were allowed
+        }
+        line = next;
+    }
+    return allAllowed;
+}
+
+DashPolicy *DashPolicyTable::get(uint8_t index) {
+    if ((index < POLICY_TABLE_SIZE) && (policies[index].hash != 0)) {
+        return &policies[index];
+    }
+    return nullptr;
+}
+
+void DashPolicyTable::clear() {
+    for (uint8_t i = 0; i < POLICY_TABLE_SIZE; i++) {
+        policies[i].hash = 0;
+        policies[i].key = "";
+    }
+    numPolicies = 0;
+    clearBuckets();
+}
@@ -0,0 +1,68 @@
+#ifndef DASHIO_COMMS_POLICY_ESP_H
+#define DASHIO_COMMS_POLICY_ESP_H
+
+#include <Arduino.h>
+
+#define MAX_POLICIES 16
+#define POLICY_TABLE_SIZE 32 // Must be a power of 2, and at least twice MAX_POLICIES
+#define MAX_POLICY_BUCKETS 32 // Control IDs rate limited by POLICY_ALL_IDS policies
+#define POLICY_BUCKET_TABLE_SIZE 64 // Must be a power of 2, and at least twice MAX_POLICY_BUCKETS
+
+const uint8_t POLICY_BLOCKED = 0;
+const uint8_t POLICY_UNLIMITED = 255;
+const char POLICY_ALL_IDS[] = "*";
+
+enum PolicyTransport {
+    POLICY_BLE,
+    POLICY_TCP,
+    POLICY_MQTT,
+    NUM_POLICY_TRANSPORTS
+};
+
+// Token bucket for each transport. Each message costs 1000, refilled at rate per ms
+struct DashPolicyBucket {
+    uint32_t hash = 0; // controlType and controlID, for buckets of POLICY_ALL_IDS policies. 0 for an empty slot
+    uint32_t tokensMs[NUM_POLICY_TRANSPORTS];
+    uint32_t lastMs = 0;
+};
+
+// Outbound policy for a control type and control ID (or POLICY_ALL_IDS).
+// Each transport is POLICY_BLOCKED, POLICY_UNLIMITED or rate limited to a number of messages per second.
+// A POLICY_ALL_IDS policy rate limits each control ID separately.
+struct DashPolicy {
+    uint32_t hash = 0; // 0 for an empty slot
+    String key; // controlType DELIM controlID
+    uint8_t rate[NUM_POLICY_TRANSPORTS];
+    DashPolicyBucket bucket; // For a single control ID, or shared by control IDs when the bucket table is full
+    uint32_t drops = 0;
+};
+
+struct DashPolicyMatch {
+    DashPolicy *policy = nullptr;
+    DashPolicyBucket *bucket = nullptr;
+};
+
+class DashPolicyTable {
+public:
+    bool add(const char *controlType, const char *controlID, uint8_t bleRate, uint8_t tcpRate, uint8_t mqttRate); // Returns false if the table is full
+    DashPolicyMatch find(const char *line, size_t length); // Policy for the control in one line of a message. The policy is nullptr if there isn't one
+    bool allow(DashPolicyMatch match, PolicyTransport transport); // Takes a token. Counts a drop if not allowed
+    bool filter(const String& message, PolicyTransport transport, String& allowed); // Applies the policy to each line. Returns true if every line is allowed, otherwise allowed holds the lines that are
+    DashPolicy *get(uint8_t index); // For iterating over the table. Returns nullptr for empty slots
+    void clear();
+    uint8_t count() { return numPolicies; }
+
+private:
+    DashPolicy policies[POLICY_TABLE_SIZE];
+    uint8_t numPolicies = 0;
+    DashPolicyBucket buckets[POLICY_BUCKET_TABLE_SIZE]; // Hash collisions just share a bucket
+    uint8_t numBuckets = 0;
+
+    DashPolicy *lookup(uint32_t hashVal, const char *controlType, int typeLen, const char *controlID, int idLen);
+    DashPolicyBucket *idBucket(DashPolicy *policy, uint32_t hashVal);
+    void clearBuckets();
+    static void fillBucket(DashPolicy *policy, DashPolicyBucket *bucket);
+    static uint32_t policyHash(const char *controlType, int typeLen, const char *controlID, int idLen);
+};
+
+#endif
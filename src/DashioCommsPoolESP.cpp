@@ -0,0 +1,127 @@
+#include <DashioCommsPoolESP.h>
+
+DashMessageSlot::DashMessageSlot(DashMessageSlot&& other) {
+    take(other);
+}
+
+DashMessageSlot& DashMessageSlot::operator=(DashMessageSlot&& other) {
+    if (this != &other) {
+        release();
+        take(other);
+    }
+    return *this;
+}
+
+void DashMessageSlot::take(DashMessageSlot& other) {
+    pool = other.pool;
+    sizeClass = other.sizeClass;
+    index = other.index;
+    if (pool != nullptr) {
+        message = other.message;
+    } else {
+        heapMessage = std::move(other.heapMessage);
+        message = &heapMessage;
+    }
+    other.pool = nullptr;
+    other.message = &other.heapMessage;
+}
+
+void DashMessageSlot::release() {
+    if (pool != nullptr) {
+        pool->release(sizeClass, index);
+        pool = nullptr;
+        message = &heapMessage;
+    }
+}
+
+DashMessagePool::~DashMessagePool() {
+    for (uint8_t i = 0; i < NUM_POOL_CLASSES; i++) {
+        delete[] slots[i];
+    }
+}
+
+void DashMessagePool::begin(uint8_t smallSlots, uint8_t mediumSlots, uint8_t largeSlots, uint16_t largeSize) {
+    uint8_t numSlots[NUM_POOL_CLASSES] = {smallSlots, mediumSlots, largeSlots};
+    uint16_t slotSizes[NUM_POOL_CLASSES] = {POOL_SMALL_SIZE, POOL_MEDIUM_SIZE, largeSize};
+
+    for (uint8_t i = 0; i < NUM_POOL_CLASSES; i++) {
+        if (numSlots[i] > MAX_POOL_SLOTS) {
+            numSlots[i] = MAX_POOL_SLOTS;
+        }
+        poolStats[i] = DashPoolStats();
+        poolStats[i].slotSize = slotSizes[i];
+        poolStats[i].slots = numSlots[i];
+        if (numSlots[i] > 0) {
+            slots[i] = new String[numSlots[i]];
+            for (uint8_t j = 0; j < numSlots[i]; j++) {
+                slots[i][j].reserve(slotSizes[i] - 1);
+            }
+            freeMask[i] = (numSlots[i] == 32) ? 0xFFFFFFFF : ((1UL << numSlots[i]) - 1);
+        }
+    }
+}
+
+DashMessageSlot DashMessagePool::acquire(uint32_t length) {
+    DashMessageSlot slot;
+
+    uint8_t wanted = NUM_POOL_CLASSES;
+    for (uint8_t i = 0; i < NUM_POOL_CLASSES; i++) {
+        if ((poolStats[i].slots > 0) && (length < poolStats[i].slotSize)) {
+            wanted = i;
+            break;
+        }
+    }
+
+    portENTER_CRITICAL(&mux);
+    for (uint8_t i = wanted; i < NUM_POOL_CLASSES; i++) {
+        if (freeMask[i] != 0) {
+            uint8_t index = __builtin_ctz(freeMask[i]);
+            freeMask[i] &= ~(1UL << index);
+            DashPoolStats *classStats = &poolStats[i];
+            classStats->acquired++;
+            classStats->inUse++;
+            if (classStats->inUse > classStats->peak) {
+                classStats->peak = classStats->inUse;
+            }
+            slot.pool = this;
+            slot.sizeClass = i;
+            slot.index = index;
+            slot.message = &slots[i][index];
+            break;
+        }
+    }
+    if ((slot.pool == nullptr) && (wanted < NUM_POOL_CLASSES)) {
+        poolStats[wanted].failed++;
+    } else if (slot.pool == nullptr) {
+        poolStats[POOL_LARGE].failed++; // Longer than the large slots
+    }
+    portEXIT_CRITICAL(&mux);
+
+    *slot.message = "";
+    return slot;
+}
+
+void DashMessagePool::release(uint8_t sizeClass, uint8_t index) {
+    portENTER_CRITICAL(&mux);
+    freeMask[sizeClass] |= (1UL << index);
+    poolStats[sizeClass].inUse--;
+    portEXIT_CRITICAL(&mux);
+}
+
+DashPoolStats DashMessagePool::stats(uint8_t sizeClass) {
+    DashPoolStats classStats;
+    if (sizeClass < NUM_POOL_CLASSES) {
+        portENTER_CRITICAL(&mux);
+        classStats = poolStats[sizeClass];
+        portEXIT_CRITICAL(&mux);
+    }
+    return classStats;
+}
+
+uint32_t DashMessagePool::bytes() {
+    uint32_t total = 0;
+    for (uint8_t i = 0; i < NUM_POOL_CLASSES; i++) {
+        total += (uint32_t)poolStats[i].slots * poolStats[i].slotSize;
+    }
+    return total;
+}
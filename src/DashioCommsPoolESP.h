@@ -0,0 +1,69 @@
+#ifndef DASHIO_COMMS_POOL_ESP_H
+#define DASHIO_COMMS_POOL_ESP_H
+
+#include <Arduino.h>
+
+#define MAX_POOL_SLOTS 32 // Per size class
+#define POOL_SMALL_SIZE 128 // Bytes, including the terminator
+#define POOL_MEDIUM_SIZE 512
+
+enum DashPoolClass : uint8_t {
+    POOL_SMALL,
+    POOL_MEDIUM,
+    POOL_LARGE,
+    NUM_POOL_CLASSES
+};
+
+struct DashPoolStats {
+    uint16_t slotSize = 0;
+    uint8_t slots = 0;
+    uint8_t inUse = 0;
+    uint8_t peak = 0;
+    uint32_t acquired = 0;
+    uint32_t failed = 0; // No free slot large enough, so the message was built on the heap
+};
+
+class DashMessagePool;
+
+// Handle to a pooled String, reserved to the slot size so that building a message in it does not allocate.
+// Returned to the pool when the handle is destroyed. Build messages with += or concat, as assigning a temporary String may swap its buffer in.
+class DashMessageSlot {
+public:
+    DashMessageSlot() {}
+    DashMessageSlot(DashMessageSlot&& other);
+    DashMessageSlot& operator=(DashMessageSlot&& other);
+    DashMessageSlot(const DashMessageSlot&) = delete;
+    DashMessageSlot& operator=(const DashMessageSlot&) = delete;
+    ~DashMessageSlot() { release(); }
+
+    String& str() { return *message; }
+    void release();
+
+private:
+    friend class DashMessagePool;
+    DashMessagePool *pool = nullptr;
+    String *message = &heapMessage;
+    uint8_t sizeClass = 0;
+    uint8_t index = 0;
+    String heapMessage; // Used when the pool has no free slot
+    void take(DashMessageSlot& other);
+};
+
+class DashMessagePool {
+public:
+    ~DashMessagePool();
+    void begin(uint8_t smallSlots, uint8_t mediumSlots, uint8_t largeSlots, uint16_t largeSize);
+    DashMessageSlot acquire(uint32_t length); // Slot for a message of length bytes
+    DashPoolStats stats(uint8_t sizeClass);
+    uint32_t bytes(); // Total reserved
+
+private:
+    friend class DashMessageSlot;
+    String *slots[NUM_POOL_CLASSES] = {};
+    uint32_t freeMask[NUM_POOL_CLASSES] = {};
+    DashPoolStats poolStats[NUM_POOL_CLASSES];
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+    void release(uint8_t sizeClass, uint8_t index);
+};
+
+#endif
@@ -0,0 +1,29 @@
+#include <DashioCommsPowerESP.h>
+
+bool DashPowerManager::update(PowerRadio radio, PowerMode *newMode) {
+    uint32_t nowMs = millis();
+    uint32_t quietMs = nowMs - lastActivityMs[radio];
+    PowerMode mode = POWER_ACTIVE;
+    if (quietMs >= dozeMs) {
+        mode = POWER_DOZE;
+    } else if (quietMs >= idleMs) {
+        mode = POWER_IDLE;
+    }
+
+    DashPowerStats *powerStats = &radioStats[radio];
+    if (mode == powerStats->mode) {
+        return false;
+    }
+    powerStats->modeMs[powerStats->mode] += nowMs - modeStartMs[radio];
+    modeStartMs[radio] = nowMs;
+    powerStats->mode = mode;
+    powerStats->changes++;
+    *newMode = mode;
+    return true;
+}
+
+DashPowerStats DashPowerManager::stats(PowerRadio radio) {
+    DashPowerStats powerStats = radioStats[radio];
+    powerStats.modeMs[powerStats.mode] += millis() - modeStartMs[radio]; // Include time in the current mode
+    return powerStats;
+}
@@ -0,0 +1,43 @@
+#ifndef DASHIO_COMMS_POWER_ESP_H
+#define DASHIO_COMMS_POWER_ESP_H
+
+#include <Arduino.h>
+
+enum PowerRadio : uint8_t {
+    POWER_WIFI, // TCP and MQTT traffic
+    POWER_BLE,
+    NUM_POWER_RADIOS
+};
+
+enum PowerMode : uint8_t {
+    POWER_ACTIVE,
+    POWER_IDLE, // No traffic for idleMs
+    POWER_DOZE, // No traffic for dozeMs
+    NUM_POWER_MODES
+};
+
+const char * const POWER_MODE_NAMES[NUM_POWER_MODES] = {"ACTIVE", "IDLE", "DOZE"};
+
+struct DashPowerStats {
+    PowerMode mode = POWER_ACTIVE;
+    uint32_t modeMs[NUM_POWER_MODES] = {}; // Time spent in each mode
+    uint32_t changes = 0;
+};
+
+// Chooses a power mode for each radio from the time since its last message in or out.
+class DashPowerManager {
+public:
+    void activity(PowerRadio radio) { lastActivityMs[radio] = millis(); }
+    bool update(PowerRadio radio, PowerMode *newMode); // Returns true if the radio should change mode
+    DashPowerStats stats(PowerRadio radio);
+
+    uint32_t idleMs = 5000;
+    uint32_t dozeMs = 60000;
+
+private:
+    uint32_t lastActivityMs[NUM_POWER_RADIOS] = {};
+    uint32_t modeStartMs[NUM_POWER_RADIOS] = {};
+    DashPowerStats radioStats[NUM_POWER_RADIOS];
+};
+
+#endif
@@ -0,0 +1,93 @@
+#include <DashioCommsProbeESP.h>
+
+uint32_t DashLinkProbe::ping(uint32_t nowUs, uint32_t timeoutUs) {
+    portENTER_CRITICAL(&mux);
+    for (uint8_t i = 0; i < PROBE_WINDOW; i++) {
+        if ((pingSeq[i] != 0) && ((nowUs - pingUs[i]) > timeoutUs)) {
+            pingSeq[i] = 0;
+            linkStats.lost++;
+        }
+    }
+
+    uint32_t seq = nextSeq++;
+    if (nextSeq == 0) {
+        nextSeq = 1; // 0 marks an empty slot
+    }
+    uint8_t index = seq & (PROBE_WINDOW - 1);
+    if (pingSeq[index] != 0) {
+        linkStats.lost++; // Overwritten before its PONG arrived
+    }
+    pingSeq[index] = seq;
+    pingUs[index] = nowUs;
+    linkStats.sent++;
+    portEXIT_CRITICAL(&mux);
+    return seq;
+}
+
+bool DashLinkProbe::pong(uint32_t seq, uint32_t nowUs) {
+    bool found = false;
+    portENTER_CRITICAL(&mux);
+    uint8_t index = seq & (PROBE_WINDOW - 1);
+    if ((seq != 0) && (pingSeq[index] == seq)) {
+        pingSeq[index] = 0;
+        linkStats.received++;
+        addSample(nowUs - pingUs[index]);
+        found = true;
+    }
+    portEXIT_CRITICAL(&mux);
+    return found;
+}
+
+void DashLinkProbe::sample(uint32_t us) {
+    portENTER_CRITICAL(&mux);
+    linkStats.sent++;
+    linkStats.received++;
+    addSample(us);
+    portEXIT_CRITICAL(&mux);
+}
+
+void DashLinkProbe::addSample(uint32_t us) {
+    if (numSamples > 0) {
+        uint32_t diff = (us > linkStats.lastUs) ? (us - linkStats.lastUs) : (linkStats.lastUs - us);
+        linkStats.jitterUs = linkStats.jitterUs - (linkStats.jitterUs >> 4) + (diff >> 4);
+    }
+    linkStats.lastUs = us;
+    samples[sampleHead] = us;
+    sampleHead = (sampleHead + 1) & (PROBE_WINDOW - 1);
+    if (numSamples < PROBE_WINDOW) {
+        numSamples++;
+    }
+}
+
+DashLinkStats DashLinkProbe::stats() {
+    portENTER_CRITICAL(&mux);
+    DashLinkStats windowStats = linkStats;
+    if (numSamples > 0) {
+        uint64_t total = 0;
+        windowStats.minUs = UINT32_MAX;
+        for (uint8_t i = 0; i < numSamples; i++) {
+            uint32_t us = samples[i];
+            total += us;
+            if (us < windowStats.minUs) {
+                windowStats.minUs = us;
+            }
+            if (us > windowStats.maxUs) {
+                windowStats.maxUs = us;
+            }
+        }
+        windowStats.avgUs = total / numSamples;
+    }
+    portEXIT_CRITICAL(&mux);
+    return windowStats;
+}
+
+void DashLinkProbe::clear() {
+    portENTER_CRITICAL(&mux);
+    for (uint8_t i = 0; i < PROBE_WINDOW; i++) {
+        pingSeq[i] = 0;
+    }
+    sampleHead = 0;
+    numSamples = 0;
+    linkStats = DashLinkStats();
+    portEXIT_CRITICAL(&mux);
+}
@@ -0,0 +1,48 @@
+#ifndef DASHIO_COMMS_PROBE_ESP_H
+#define DASHIO_COMMS_PROBE_ESP_H
+
+#include <Arduino.h>
+
+#define PROBE_WINDOW 16 // Pings awaiting a PONG, and samples in the rolling stats. Must be a power of 2
+
+enum ProbeLink : uint8_t {
+    PROBE_SERIAL, // Round trip time to the serial master
+    PROBE_BLE, // Time to send on each connection
+    PROBE_TCP,
+    PROBE_MQTT,
+    NUM_PROBE_LINKS
+};
+
+struct DashLinkStats {
+    uint32_t sent = 0;
+    uint32_t received = 0;
+    uint32_t lost = 0; // No PONG within the timeout
+    uint32_t lastUs = 0;
+    uint32_t minUs = 0; // min, avg and max are over the last PROBE_WINDOW samples
+    uint32_t avgUs = 0;
+    uint32_t maxUs = 0;
+    uint32_t jitterUs = 0; // Smoothed difference between consecutive samples (as for RTP)
+};
+
+// Link quality for one link. Pings are numbered, and each PONG is matched to its ping by sequence number.
+class DashLinkProbe {
+public:
+    uint32_t ping(uint32_t nowUs, uint32_t timeoutUs); // Returns the sequence number for the next ping
+    bool pong(uint32_t seq, uint32_t nowUs); // Returns false for an unknown or late PONG
+    void sample(uint32_t us); // Adds a measurement that doesn't need a PONG
+    DashLinkStats stats();
+    void clear();
+
+private:
+    uint32_t nextSeq = 1;
+    uint32_t pingSeq[PROBE_WINDOW] = {}; // 0 for not waiting
+    uint32_t pingUs[PROBE_WINDOW];
+    uint32_t samples[PROBE_WINDOW];
+    uint8_t sampleHead = 0;
+    uint8_t numSamples = 0;
+    DashLinkStats linkStats;
+    portMUX_TYPE mux = portMUX_INITIALIZER_UNLOCKED;
+    void addSample(uint32_t us);
+};
+
+#endif
@@ -0,0 +1,110 @@
+#include <DashioCommsRegistryESP.h>
+
+DashStoreRegistry::~DashStoreRegistry() {
+    delete[] entries;
+}
+
+void DashStoreRegistry::begin(uint16_t maxSize, uint8_t instance) {
+    entries = new char[maxSize + 1];
+    maxLength = maxSize;
+    entries[0] = '\0';
+    snprintf(key, sizeof(key), "ste%u", instance);
+}
+
+bool DashStoreRegistry::load() {
+    Preferences preferences;
+    if (!preferences.begin(REGISTRY_NAMESPACE, true)) {
+        return false;
+    }
+
+    // Blob is the revision followed by the entries
+    size_t blobLength = preferences.getBytesLength(key);
+    bool loaded = false;
+    if ((blobLength >= sizeof(uint32_t)) && (blobLength <= sizeof(uint32_t) + maxLength)) {
+        uint8_t blob[blobLength];
+        if (preferences.getBytes(key, blob, blobLength) == blobLength) {
+            memcpy(&tableRevision, blob, sizeof(uint32_t));
+            length = blobLength - sizeof(uint32_t);
+            memcpy(entries, blob + sizeof(uint32_t), length);
+            entries[length] = '\0';
+
+            numEntries = 0;
+            for (uint16_t i = 0; i < length; i++) {
+                if (entries[i] == '\n') {
+                    numEntries++;
+                }
+            }
+            loaded = true;
+        }
+    }
+    preferences.end();
+    return loaded;
+}
+
+void DashStoreRegistry::save() {
+    if (!changed) {
+        return;
+    }
+
+    Preferences preferences;
+    if (preferences.begin(REGISTRY_NAMESPACE, false)) {
+        uint8_t blob[sizeof(uint32_t) + length];
+        memcpy(blob, &tableRevision, sizeof(uint32_t));
+        memcpy(blob + sizeof(uint32_t), entries, length);
+        preferences.putBytes(key, blob, sizeof(blob));
+        preferences.end();
+        changed = false;
+    }
+}
+
+void DashStoreRegistry::reset(uint32_t revision) {
+    if ((revision != tableRevision) || (length > 0)) {
+        changed = true;
+    }
+    tableRevision = revision;
+    length = 0;
+    numEntries = 0;
+    entries[0] = '\0';
+}
+
+bool DashStoreRegistry::add(const char *controlType, const char *controlID) {
+    uint16_t typeLen = strlen(controlType);
+    uint16_t idLen = strlen(controlID);
+    uint16_t entryLen = typeLen + idLen + 2;
+
+    char entry[entryLen + 1];
+    snprintf(entry, sizeof(entry), "%s\t%s\n", controlType, controlID);
+
+    // Entries start at 0 or after a newline
+    for (char *found = strstr(entries, entry); found != nullptr; found = strstr(found + 1, entry)) {
+        if ((found == entries) || (found[-1] == '\n')) {
+            return true;
+        }
+    }
+
+    if (length + entryLen > maxLength) {
+        return false;
+    }
+    memcpy(&entries[length], entry, entryLen + 1);
+    length += entryLen;
+    numEntries++;
+    changed = true;
+    return true;
+}
+
+bool DashStoreRegistry::get(uint16_t *pos, String& controlType, String& controlID) {
+    if (*pos >= length) {
+        return false;
+    }
+    const char *entry = &entries[*pos];
+    const char *tab = strchr(entry, '\t');
+    const char *end = strchr(entry, '\n');
+    if ((tab == nullptr) || (end == nullptr) || (tab > end)) {
+        *pos = length;
+        return false;
+    }
+    controlType = String(entry, tab - entry);
+    controlID = String(tab + 1, end - tab - 1);
+    *pos = end - entries + 1;
+    return true;
+}
@@ -0,0 +1,36 @@
+#ifndef DASHIO_COMMS_REGISTRY_ESP_H
+#define DASHIO_COMMS_REGISTRY_ESP_H
+
+#include <Arduino.h>
+#include <Preferences.h>
+
+#define REGISTRY_NAMESPACE "dashStore"
+
+// Dash store registrations (CTRL STE) from the serial master, kept in NVS with the master's config revision.
+// Entries are packed as controlType TAB controlID NEWLINE, so the table is one NVS blob.
+class DashStoreRegistry {
+public:
+    ~DashStoreRegistry();
+
+    void begin(uint16_t maxSize, uint8_t instance); // maxSize bytes of entries
+    bool load(); // Reads the table from NVS. Returns false if there isn't one
+    void save(); // Writes the table to NVS, if changed
+    void reset(uint32_t revision); // Empties the table for a new config revision
+
+    bool add(const char *controlType, const char *controlID); // Ignores duplicates. Returns false if the table is full
+    bool get(uint16_t *pos, String& controlType, String& controlID); // For iterating over the table from pos 0. Returns false at the end
+
+    uint32_t revision() { return tableRevision; }
+    uint16_t count() { return numEntries; }
+
+private:
+    char *entries = nullptr;
+    uint16_t maxLength = 0;
+    uint16_t length = 0;
+    uint16_t numEntries = 0;
+    uint32_t tableRevision = 0;
+    bool changed = false;
+    char key[8];
+};
+
+#endif
@@ -0,0 +1,101 @@
+#include <DashioCommsRouteESP.h>
+#include <DashioCommsHashESP.h>
+
+DashRouteTable::DashRouteTable() {
+    memset(slots, ROUTE_EMPTY, sizeof(slots));
+}
+
+DashRouteTable::~DashRouteTable() {
+    for (uint8_t i = 0; i < MAX_ROUTED_DEVICES; i++) {
+        delete[] routes[i].configC64;
+    }
+}
+
+DashRoute *DashRouteTable::find(const char *deviceID) {
+    uint32_t hashVal = dashHash(deviceID, strlen(deviceID));
+    for (uint8_t i = 0; i < ROUTE_TABLE_SIZE; i++) {
+        uint8_t index = (hashVal + i) & (ROUTE_TABLE_SIZE - 1);
+        if (slots[index] == ROUTE_EMPTY) {
+            return nullptr;
+        }
+        DashRoute *route = &routes[slots[index]];
+        if ((hashes[index] == hashVal) && (route->deviceID == deviceID)) {
+            return route;
+        }
+    }
+    return nullptr;
+}
+
+DashRoute *DashRouteTable::add(const String& deviceID, bool primary) {
+    if (numRoutes >= MAX_ROUTED_DEVICES) {
+        return nullptr;
+    }
+
+    uint8_t routeIndex = 0;
+    while (routes[routeIndex].deviceID.length() > 0) {
+        routeIndex++;
+    }
+
+    uint32_t hashVal = dashHash(deviceID.c_str(), deviceID.length());
+    for (uint8_t i = 0; i < ROUTE_TABLE_SIZE; i++) {
+        uint8_t index = (hashVal + i) & (ROUTE_TABLE_SIZE - 1);
+        if (slots[index] == ROUTE_EMPTY) {
+            DashRoute *route = &routes[routeIndex];
+            route->deviceID = deviceID;
+            route->primary = primary;
+            route->lastSeenMs = millis();
+            slots[index] = routeIndex;
+            hashes[index] = hashVal;
+            numRoutes++;
+            return route;
+        }
+    }
+    return nullptr;
+}
+
+void DashRouteTable::remove(DashRoute *route) {
+    uint8_t routeIndex = route - routes;
+    uint8_t hole = 0;
+    while ((hole < ROUTE_TABLE_SIZE) && (slots[hole] != routeIndex)) {
+        hole++;
+    }
+    if (hole >= ROUTE_TABLE_SIZE) {
+        return;
+    }
+
+    // Move later entries in the probe sequence back into the hole, so find doesn't stop early
+    slots[hole] = ROUTE_EMPTY;
+    for (uint8_t i = 1; i < ROUTE_TABLE_SIZE; i++) {
+        uint8_t index = (hole + i) & (ROUTE_TABLE_SIZE - 1);
+        if (slots[index] == ROUTE_EMPTY) {
+            break;
+        }
+        uint8_t home = hashes[index] & (ROUTE_TABLE_SIZE - 1);
+        if (((index - home) & (ROUTE_TABLE_SIZE - 1)) >= ((index - hole) & (ROUTE_TABLE_SIZE - 1))) {
+            slots[hole] = slots[index];
+            hashes[hole] = hashes[index];
+            slots[index] = ROUTE_EMPTY;
+            hole = index;
+            i = 0;
+        }
+    }
+
+    delete[] route->configC64;
+    route->configC64 = nullptr;
+    route->deviceID = "";
+    route->primary = false;
+    numRoutes--;
+}
+
+DashRoute *DashRouteTable::findIdle(unsigned long now, uint32_t timeoutMs) {
+    DashRoute *idle = nullptr;
+    for (uint8_t i = 0; i < MAX_ROUTED_DEVICES; i++) {
+        DashRoute *route = &routes[i];
+        if ((route->deviceID.length() > 0) && !route->primary && ((now - route->lastSeenMs) >= timeoutMs)) {
+            if ((idle == nullptr) || ((now - route->lastSeenMs) > (now - idle->lastSeenMs))) {
+                idle = route;
+            }
+        }
+    }
+    return idle;
+}
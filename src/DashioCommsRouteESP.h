@@ -0,0 +1,39 @@
+#ifndef DASHIO_COMMS_ROUTE_ESP_H
+#define DASHIO_COMMS_ROUTE_ESP_H
+
+#include <Arduino.h>
+
+#define MAX_ROUTED_DEVICES 8 // Serial masters (including the primary) that can share one comms module
+#define ROUTE_TABLE_SIZE 16 // Must be a power of 2, and at least twice MAX_ROUTED_DEVICES
+#define ROUTE_EMPTY 0xFF
+
+// A serial master behind this comms module. Secondary masters are only routed by device ID. They have no DashDevice,
+// so their type, name and config are not used and they have no MQTT topics.
+struct DashRoute {
+    String deviceID; // Empty for an unused entry
+    bool primary = false; // The comms module's own DashDevice
+    unsigned long lastSeenMs = 0; // Time of the last message from this master
+    char *configC64 = nullptr; // Layout config provided by the primary master
+};
+
+// Small open addressing hash map from device ID to route. Routes don't move while they are in the table,
+// so route pointers (e.g. for delta streams) stay valid until the route is removed.
+class DashRouteTable {
+public:
+    DashRouteTable();
+    ~DashRouteTable();
+
+    DashRoute *find(const char *deviceID);
+    DashRoute *add(const String& deviceID, bool primary);
+    void remove(DashRoute *route);
+    DashRoute *findIdle(unsigned long now, uint32_t timeoutMs); // Oldest secondary without a message for timeoutMs, or nullptr
+    uint8_t count() { return numRoutes; }
+
+private:
+    DashRoute routes[MAX_ROUTED_DEVICES];
+    uint8_t slots[ROUTE_TABLE_SIZE]; // Index into routes, or ROUTE_EMPTY
+    uint32_t hashes[ROUTE_TABLE_SIZE];
+    uint8_t numRoutes = 0;
+};
+
+#endif
@@ -0,0 +1,439 @@
+#include <DashioCommsStoreESP.h>
+#include <stdlib.h>
+
+#ifdef ESP_PLATFORM
+#include <esp_heap_caps.h>
+#endif
+
+// ---------------------------------------- Memory Storage ----------------------------------------
+
+DashMemoryLogStorage::DashMemoryLogStorage(uint32_t size) {
+    size = (size / LOG_SECTOR_SIZE) * LOG_SECTOR_SIZE;
+#ifdef ESP_PLATFORM
+    buffer = (uint8_t *)heap_caps_malloc(size, MALLOC_CAP_SPIRAM | MALLOC_CAP_8BIT);
+    if (buffer == nullptr) {
+        buffer = (uint8_t *)heap_caps_malloc(size, MALLOC_CAP_8BIT);
+    }
+#else
+    buffer = (uint8_t *)malloc(size);
+#endif
+    if (buffer != nullptr) {
+        storageSize = size;
+        memset(buffer, 0xFF, storageSize);
+    }
+}
+
+DashMemoryLogStorage::~DashMemoryLogStorage() {
+    free(buffer);
+}
+
+bool DashMemoryLogStorage::read(uint32_t offset, void *data, uint32_t len) {
+    if (offset + len > storageSize) {
+        return false;
+    }
+    memcpy(data, buffer + offset, len);
+    return true;
+}
+
+bool DashMemoryLogStorage::write(uint32_t offset, const void *data, uint32_t len) {
+    if (offset + len > storageSize) {
+        return false;
+    }
+    memcpy(buffer + offset, data, len);
+    return true;
+}
+
+bool DashMemoryLogStorage::eraseSector(uint32_t offset) {
+    if (offset + LOG_SECTOR_SIZE > storageSize) {
+        return false;
+    }
+    memset(buffer + offset, 0xFF, LOG_SECTOR_SIZE);
+    return true;
+}
+
+// ---------------------------------------- File Storage ----------------------------------------
+
+DashFileLogStorage::DashFileLogStorage(const char *path, uint32_t size) {
+    size = (size / LOG_SECTOR_SIZE) * LOG_SECTOR_SIZE;
+    file = fopen(path, "r+b");
+    if (file == nullptr) {
+        file = fopen(path, "w+b");
+    }
+    if (file == nullptr) {
+        return;
+    }
+
+    // Extend a new (or short) file with erased sectors
+    fseek(file, 0, SEEK_END);
+    long fileSize = ftell(file);
+    if (fileSize < (long)size) {
+        uint8_t erased[64];
+        memset(erased, 0xFF, sizeof(erased));
+        for (long i = fileSize; i < (long)size; i += sizeof(erased)) {
+            fwrite(erased, 1, ((long)size - i < (long)sizeof(erased)) ? size - i : sizeof(erased), file);
+        }
+        fflush(file);
+    }
+    storageSize = size;
+}
+
+DashFileLogStorage::~DashFileLogStorage() {
+    if (file != nullptr) {
+        fclose(file);
+    }
+}
+
+bool DashFileLogStorage::read(uint32_t offset, void *data, uint32_t len) {
+    if ((file == nullptr) || (offset + len > storageSize)) {
+        return false;
+    }
+    fseek(file, offset, SEEK_SET);
+    return fread(data, 1, len, file) == len;
+}
+
+bool DashFileLogStorage::write(uint32_t offset, const void *data, uint32_t len) {
+    if ((file == nullptr) || (offset + len > storageSize)) {
+        return false;
+    }
+    fseek(file, offset, SEEK_SET);
+    bool ok = fwrite(data, 1, len, file) == len;
+    fflush(file);
+    return ok;
+}
+
+bool DashFileLogStorage::eraseSector(uint32_t offset) {
+    uint8_t erased[256];
+    memset(erased, 0xFF, sizeof(erased));
+    for (uint32_t i = 0; i < LOG_SECTOR_SIZE; i += sizeof(erased)) {
+        if (!write(offset + i, erased, sizeof(erased))) {
+            return false;
+        }
+    }
+    return true;
+}
+
+// ---------------------------------------- Partition Storage ----------------------------------------
+
+#ifdef ESP_PLATFORM
+DashPartitionLogStorage::DashPartitionLogStorage(const char *label) {
+    partition = esp_partition_find_first(ESP_PARTITION_TYPE_DATA, ESP_PARTITION_SUBTYPE_ANY, label);
+}
+
+uint32_t DashPartitionLogStorage::size() {
+    if (partition == nullptr) {
+        return 0;
+    }
+    return (partition->size / LOG_SECTOR_SIZE) * LOG_SECTOR_SIZE;
+}
+
+bool DashPartitionLogStorage::read(uint32_t offset, void *data, uint32_t len) {
+    return (partition != nullptr) && (esp_partition_read(partition, offset, data, len) == ESP_OK);
+}
+
+bool DashPartitionLogStorage::write(uint32_t offset, const void *data, uint32_t len) {
+    return (partition != nullptr) && (esp_partition_write(partition, offset, data, len) == ESP_OK);
+}
+
+bool DashPartitionLogStorage::eraseSector(uint32_t offset) {
+    return (partition != nullptr) && (esp_partition_erase_range(partition, offset, LOG_SECTOR_SIZE) == ESP_OK);
+}
+#endif
+
+// ---------------------------------------- Ring Log ----------------------------------------
+
+static uint32_t logCRC(const void *data, uint32_t len, uint32_t crc = 0) { // CRC-32 (as for zlib), a nibble at a time
+    static const uint32_t table[16] = {
+        0x00000000, 0x1DB71064, 0x3B6E20C8, 0x26D930AC, 0x76DC4190, 0x6B6B51F4, 0x4DB26158, 0x5005713C,
+        0xEDB88320, 0xF00F9344, 0xD6D6A3E8, 0xCB61B38C, 0x9B64C2B0, 0x86D3D2D4, 0xA00AE278, 0xBDBDF21C
+    };
+    const uint8_t *bytes = (const uint8_t *)data;
+    crc = ~crc;
+    for (uint32_t i = 0; i < len; i++) {
+        crc = table[(crc ^ bytes[i]) & 0x0F] ^ (crc >> 4);
+        crc = table[(crc ^ (bytes[i] >> 4)) & 0x0F] ^ (crc >> 4);
+    }
+    return ~crc;
+}
+
+DashRingLog::DashRingLog(DashLogStorage *storage) {
+    this->storage = storage;
+    memset(keyHashes, 0, sizeof(keyHashes));
+}
+
+bool DashRingLog::readHeader(uint32_t offset, DashLogRecordHeader *header) {
+    if (!storage->read(offset, header, sizeof(DashLogRecordHeader))) {
+        return false;
+    }
+    if ((header->magic != LOG_MAGIC) || (header->length > maxRecordLength())) {
+        return false;
+    }
+    return (offset % LOG_SECTOR_SIZE) + recordSize(header->length) <= LOG_SECTOR_SIZE;
+}
+
+bool DashRingLog::checkRecord(uint32_t offset, const DashLogRecordHeader *header) {
+    uint8_t buffer[64];
+    uint32_t crc = logCRC(header, offsetof(DashLogRecordHeader, crc));
+    for (uint32_t i = 0; i < header->length; i += sizeof(buffer)) {
+        uint32_t len = (header->length - i < sizeof(buffer)) ? header->length - i : sizeof(buffer);
+        if (!storage->read(offset + sizeof(DashLogRecordHeader) + i, buffer, len)) {
+            return false;
+        }
+        crc = logCRC(buffer, len, crc);
+    }
+    return crc == header->crc;
+}
+
+bool DashRingLog::isErased(uint32_t offset, uint32_t len) {
+    uint8_t buffer[64];
+    for (uint32_t i = 0; i < len; i += sizeof(buffer)) {
+        uint32_t chunk = (len - i < sizeof(buffer)) ? len - i : sizeof(buffer);
+        if (!storage->read(offset + i, buffer, chunk)) {
+            return false;
+        }
+        for (uint32_t j = 0; j < chunk; j++) {
+            if (buffer[j] != 0xFF) {
+                return false;
+            }
+        }
+    }
+    return true;
+}
+
+void DashRingLog::setState(uint32_t offset, uint8_t state) {
+    storage->write(offset + offsetof(DashLogRecordHeader, state), &state, 1);
+}
+
+void DashRingLog::setKey(uint32_t keyHash, uint32_t offset) {
+    uint32_t index = keyHash & (LOG_KEY_TABLE_SIZE - 1);
+    for (uint32_t i = 0; i < LOG_KEY_TABLE_SIZE; i++) {
+        uint32_t slot = (index + i) & (LOG_KEY_TABLE_SIZE - 1);
+        if (keyHashes[slot] == keyHash) {
+            setState(keyOffsets[slot], LOG_STATE_SUPERSEDED);
+            numPending--;
+            numDropped++;
+            keyOffsets[slot] = offset;
+            return;
+        }
+        if (keyHashes[slot] == 0) {
+            keyHashes[slot] = keyHash;
+            keyOffsets[slot] = offset;
+            return;
+        }
+    }
+    // Table full, so the record is kept without superseding older records
+}
+
+void DashRingLog::removeKey(uint32_t offset) {
+    for (uint32_t slot = 0; slot < LOG_KEY_TABLE_SIZE; slot++) {
+        if ((keyHashes[slot] != 0) && (keyOffsets[slot] == offset)) {
+            // Open addressing, so reinsert the rest of the cluster after removing
+            keyHashes[slot] = 0;
+            uint32_t next = (slot + 1) & (LOG_KEY_TABLE_SIZE - 1);
+            while (keyHashes[next] != 0) {
+                uint32_t keyHash = keyHashes[next];
+                uint32_t keyOffset = keyOffsets[next];
+                keyHashes[next] = 0;
+                uint32_t index = keyHash & (LOG_KEY_TABLE_SIZE - 1);
+                while (keyHashes[index] != 0) {
+                    index = (index + 1) & (LOG_KEY_TABLE_SIZE - 1);
+                }
+                keyHashes[index] = keyHash;
+                keyOffsets[index] = keyOffset;
+                next = (next + 1) & (LOG_KEY_TABLE_SIZE - 1);
+            }
+            return;
+        }
+    }
+}
+
+void DashRingLog::freeSector(uint32_t offset) { // Drops any pending records in the sector and erases it
+    uint32_t sectorStart = offset - (offset % LOG_SECTOR_SIZE);
+    uint32_t recordOffset = sectorStart;
+    DashLogRecordHeader header;
+    while ((recordOffset < sectorStart + LOG_SECTOR_SIZE) && readHeader(recordOffset, &header)) {
+        if (header.state == LOG_STATE_PENDING) {
+            if (header.keyHash != 0) {
+                removeKey(recordOffset);
+            }
+            numPending--;
+            numDropped++;
+        }
+        recordOffset += recordSize(header.length);
+    }
+    if ((numPending > 0) && (tail / LOG_SECTOR_SIZE == sectorStart / LOG_SECTOR_SIZE)) {
+        tail = nextSector(sectorStart);
+    }
+    storage->eraseSector(sectorStart);
+}
+
+void DashRingLog::format() {
+    for (uint32_t offset = 0; offset < storage->size(); offset += LOG_SECTOR_SIZE) {
+        storage->eraseSector(offset);
+    }
+    head = 0;
+    tail = 0;
+    nextSeq = 0;
+    numPending = 0;
+    memset(keyHashes, 0, sizeof(keyHashes));
+}
+
+void DashRingLog::open() {
+    head = 0;
+    tail = 0;
+    nextSeq = 0;
+    numPending = 0;
+    memset(keyHashes, 0, sizeof(keyHashes));
+    if (storage->size() < 2 * LOG_SECTOR_SIZE) {
+        return;
+    }
+
+    bool found = false;
+    uint32_t minPendingSeq = 0;
+    for (uint32_t sector = 0; sector < storage->size(); sector += LOG_SECTOR_SIZE) {
+        uint32_t offset = sector;
+        DashLogRecordHeader header;
+        while ((offset < sector + LOG_SECTOR_SIZE) && readHeader(offset, &header)) {
+            uint32_t end = offset + recordSize(header.length);
+            if (!checkRecord(offset, &header)) {
+                // Torn or corrupted, so it's never sent. The header sets its length, so the rest of the sector can still be read
+                if (header.state == LOG_STATE_PENDING) {
+                    setState(offset, LOG_STATE_SENT);
+                }
+                offset = end;
+                continue;
+            }
+            if ((!found) || ((int32_t)(header.seq - nextSeq) >= 0)) {
+                found = true;
+                nextSeq = header.seq + 1;
+                head = end % storage->size();
+            }
+            if (header.state == LOG_STATE_PENDING) {
+                if ((numPending == 0) || ((int32_t)(header.seq - minPendingSeq) < 0)) {
+                    minPendingSeq = header.seq;
+                    tail = offset;
+                }
+                numPending++;
+            }
+            offset = end;
+        }
+    }
+    // A torn append (e.g. power lost before its header was written) leaves programmed bytes at head.
+    // Flash can't be rewritten without an erase, so start at the next sector, which append erases
+    if ((head % LOG_SECTOR_SIZE != 0) && !isErased(head, LOG_SECTOR_SIZE - (head % LOG_SECTOR_SIZE))) {
+        head = nextSector(head);
+    }
+    if (numPending == 0) {
+        tail = head;
+    }
+
+    // Rebuild the newest only table from the pending records, oldest first
+    if (numPending > 0) {
+        uint32_t numKeys = numPending;
+        uint32_t offset = tail;
+        DashLogRecordHeader header;
+        while ((numKeys > 0) && (offset != head)) {
+            if (!readHeader(offset, &header)) {
+                offset = nextSector(offset);
+                continue;
+            }
+            if (header.state == LOG_STATE_PENDING) {
+                numKeys--;
+                if (header.keyHash != 0) {
+                    setKey(header.keyHash, offset);
+                }
+            }
+            offset = (offset + recordSize(header.length)) % storage->size();
+        }
+    }
+}
+
+bool DashRingLog::append(const char *data, size_t len, uint32_t keyHash, uint32_t timestamp) {
+    if ((len > maxRecordLength()) || (storage->size() < 2 * LOG_SECTOR_SIZE)) {
+        return false;
+    }
+
+    uint32_t size = recordSize((uint16_t)len);
+    if ((head % LOG_SECTOR_SIZE) + size > LOG_SECTOR_SIZE) { // Doesn't fit, so skip to the next sector
+        head = nextSector(head);
+    }
+    if (head % LOG_SECTOR_SIZE == 0) {
+        freeSector(head);
+    }
+
+    DashLogRecordHeader header;
+    header.magic = LOG_MAGIC;
+    header.length = (uint16_t)len; // No more than maxRecordLength()
+    header.seq = nextSeq++;
+    header.timestamp = timestamp;
+    header.keyHash = newestOnly ? keyHash : 0;
+    header.crc = logCRC(data, len, logCRC(&header, offsetof(DashLogRecordHeader, crc)));
+    header.state = LOG_STATE_PENDING;
+    memset(header.reserved, 0xFF, sizeof(header.reserved));
+
+    // Payload first, so a record is only valid once its header is written
+    storage->write(head + sizeof(DashLogRecordHeader), data, len);
+    storage->write(head, &header, sizeof(DashLogRecordHeader));
+
+    if (numPending == 0) {
+        tail = head;
+    }
+    numPending++;
+    if (header.keyHash != 0) {
+        setKey(header.keyHash, head);
+    }
+
+    head = (head + size) % storage->size();
+    return true;
+}
+
+int32_t DashRingLog::peek(char *data, uint16_t maxLen, uint32_t now) {
+    DashLogRecordHeader header;
+    uint32_t sectorsSkipped = 0;
+    while (numPending > 0) {
+        if (!readHeader(tail, &header)) {
+            tail = nextSector(tail); // Rest of the sector is unused
+            sectorsSkipped++;
+            if (sectorsSkipped > storage->size() / LOG_SECTOR_SIZE) {
+                numPending = 0; // Nothing left to find
+                tail = head;
+            }
+            continue;
+        }
+        if (header.state == LOG_STATE_PENDING) {
+            if ((maxAge > 0) && ((int32_t)(now - header.timestamp) > (int32_t)maxAge)) {
+                pop(); // Expired
+                numDropped++;
+                continue;
+            }
+            if (header.length > maxLen) {
+                pop(); // Can't be sent
+                numDropped++;
+                continue;
+            }
+            storage->read(tail + sizeof(DashLogRecordHeader), data, header.length);
+            if (logCRC(data, header.length, logCRC(&header, offsetof(DashLogRecordHeader, crc))) != header.crc) {
+                pop(); // Corrupted
+                numDropped++;
+                continue;
+            }
+            return header.length;
+        }
+        tail = (tail + recordSize(header.length)) % storage->size();
+    }
+    return -1;
+}
+
+void DashRingLog::pop() {
+    DashLogRecordHeader header;
+    if ((numPending > 0) && readHeader(tail, &header)) {
+        setState(tail, LOG_STATE_SENT);
+        if (header.keyHash != 0) {
+            removeKey(tail);
+        }
+        numPending--;
+        tail = (tail + recordSize(header.length)) % storage->size();
+        if (numPending == 0) {
+            tail = head;
+        }
+    }
+}
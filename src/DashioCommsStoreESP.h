@@ -0,0 +1,127 @@
+#ifndef DASHIO_COMMS_STORE_ESP_H
+#define DASHIO_COMMS_STORE_ESP_H
+
+// Bounded, append only ring log for storing MQTT messages while the broker is unreachable.
+// Only depends on the C library, so the log format can be tested on a host with DashFileLogStorage.
+
+#include <stdint.h>
+#include <stddef.h>
+#include <stdio.h>
+#include <string.h>
+
+#define LOG_SECTOR_SIZE 4096 // Flash erase size. Records never cross a sector boundary
+#define LOG_KEY_TABLE_SIZE 64 // Controls tracked for newest only retention. Must be a power of 2
+
+// Storage for the ring log. Must be at least 2 sectors. Writes may only clear bits of erased (0xFF) storage, as for flash.
+class DashLogStorage {
+public:
+    virtual ~DashLogStorage() {}
+    virtual uint32_t size() = 0; // Whole sectors
+    virtual bool read(uint32_t offset, void *data, uint32_t len) = 0;
+    virtual bool write(uint32_t offset, const void *data, uint32_t len) = 0;
+    virtual bool eraseSector(uint32_t offset) = 0; // Sets the sector to 0xFF
+};
+
+// RAM storage, in PSRAM when available. Lost on reset or deep sleep.
+class DashMemoryLogStorage : public DashLogStorage {
+public:
+    DashMemoryLogStorage(uint32_t size);
+    ~DashMemoryLogStorage();
+    uint32_t size() { return storageSize; }
+    bool read(uint32_t offset, void *data, uint32_t len);
+    bool write(uint32_t offset, const void *data, uint32_t len);
+    bool eraseSector(uint32_t offset);
+
+private:
+    uint8_t *buffer = nullptr;
+    uint32_t storageSize = 0;
+};
+
+// File storage, for host testing or a file on a mounted file system (e.g. LittleFS).
+class DashFileLogStorage : public DashLogStorage {
+public:
+    DashFileLogStorage(const char *path, uint32_t size);
+    ~DashFileLogStorage();
+    uint32_t size() { return storageSize; }
+    bool read(uint32_t offset, void *data, uint32_t len);
+    bool write(uint32_t offset, const void *data, uint32_t len);
+    bool eraseSector(uint32_t offset);
+
+private:
+    FILE *file = nullptr;
+    uint32_t storageSize = 0;
+};
+
+#ifdef ESP_PLATFORM
+#include <esp_partition.h>
+
+// Flash partition storage (data partition with the given label). Survives reset and deep sleep.
+class DashPartitionLogStorage : public DashLogStorage {
+public:
+    DashPartitionLogStorage(const char *label);
+    uint32_t size();
+    bool read(uint32_t offset, void *data, uint32_t len);
+    bool write(uint32_t offset, const void *data, uint32_t len);
+    bool eraseSector(uint32_t offset);
+
+private:
+    const esp_partition_t *partition = nullptr;
+};
+#endif
+
+const uint16_t LOG_MAGIC = 0xDA52;
+const uint8_t LOG_STATE_PENDING = 0xFF;
+const uint8_t LOG_STATE_SUPERSEDED = 0x0F;
+const uint8_t LOG_STATE_SENT = 0x00;
+
+struct DashLogRecordHeader {
+    uint16_t magic;
+    uint16_t length; // Payload bytes
+    uint32_t seq;
+    uint32_t timestamp; // Seconds
+    uint32_t keyHash; // 0 if the record is never superseded
+    uint32_t crc; // CRC-32 of the fields above and the payload, so torn or corrupted records are ignored
+    uint8_t state;
+    uint8_t reserved[3];
+};
+
+class DashRingLog {
+public:
+    DashRingLog(DashLogStorage *storage);
+
+    void open(); // Recovers the log from storage
+    void format(); // Erases all records
+    bool append(const char *data, size_t len, uint32_t keyHash, uint32_t timestamp); // Returns false if longer than maxRecordLength()
+    int32_t peek(char *data, uint16_t maxLen, uint32_t now); // Oldest pending payload length, or -1 if empty
+    void pop(); // Marks the oldest pending record (from peek) as sent
+
+    uint32_t pending() { return numPending; }
+    uint32_t dropped() { return numDropped; } // Overwritten by newer records, or expired
+    uint16_t maxRecordLength() { return LOG_SECTOR_SIZE - sizeof(DashLogRecordHeader); }
+
+    uint32_t maxAge = 0; // Seconds. 0 for no limit
+    bool newestOnly = false; // Only keep the newest pending record for each keyHash
+
+private:
+    DashLogStorage *storage;
+    uint32_t head = 0; // Write offset
+    uint32_t tail = 0; // Oldest record that may be pending
+    uint32_t nextSeq = 0;
+    uint32_t numPending = 0;
+    uint32_t numDropped = 0;
+
+    uint32_t keyHashes[LOG_KEY_TABLE_SIZE]; // Newest pending record offset for each keyHash
+    uint32_t keyOffsets[LOG_KEY_TABLE_SIZE];
+
+    static uint32_t recordSize(uint16_t length) { return (sizeof(DashLogRecordHeader) + length + 3) & ~3UL; }
+    uint32_t nextSector(uint32_t offset) { return ((offset / LOG_SECTOR_SIZE) + 1) * LOG_SECTOR_SIZE % storage->size(); }
+    bool readHeader(uint32_t offset, DashLogRecordHeader *header);
+    bool checkRecord(uint32_t offset, const DashLogRecordHeader *header);
+    bool isErased(uint32_t offset, uint32_t len);
+    void setState(uint32_t offset, uint8_t state);
+    void freeSector(uint32_t offset);
+    void setKey(uint32_t keyHash, uint32_t offset);
+    void removeKey(uint32_t offset);
+};
+
+#endif
@@ -0,0 +1,78 @@
+#include <dashioCommsESP.h>
+#include <ESPmDNS.h>
+
+void DashCommsESP::startTcpEgress(uint8_t numTCP) {
+    tcpEgress.begin(numTCP, config.tcpEgressSize);
+    tcpEgress.maxWrite = config.tcpMaxWrite;
+    tcpEgress.degradeMs = config.tcpDegradeMs;
+    tcpEgress.evictMs = config.tcpEvictMs;
+    tcpEgress.setCallbacks(tcpReceive, tcpEvent, this);
+    for (uint8_t i = 0; i < MAX_EGRESS_CLIENTS; i++) {
+        tcpReceived[i].connectionType = TCP_CONN;
+    }
+}
+
+bool DashCommsESP::hasTCP() {
+    return (tcp_con != nullptr) || tcpEgress.active();
+}
+
+void DashCommsESP::listenTCP() {
+    // In place of DashTCP, which would otherwise be started by DashWiFi once connected
+    if (tcpEgress.listening()) {
+        return;
+    }
+    if (tcpEgress.listen(provisioning->tcpPort)) {
+        MDNS.begin(dashDevice->deviceID.c_str());
+        MDNS.addService("DashIO", "tcp", provisioning->tcpPort);
+        DASH_LOGI("TCP server listening on port %u", provisioning->tcpPort);
+    } else {
+        DASH_LOGE("TCP server can't listen on port %u", provisioning->tcpPort);
+    }
+}
+
+void DashCommsESP::sendTCP(const String& message) {
+    if (tcpEgress.active()) {
+        tcpEgress.send(message.c_str(), message.length(), millis());
+    } else {
+        tcp_con->sendMessage(message);
+    }
+}
+
+void DashCommsESP::tcpReceive(uint8_t client, const char *data, uint32_t len, void *context) {
+    DashCommsESP *dashComms = (DashCommsESP *)context;
+    MessageData *messageData = &dashComms->tcpReceived[client];
+    for (uint32_t i = 0; i < len; i++) {
+        if (messageData->processChar(data[i])) {
+            incomingMessageHooks[dashComms->instanceSlot](messageData);
+        }
+    }
+}
+
+void DashCommsESP::tcpEvent(uint8_t client, DashEgressEvent event, void *context) {
+    DashCommsESP *dashComms = (DashCommsESP *)context;
+    if (event == EGRESS_CONNECTED) {
+        DASH_LOGI("TCP client %u connected", client);
+    } else if (event == EGRESS_EVICTED) {
+        DASH_LOGW("TCP client %u stalled for %lu ms. Disconnected", client, (unsigned long)dashComms->config.tcpEvictMs);
+    } else {
+        DASH_LOGI("TCP client %u disconnected", client);
+    }
+}
+
+void DashCommsESP::sendEgressStats() {
+    // CTRL EGR TCP clients evictions, then CTRL EGR CLNT client backlog peak sent writes dropped stallMs maxStallMs degraded for each client
+    char payload[112];
+    snprintf(payload, sizeof(payload), "%s\t%u\t%lu", TCP, tcpEgress.numClients(), (unsigned long)tcpEgress.evictions());
+    sendControlMessage(EGRESS, payload);
+
+    uint32_t nowMs = millis();
+    for (uint8_t i = 0; i < tcpEgress.clientCount(); i++) {
+        DashEgressStats stats = tcpEgress.stats(i, nowMs);
+        if (stats.connected) {
+            snprintf(payload, sizeof(payload), "%s\t%u\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%lu\t%u", EGRESS_CLIENT, i, (unsigned long)stats.backlog, (unsigned long)stats.peakBacklog,
+                     (unsigned long)stats.sentBytes, (unsigned long)stats.writes, (unsigned long)stats.droppedMessages, (unsigned long)stats.stallMs,
+                     (unsigned long)stats.maxStallMs, stats.degraded);
+            sendControlMessage(EGRESS, payload);
+        }
+    }
+}
@@ -0,0 +1,62 @@
+#include <DashioCommsTraceESP.h>
+
+#ifdef DASH_TRACE_ENABLE
+DashTraceEntry DashTrace::buffer[DASH_TRACE_BUFFER_SIZE];
+uint32_t DashTrace::head = 0;
+portMUX_TYPE DashTrace::mux = portMUX_INITIALIZER_UNLOCKED;
+
+void DashTrace::record(uint16_t event, uint16_t length) {
+    uint32_t timestampUs = (uint32_t)esp_timer_get_time();
+    portENTER_CRITICAL(&mux);
+    DashTraceEntry *entry = &buffer[head & (DASH_TRACE_BUFFER_SIZE - 1)];
+    entry->timestampUs = timestampUs;
+    entry->event = event;
+    entry->length = length;
+    head++;
+    portEXIT_CRITICAL(&mux);
+}
+
+uint16_t DashTrace::count() {
+    if (head < DASH_TRACE_BUFFER_SIZE) {
+        return head;
+    }
+    return DASH_TRACE_BUFFER_SIZE;
+}
+
+uint32_t DashTrace::end() {
+    portENTER_CRITICAL(&mux);
+    uint32_t endIndex = head;
+    portEXIT_CRITICAL(&mux);
+    return endIndex;
+}
+
+uint16_t DashTrace::read(DashTraceEntry *entries, uint32_t *index, uint32_t end, uint16_t maxEntries) {
+    uint16_t numRead = 0;
+    portENTER_CRITICAL(&mux);
+    if (end > head) {
+        end = head; // Cleared since end was taken
+    }
+    uint32_t oldest = head - count();
+    if (*index < oldest) {
+        *index = oldest; // Overwritten while paging
+    }
+    while ((*index < end) && (numRead < maxEntries)) {
+        entries[numRead++] = buffer[*index & (DASH_TRACE_BUFFER_SIZE - 1)];
+        (*index)++;
+    }
+    portEXIT_CRITICAL(&mux);
+    return numRead;
+}
+
+void DashTrace::clear() {
+    portENTER_CRITICAL(&mux);
+    head = 0;
+    portEXIT_CRITICAL(&mux);
+}
+#else
+void DashTrace::record(uint16_t, uint16_t) {}
+uint16_t DashTrace::count() { return 0; }
+uint32_t DashTrace::end() { return 0; }
+uint16_t DashTrace::read(DashTraceEntry *, uint32_t *, uint32_t, uint16_t) { return 0; }
+void DashTrace::clear() {}
+#endif
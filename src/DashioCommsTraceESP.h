@@ -0,0 +1,103 @@
+#ifndef DASHIO_COMMS_TRACE_ESP_H
+#define DASHIO_COMMS_TRACE_ESP_H
+
+#include <Arduino.h>
+
+// Log levels (same numbering as the Arduino Core Debug Level)
+#define DASH_LOG_LEVEL_NONE 0
+#define DASH_LOG_LEVEL_ERROR 1
+#define DASH_LOG_LEVEL_WARN 2
+#define DASH_LOG_LEVEL_INFO 3
+#define DASH_LOG_LEVEL_DEBUG 4
+#define DASH_LOG_LEVEL_VERBOSE 5
+
+// Set DASH_LOG_LEVEL with a build flag (e.g. -DDASH_LOG_LEVEL=2) to override the Core Debug Level.
+// Logging below the chosen level is compiled out.
+#ifndef DASH_LOG_LEVEL
+#ifdef CORE_DEBUG_LEVEL
+#define DASH_LOG_LEVEL CORE_DEBUG_LEVEL
+#else
+#define DASH_LOG_LEVEL DASH_LOG_LEVEL_NONE
+#endif
+#endif
+
+// Compiled out log statements still use their arguments (without evaluating them), so values computed only for logging
+// don't give unused variable warnings
+static inline void dashLogDiscard(const char *, ...) {}
+#define DASH_LOG_DISCARD(...) do { if (0) { dashLogDiscard(__VA_ARGS__); } } while (0)
+
+#if DASH_LOG_LEVEL >= DASH_LOG_LEVEL_ERROR
+#define DASH_LOGE(...) ESP_LOGE(DTAG, __VA_ARGS__)
+#else
+#define DASH_LOGE(...) DASH_LOG_DISCARD(__VA_ARGS__)
+#endif
+
+#if DASH_LOG_LEVEL >= DASH_LOG_LEVEL_WARN
+#define DASH_LOGW(...) ESP_LOGW(DTAG, __VA_ARGS__)
+#else
+#define DASH_LOGW(...) DASH_LOG_DISCARD(__VA_ARGS__)
+#endif
+
+#if DASH_LOG_LEVEL >= DASH_LOG_LEVEL_INFO
+#define DASH_LOGI(...) ESP_LOGI(DTAG, __VA_ARGS__)
+#else
+#define DASH_LOGI(...) DASH_LOG_DISCARD(__VA_ARGS__)
+#endif
+
+#if DASH_LOG_LEVEL >= DASH_LOG_LEVEL_DEBUG
+#define DASH_LOGD(...) ESP_LOGD(DTAG, __VA_ARGS__)
+#else
+#define DASH_LOGD(...) DASH_LOG_DISCARD(__VA_ARGS__)
+#endif
+
+// Every incoming and outgoing frame is logged at DEBUG level, as formatting large frames is slow
+#define DASH_LOG_FRAME(...) DASH_LOGD(__VA_ARGS__)
+
+// Binary trace events
+enum DashTraceEvent : uint16_t {
+    TRACE_SERIAL_RX = 1,
+    TRACE_SERIAL_TX_CTRL,
+    TRACE_SERIAL_FORWARD,
+    TRACE_SEND_BLE,
+    TRACE_SEND_TCP,
+    TRACE_SEND_MQTT,
+    TRACE_PROVISION,
+    TRACE_USER_EVENT = 0x100 // Start of event IDs free for user code
+};
+
+struct DashTraceEntry {
+    uint32_t timestampUs;
+    uint16_t event;
+    uint16_t length;
+};
+
+// Build with -DDASH_TRACE_ENABLE to record (timestamp, event, length) entries into a ring buffer.
+#ifndef DASH_TRACE_BUFFER_SIZE
+#define DASH_TRACE_BUFFER_SIZE 256 // Entries. Must be a power of 2
+#endif
+
+#define DASH_TRACE_DUMP_ENTRIES 32 // Entries per dump message
+
+class DashTrace {
+public:
+    static void record(uint16_t event, uint16_t length);
+    static uint16_t count();
+    static uint32_t end(); // Index after the newest entry. Entries are numbered from the last clear()
+    static uint16_t read(DashTraceEntry *entries, uint32_t *index, uint32_t end, uint16_t maxEntries); // From *index up to end, oldest first. Advances *index, skipping overwritten entries
+    static void clear();
+
+private:
+#ifdef DASH_TRACE_ENABLE
+    static DashTraceEntry buffer[DASH_TRACE_BUFFER_SIZE];
+    static uint32_t head;
+    static portMUX_TYPE mux;
+#endif
+};
+
+#ifdef DASH_TRACE_ENABLE
+#define DASH_TRACE(event, length) DashTrace::record((event), (length))
+#else
+#define DASH_TRACE(event, length) do {} while (0)
+#endif
+
+#endif
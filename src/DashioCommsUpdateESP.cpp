@@ -0,0 +1,122 @@
+#include <dashioCommsESP.h>
+
+// Master firmware update.
+// Uploader (TCP or MQTT), as TEXT messages to control FWU on this device:
+//   BEGIN,size,sha256 hex    DATA,offset,base64    END    STATUS    ABORT
+// Each is answered with a TEXT message: OK or ERR,state,bytes received,size. A rejected DATA gives the offset to resume from.
+// Master (serial), once the image is staged:
+//   -> CTRL FWU OFFER size sha256       <- CTRL FWU ACK offset (starts or resumes the transfer from offset)
+//   -> CTRL FWU DATA offset base64      <- CTRL FWU ACK offset (every byte before offset received)
+//   -> CTRL FWU DONE sha256             <- CTRL FWU (repeat the offer) or CTRL FWU ABORT
+// Chunks are base 64 text so they are framed and parsed like any other serial message.
+
+void DashCommsESP::startFirmware() {
+    firmware = new DashFirmwareTransfer(config.firmwareStorage);
+    firmware->chunkSize = config.firmwareChunkSize;
+    firmware->window = config.firmwareWindow;
+    firmware->ackTimeoutMs = config.firmwareAckTimeoutMs;
+    firmware->open();
+
+    firmwareChunk = new uint8_t[config.firmwareChunkSize];
+    DASH_LOGI("Firmware store %lu bytes, %s", (unsigned long)firmware->maxSize(), FIRMWARE_STATE_NAMES[firmware->state()]);
+}
+
+bool DashCommsESP::receiveFirmware(MessageData *messageData) {
+    if ((firmware == nullptr) || (messageData->control != textBox) || (messageData->idStr != FIRMWARE) || (messageData->deviceID != dashDevice->deviceID)) {
+        return false;
+    }
+
+    const char *payload = messageData->payloadStr.c_str();
+    const char *field = strchr(payload, ',');
+    bool ok = false;
+    if (!strncmp(payload, FIRMWARE_BEGIN, strlen(FIRMWARE_BEGIN))) {
+        const char *hashHex = field ? strchr(field + 1, ',') : nullptr;
+        uint8_t hash[FIRMWARE_HASH_SIZE];
+        if (hashHex && dashHexDecode(hashHex + 1, hash, FIRMWARE_HASH_SIZE)) {
+            ok = firmware->begin(strtoul(field + 1, NULL, 10), hash);
+        }
+    } else if (!strncmp(payload, FIRMWARE_DATA, strlen(FIRMWARE_DATA))) {
+        const char *data = field ? strchr(field + 1, ',') : nullptr;
+        if (data) {
+            int32_t len = dashBase64Decode(data + 1, firmwareChunk, config.firmwareChunkSize);
+            ok = (len > 0) && firmware->write(strtoul(field + 1, NULL, 10), firmwareChunk, len);
+        }
+        if (ok) {
+            return true; // Only failed chunks are answered, so the uploader can stream
+        }
+    } else if (!strncmp(payload, FIRMWARE_END, strlen(FIRMWARE_END))) {
+        ok = firmware->finish();
+        if (ok) {
+            DASH_LOGI("Firmware staged, %lu bytes", (unsigned long)firmware->size());
+            offerFirmware();
+        } else {
+            DASH_LOGW("Firmware hash check failed");
+        }
+    } else if (!strncmp(payload, FIRMWARE_ABORT, strlen(FIRMWARE_ABORT))) {
+        firmware->abort();
+        ok = true;
+    } else {
+        ok = true; // STATUS
+    }
+
+    replyFirmware(ok ? "OK" : "ERR", messageData->connectionType);
+    return true;
+}
+
+void DashCommsESP::replyFirmware(const char *result, ConnectionType connectionType) {
+    char payload[48];
+    snprintf(payload, sizeof(payload), "%s,%s,%lu,%lu", result, FIRMWARE_STATE_NAMES[firmware->state()], (unsigned long)firmware->received(), (unsigned long)firmware->size());
+    String message = String(DELIM) + dashDevice->deviceID + String(DELIM) + dashDevice->getControlTypeStr(textBox) + String(DELIM) + FIRMWARE + String(DELIM) + payload + String(END_DELIM);
+    sendMessage(message, connectionType);
+}
+
+void DashCommsESP::offerFirmware() {
+    char payload[FIRMWARE_HASH_SIZE * 2 + 24];
+    int len = snprintf(payload, sizeof(payload), "%s\t%lu\t", FIRMWARE_OFFER, (unsigned long)firmware->size());
+    dashHexEncode(firmware->hash(), FIRMWARE_HASH_SIZE, &payload[len]);
+    sendControlMessage(FIRMWARE, payload);
+}
+
+void DashCommsESP::parseFirmwareCommand() {
+    // CTRL FWU (offer the staged image), CTRL FWU ACK offset, or CTRL FWU ABORT
+    if (firmware == nullptr) {
+        return;
+    }
+    char *token = strtok(NULL, DELIMETERS_STR);
+    if (!token) {
+        if ((firmware->state() != FIRMWARE_EMPTY) && (firmware->state() != FIRMWARE_RECEIVING)) {
+            offerFirmware();
+        }
+    } else if (!strcmp(token, FIRMWARE_ACK)) {
+        token = strtok(NULL, DELIMETERS_STR);
+        if (token) {
+            FirmwareState previousState = firmware->state();
+            firmware->ack(strtoul(token, NULL, 10), millis());
+            if ((firmware->state() == FIRMWARE_SENT) && (previousState != FIRMWARE_SENT)) {
+                char hashHex[FIRMWARE_HASH_SIZE * 2 + 1];
+                dashHexEncode(firmware->hash(), FIRMWARE_HASH_SIZE, hashHex);
+                char payload[sizeof(hashHex) + 8];
+                snprintf(payload, sizeof(payload), "%s\t%s", FIRMWARE_DONE, hashHex);
+                sendControlMessage(FIRMWARE, payload);
+                DASH_LOGI("Firmware sent, %lu retransmitted chunks", (unsigned long)firmware->retransmits());
+            }
+        }
+    } else if (!strcmp(token, FIRMWARE_ABORT)) {
+        firmware->abort();
+    }
+}
+
+void DashCommsESP::sendFirmware() { // Called while the firmware state is FIRMWARE_SENDING
+    uint32_t offset;
+    int32_t len = firmware->next(millis(), &offset, firmwareChunk);
+    while (len > 0) {
+        char payload[(config.firmwareChunkSize + 2) / 3 * 4 + 24];
+        int prefixLen = snprintf(payload, sizeof(payload), "%s\t%lu\t", FIRMWARE_DATA, (unsigned long)offset);
+        dashBase64Encode(firmwareChunk, len, &payload[prefixLen]);
+        sendControlMessage(FIRMWARE, payload);
+        len = firmware->next(millis(), &offset, firmwareChunk);
+    }
+    if (firmware->state() == FIRMWARE_PAUSED) {
+        DASH_LOGW("Firmware transfer paused at %lu bytes. No ACK from the master", (unsigned long)firmware->acked());
+    }
+}
@@ -0,0 +1,102 @@
+#include <dashioCommsESP.h>
+
+template <typename T>
+static void storeMax(std::atomic<T>& value, T sample) {
+    T current = value.load(std::memory_order_relaxed);
+    while ((sample > current) && !value.compare_exchange_weak(current, sample, std::memory_order_relaxed)) {
+    }
+}
+
+void DashCommsESP::startUserTask() {
+    uint8_t queueLength = config.userTaskQueueLength;
+
+    userMessagePool = new MessageData[queueLength];
+    userMessageQueuedUs = new uint32_t[queueLength];
+    userFreeQueue = xQueueCreate(queueLength, sizeof(uint8_t));
+    userReadyQueue = xQueueCreate(queueLength, sizeof(uint8_t));
+    for (uint8_t i = 0; i < queueLength; i++) {
+        xQueueSend(userFreeQueue, &i, 0);
+    }
+
+    uint8_t sendQueueLength = (config.userSendQueueLength > 0) ? config.userSendQueueLength : 1;
+    userSendPool = new DashUserSend[sendQueueLength];
+    userSendFreeQueue = xQueueCreate(sendQueueLength, sizeof(uint8_t));
+    userSendReadyQueue = xQueueCreate(sendQueueLength, sizeof(uint8_t));
+    for (uint8_t i = 0; i < sendQueueLength; i++) {
+        xQueueSend(userSendFreeQueue, &i, 0);
+    }
+
+    xTaskCreatePinnedToCore(userMessageTask, "userTask", config.userTaskStackSize, this, config.userTaskPriority, &userTaskHandle, config.userTaskCore);
+}
+
+void DashCommsESP::queueUserMessage(MessageData *messageData) {
+    uint8_t slot;
+    if (xQueueReceive(userFreeQueue, &slot, 0) != pdTRUE) {
+        if (config.userQueueOverflow == USER_QUEUE_RUN_INLINE) {
+            userTaskStats.ranInline.fetch_add(1, std::memory_order_relaxed);
+            callUserMessage(messageData);
+            return;
+        } else if ((config.userQueueOverflow == USER_QUEUE_DROP_NEWEST) || (xQueueReceive(userReadyQueue, &slot, 0) != pdTRUE)) {
+            userTaskStats.dropped.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        userTaskStats.dropped.fetch_add(1, std::memory_order_relaxed); // Oldest message dropped, and its slot reused
+    }
+
+    userMessagePool[slot] = *messageData;
+    userMessageQueuedUs[slot] = (uint32_t)esp_timer_get_time();
+    xQueueSend(userReadyQueue, &slot, 0);
+
+    storeMax(userTaskStats.maxQueueDepth, (uint8_t)uxQueueMessagesWaiting(userReadyQueue));
+}
+
+void DashCommsESP::userMessageTask(void *parameters) {
+    DashCommsESP *dashComms = (DashCommsESP *)parameters;
+    dashComms->runUserTask();
+}
+
+void DashCommsESP::runUserTask() {
+    uint8_t slot;
+    while (!stopTasks) {
+        if ((xQueueReceive(userReadyQueue, &slot, portMAX_DELAY) == pdTRUE) && (slot != USER_TASK_STOP)) {
+            uint32_t latencyUs = (uint32_t)esp_timer_get_time() - userMessageQueuedUs[slot];
+            storeMax(userTaskStats.maxLatencyUs, latencyUs);
+            uint32_t avgLatencyUs = userTaskStats.avgLatencyUs.load(std::memory_order_relaxed); // Only written here
+            userTaskStats.avgLatencyUs.store(avgLatencyUs - (avgLatencyUs >> 3) + (latencyUs >> 3), std::memory_order_relaxed);
+
+            callUserMessage(&userMessagePool[slot]);
+            userTaskStats.processed.fetch_add(1, std::memory_order_relaxed);
+
+            xQueueSend(userFreeQueue, &slot, 0);
+        }
+    }
+    exitTask();
+}
+
+void DashCommsESP::queueUserSend(const String& message, ConnectionType connectionType, bool all) {
+    uint8_t slot;
+    if (xQueueReceive(userSendFreeQueue, &slot, pdMS_TO_TICKS(config.userSendWaitMs)) != pdTRUE) {
+        userTaskStats.sendsDropped.fetch_add(1, std::memory_order_relaxed);
+        DASH_LOGW("User task send dropped");
+        return;
+    }
+
+    userSendPool[slot].message = message;
+    userSendPool[slot].connectionType = connectionType;
+    userSendPool[slot].all = all;
+    xQueueSend(userSendReadyQueue, &slot, 0);
+    userTaskStats.sendsQueued.fetch_add(1, std::memory_order_relaxed);
+}
+
+void DashCommsESP::runUserSends() {
+    uint8_t slot;
+    while (xQueueReceive(userSendReadyQueue, &slot, 0) == pdTRUE) {
+        DashUserSend *send = &userSendPool[slot];
+        if (send->all) {
+            sendMessageAll(send->message);
+        } else {
+            sendMessage(send->message, send->connectionType);
+        }
+        xQueueSend(userSendFreeQueue, &slot, 0);
+    }
+}
@@ -0,0 +1,294 @@
+// Host tests for the TCP egress server (DashTcpEgress) against loopback sockets
+
+#include <DashioCommsEgressESP.h>
+#include "test_host.h"
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/socket.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <atomic>
+#include <string>
+#include <thread>
+
+#define TEST_BUFFER_SIZE 16384
+#define TEST_TIMEOUT_MS 10000
+#define TEST_LARGE_MESSAGE 4000
+
+static uint32_t nowMs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+static int connectClient(uint16_t port, int receiveBufferSize = 0) {
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (receiveBufferSize > 0) {
+        setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &receiveBufferSize, sizeof(receiveBufferSize)); // Before connecting, so the window stays small
+    }
+    struct sockaddr_in address;
+    memset(&address, 0, sizeof(address));
+    address.sin_family = AF_INET;
+    address.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    address.sin_port = htons(port);
+    CHECK(connect(fd, (struct sockaddr *)&address, sizeof(address)) == 0);
+    return fd;
+}
+
+static void runUntil(DashTcpEgress& egress, uint8_t numClients) {
+    uint32_t startMs = nowMs();
+    while ((egress.numClients() != numClients) && ((nowMs() - startMs) < TEST_TIMEOUT_MS)) {
+        egress.run(nowMs());
+        usleep(1000);
+    }
+    CHECK(egress.numClients() == numClients);
+}
+
+static uint32_t makeMessage(char *message, uint32_t number, uint32_t length = 200) {
+    uint32_t len = snprintf(message, length, "\tDEV\tDIAL\tD01\t%06u\t", (unsigned int)number);
+    while (len < length - 1) {
+        message[len++] = 'x';
+    }
+    message[len++] = '\n';
+    return len;
+}
+
+// Reads everything sent to a client until it is closed
+struct Reader {
+    int fd;
+    std::string received;
+    std::atomic<bool> stop{false};
+    std::thread thread;
+
+    Reader(int fd) : fd(fd), thread([this]() { read(); }) {}
+
+    void read() {
+        char data[4096];
+        while (!stop) {
+            ssize_t len = recv(this->fd, data, sizeof(data), MSG_DONTWAIT);
+            if (len > 0) {
+                received.append(data, len);
+            } else if (len == 0) {
+                return;
+            } else {
+                usleep(100);
+            }
+        }
+    }
+
+    void join() {
+        stop = true;
+        thread.join();
+    }
+};
+
+struct Events {
+    uint32_t connected = 0;
+    uint32_t disconnected = 0;
+    uint32_t evicted = 0;
+    std::string received[MAX_EGRESS_CLIENTS];
+};
+
+static void onReceive(uint8_t client, const char *data, uint32_t len, void *context) {
+    ((Events *)context)->received[client].append(data, len);
+}
+
+static void onEvent(uint8_t client, DashEgressEvent event, void *context) {
+    Events *events = (Events *)context;
+    if (event == EGRESS_CONNECTED) {
+        events->connected++;
+    } else if (event == EGRESS_EVICTED) {
+        events->evicted++;
+    } else {
+        events->disconnected++;
+    }
+}
+
+static void testBuffer() {
+    DashEgressBuffer buffer;
+    buffer.begin(10);
+    CHECK(buffer.push("abcdef", 6));
+    CHECK(!buffer.push("ghijk", 5)); // Whole messages only
+    CHECK(buffer.backlog() == 6);
+
+    uint32_t len;
+    const char *data = buffer.peek(&len);
+    CHECK((len == 6) && !memcmp(data, "abcdef", 6));
+    buffer.consume(4);
+    CHECK(buffer.push("ghijkl", 6)); // Wraps
+
+    data = buffer.peek(&len);
+    CHECK((len == 6) && !memcmp(data, "efghij", 6));
+    buffer.consume(len);
+    data = buffer.peek(&len);
+    CHECK((len == 2) && !memcmp(data, "kl", 2));
+    buffer.consume(len);
+    CHECK(buffer.backlog() == 0);
+}
+
+static void testDelivery() {
+    DashTcpEgress egress;
+    Events events;
+    egress.begin(2, TEST_BUFFER_SIZE);
+    egress.setCallbacks(onReceive, onEvent, &events);
+    CHECK(egress.listen(0));
+    int fd = connectClient(egress.port());
+    runUntil(egress, 1);
+    CHECK(events.connected == 1);
+
+    // Messages queued together are combined into fewer writes
+    Reader reader(fd);
+    std::string expected;
+    char message[256];
+    for (uint32_t i = 0; i < 2000; i++) {
+        uint32_t len = makeMessage(message, i);
+        expected.append(message, len);
+        egress.send(message, len, nowMs());
+        if ((i % 100) == 0) {
+            egress.run(nowMs());
+        }
+    }
+    uint32_t startMs = nowMs();
+    while (egress.pending() && ((nowMs() - startMs) < TEST_TIMEOUT_MS)) {
+        egress.run(nowMs());
+        usleep(1000);
+    }
+    usleep(50000);
+    reader.join();
+    CHECK(reader.received == expected);
+
+    DashEgressStats stats = egress.stats(0, nowMs());
+    CHECK(stats.connected);
+    CHECK(stats.sentBytes == expected.length());
+    CHECK(stats.droppedMessages == 0);
+    CHECK(stats.backlog == 0);
+    CHECK(!stats.degraded);
+
+    // Incoming data, and the client closing
+    CHECK(write(fd, "\tDEV\tSTATUS", 11) == 11);
+    CHECK(write(fd, "\n", 1) == 1);
+    usleep(20000);
+    egress.run(nowMs());
+    CHECK(events.received[0] == "\tDEV\tSTATUS\n");
+    close(fd);
+    runUntil(egress, 0);
+    CHECK(events.disconnected == 1);
+    CHECK(egress.evictions() == 0);
+    egress.stop();
+}
+
+static void testSlowClient() {
+    DashTcpEgress egress;
+    Events events;
+    egress.begin(2, TEST_BUFFER_SIZE);
+    egress.degradeMs = 100;
+    egress.evictMs = 300;
+    egress.setCallbacks(onReceive, onEvent, &events);
+    CHECK(egress.listen(0));
+    int fastFd = connectClient(egress.port());
+    runUntil(egress, 1);
+    int slowFd = connectClient(egress.port(), 4096); // Never reads
+    runUntil(egress, 2);
+
+    // Large messages, to fill the host's socket buffers quickly
+    Reader reader(fastFd);
+    std::string expected;
+    char message[TEST_LARGE_MESSAGE];
+    uint32_t maxSendMs = 0;
+    uint32_t degradedMs = 0; // When the slow client was first seen degraded
+    uint32_t evictedMs = 0;
+    uint32_t startMs = nowMs();
+    for (uint32_t i = 0; (evictedMs == 0) || ((nowMs() - evictedMs) < 100); i++) {
+        if ((nowMs() - startMs) > TEST_TIMEOUT_MS) {
+            break;
+        }
+        uint32_t len = makeMessage(message, i, TEST_LARGE_MESSAGE);
+        expected.append(message, len);
+        uint32_t sendStartMs = nowMs();
+        egress.send(message, len, sendStartMs);
+        egress.run(nowMs());
+        uint32_t sendMs = nowMs() - sendStartMs;
+        if (sendMs > maxSendMs) {
+            maxSendMs = sendMs;
+        }
+
+        DashEgressStats slowStats = egress.stats(1, nowMs());
+        if ((degradedMs == 0) && slowStats.degraded) {
+            degradedMs = nowMs();
+            CHECK(slowStats.backlog > 0);
+        }
+        if ((evictedMs == 0) && (events.evicted > 0)) {
+            evictedMs = nowMs();
+        }
+        usleep(500);
+    }
+    while (egress.pending() && ((nowMs() - startMs) < TEST_TIMEOUT_MS)) {
+        egress.run(nowMs());
+        usleep(1000);
+    }
+    usleep(50000);
+    reader.join();
+
+    // Sends never waited for the slow client
+    CHECK(maxSendMs < 20);
+
+    // Only the slow client was degraded and then evicted
+    CHECK(degradedMs > 0);
+    CHECK(evictedMs >= degradedMs);
+    CHECK(events.evicted == 1);
+    CHECK(egress.evictions() == 1);
+    CHECK(egress.numClients() == 1);
+    CHECK(!egress.stats(1, nowMs()).connected);
+    char data[1];
+    int slowResult = recv(slowFd, data, sizeof(data), MSG_DONTWAIT); // Data, then reset
+    while (slowResult > 0) {
+        slowResult = recv(slowFd, data, sizeof(data), MSG_DONTWAIT);
+    }
+    CHECK(slowResult <= 0);
+
+    // The fast client got every message, in order, while the slow one stalled
+    DashEgressStats fastStats = egress.stats(0, nowMs());
+    CHECK(fastStats.connected);
+    CHECK(fastStats.droppedMessages == 0);
+    CHECK(!fastStats.degraded);
+    CHECK(reader.received == expected);
+    printf("  %u messages, degraded after %u ms, evicted %u ms later\n", (unsigned int)(expected.length() / TEST_LARGE_MESSAGE),
+           (unsigned int)(degradedMs - startMs), (unsigned int)(evictedMs - degradedMs));
+
+    close(fastFd);
+    close(slowFd);
+    egress.stop();
+}
+
+static void testClientLimit() {
+    DashTcpEgress egress;
+    Events events;
+    egress.begin(1, TEST_BUFFER_SIZE);
+    egress.setCallbacks(onReceive, onEvent, &events);
+    CHECK(egress.listen(0));
+    int firstFd = connectClient(egress.port());
+    runUntil(egress, 1);
+    int secondFd = connectClient(egress.port());
+    usleep(20000);
+    egress.run(nowMs());
+    CHECK(egress.numClients() == 1);
+    CHECK(events.connected == 1);
+
+    char data[1];
+    usleep(20000);
+    CHECK(recv(secondFd, data, sizeof(data), MSG_DONTWAIT) == 0); // Closed straight away
+    close(firstFd);
+    close(secondFd);
+    egress.stop();
+    CHECK(!egress.listening());
+}
+
+int main() {
+    RUN_TEST(testBuffer);
+    RUN_TEST(testDelivery);
+    RUN_TEST(testSlowClient);
+    RUN_TEST(testClientLimit);
+    return (testFailures == 0) ? 0 : 1;
+}
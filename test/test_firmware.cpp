@@ -0,0 +1,400 @@
+// Host tests for staging a firmware image and sending it to the serial master (DashFirmwareTransfer).
+// The transfer runs over a pty, with a fake master in a child process on the other end, using the same
+// CTRL FWU messages as DashCommsESP. Linux only.
+
+#include <DashioCommsFirmwareESP.h>
+#include "test_host.h"
+
+#include <fcntl.h>
+#include <poll.h>
+#include <signal.h>
+#include <stdlib.h>
+#include <sys/wait.h>
+#include <termios.h>
+#include <time.h>
+#include <unistd.h>
+
+#define TEST_STORAGE_PATH "build/test_firmware.bin"
+#define TEST_HOST_IMAGE_PATH "build/test_firmware_host.bin" // Bytes the fake master has, kept across its restarts
+#define TEST_IMAGE_SIZE 100000
+#define TEST_LINE_SIZE 2048
+#define TEST_TIMEOUT_MS 20000
+
+static uint32_t nowMs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
+// Reads newline terminated lines from a file descriptor
+struct LineReader {
+    int fd;
+    char buffer[TEST_LINE_SIZE * 4];
+    int length = 0;
+
+    LineReader(int fd) : fd(fd) {}
+
+    bool readLine(char *line, int timeoutMs) { // Returns false if no whole line arrives within timeoutMs
+        uint32_t startMs = nowMs();
+        while (true) {
+            char *end = (char *)memchr(buffer, '\n', length);
+            if (end != nullptr) {
+                int lineLength = end - buffer;
+                if (lineLength >= TEST_LINE_SIZE) {
+                    lineLength = TEST_LINE_SIZE - 1;
+                }
+                memcpy(line, buffer, lineLength);
+                line[lineLength] = '\0';
+                length -= end + 1 - buffer;
+                memmove(buffer, end + 1, length);
+                return true;
+            }
+            int32_t remainingMs = timeoutMs - (int32_t)(nowMs() - startMs);
+            if (remainingMs < 0) {
+                return false;
+            }
+            struct pollfd pollFd = {fd, POLLIN, 0};
+            if (poll(&pollFd, 1, remainingMs) <= 0) {
+                return false;
+            }
+            int numRead = read(fd, buffer + length, sizeof(buffer) - length);
+            if (numRead <= 0) {
+                return false;
+            }
+            length += numRead;
+        }
+    }
+};
+
+static void writeLine(int fd, const char *line) {
+    size_t length = strlen(line);
+    while (length > 0) {
+        ssize_t numWritten = write(fd, line, length);
+        if (numWritten <= 0) {
+            return;
+        }
+        line += numWritten;
+        length -= numWritten;
+    }
+}
+
+// ---------------------------------------- Fake master ----------------------------------------
+
+struct MasterScenario {
+    int dropChunk = -1; // Ignore this DATA message (counted from 0), as if lost on the line
+    uint32_t stopAfterBytes = 0; // Exit once this many bytes are received, as if reset. 0 to receive the whole image
+};
+
+enum MasterExit {
+    MASTER_DONE = 0, // Whole image received and its hash matches DONE
+    MASTER_STOPPED = 1,
+    MASTER_BAD_HASH = 2,
+    MASTER_TIMEOUT = 3
+};
+
+static void saveMasterImage(const uint8_t *image, uint32_t length) {
+    FILE *file = fopen(TEST_HOST_IMAGE_PATH, "wb");
+    fwrite(image, 1, length, file);
+    fclose(file);
+}
+
+static uint32_t loadMasterImage(uint8_t *image) {
+    FILE *file = fopen(TEST_HOST_IMAGE_PATH, "rb");
+    if (file == nullptr) {
+        return 0;
+    }
+    uint32_t length = fread(image, 1, TEST_IMAGE_SIZE, file);
+    fclose(file);
+    return length;
+}
+
+static int runMaster(const char *ptyName, const MasterScenario& scenario) {
+    int fd = open(ptyName, O_RDWR | O_NOCTTY);
+    struct termios settings;
+    tcgetattr(fd, &settings);
+    cfmakeraw(&settings);
+    tcsetattr(fd, TCSANOW, &settings);
+
+    static uint8_t image[TEST_IMAGE_SIZE];
+    uint32_t have = loadMasterImage(image); // Resumes from an earlier transfer
+    int numChunks = 0;
+    char line[TEST_LINE_SIZE];
+    char reply[64];
+    LineReader reader(fd);
+
+    writeLine(fd, "\tDEV\tCTRL\tFWU\n"); // Ask for the offer
+    while (reader.readLine(line, 5000)) {
+        // DELIM DEV DELIM CTRL DELIM FWU DELIM command ...
+        char *fields[8] = {};
+        int numFields = 0;
+        for (char *field = strtok(line, "\t"); field && (numFields < 8); field = strtok(NULL, "\t")) {
+            fields[numFields++] = field;
+        }
+        if ((numFields < 4) || strcmp(fields[2], "FWU")) {
+            continue;
+        }
+
+        if (!strcmp(fields[3], "OFFER")) {
+            snprintf(reply, sizeof(reply), "\tDEV\tCTRL\tFWU\tACK\t%u\n", (unsigned int)have);
+            writeLine(fd, reply);
+        } else if (!strcmp(fields[3], "DATA") && (numFields >= 6)) {
+            if (numChunks++ == scenario.dropChunk) {
+                continue;
+            }
+            uint32_t offset = strtoul(fields[4], NULL, 10);
+            if (offset == have) {
+                int32_t length = dashBase64Decode(fields[5], image + have, TEST_IMAGE_SIZE - have);
+                if (length > 0) {
+                    have += length;
+                }
+            }
+            if ((scenario.stopAfterBytes > 0) && (have >= scenario.stopAfterBytes)) {
+                saveMasterImage(image, have);
+                return MASTER_STOPPED;
+            }
+            snprintf(reply, sizeof(reply), "\tDEV\tCTRL\tFWU\tACK\t%u\n", (unsigned int)have);
+            writeLine(fd, reply);
+        } else if (!strcmp(fields[3], "DONE") && (numFields >= 5)) {
+            uint8_t hash[FIRMWARE_HASH_SIZE];
+            char hashHex[FIRMWARE_HASH_SIZE * 2 + 1];
+            DashSha256 sha;
+            sha.update(image, have);
+            sha.finish(hash);
+            dashHexEncode(hash, FIRMWARE_HASH_SIZE, hashHex);
+            return strcmp(hashHex, fields[4]) ? MASTER_BAD_HASH : MASTER_DONE;
+        }
+    }
+    return MASTER_TIMEOUT;
+}
+
+// ---------------------------------------- Comms module ----------------------------------------
+
+struct ModuleResult {
+    int masterExit = -1;
+    uint32_t elapsedMs = 0;
+    uint32_t firstDataOffset = 0xFFFFFFFF; // Lowest offset sent
+};
+
+static void sendOffer(int fd, DashFirmwareTransfer& firmware) {
+    char hashHex[FIRMWARE_HASH_SIZE * 2 + 1];
+    char line[128];
+    dashHexEncode(firmware.hash(), FIRMWARE_HASH_SIZE, hashHex);
+    snprintf(line, sizeof(line), "\tDEV\tCTRL\tFWU\tOFFER\t%u\t%s\n", (unsigned int)firmware.size(), hashHex);
+    writeLine(fd, line);
+}
+
+// Runs the module side as DashCommsESP does (parseFirmwareCommand and sendFirmware), until the master exits
+static ModuleResult runTransfer(DashFirmwareTransfer& firmware, const MasterScenario& scenario) {
+    ModuleResult result;
+    int fd = posix_openpt(O_RDWR | O_NOCTTY);
+    grantpt(fd);
+    unlockpt(fd);
+    struct termios settings;
+    tcgetattr(fd, &settings);
+    cfmakeraw(&settings);
+    tcsetattr(fd, TCSANOW, &settings);
+
+    fflush(stdout);
+    pid_t master = fork();
+    if (master == 0) {
+        _exit(runMaster(ptsname(fd), scenario));
+    }
+
+    LineReader reader(fd);
+    char line[TEST_LINE_SIZE];
+    uint8_t chunk[512];
+    char dataLine[TEST_LINE_SIZE];
+    uint32_t startMs = nowMs();
+    bool doneSent = false;
+    int status;
+    while ((nowMs() - startMs) < TEST_TIMEOUT_MS) {
+        if (waitpid(master, &status, WNOHANG) == master) {
+            result.masterExit = WIFEXITED(status) ? WEXITSTATUS(status) : -1;
+            break;
+        }
+        while (reader.readLine(line, 1)) {
+            char *ack = strstr(line, "\tFWU\tACK\t");
+            if (ack != nullptr) {
+                firmware.ack(strtoul(ack + 9, NULL, 10), nowMs());
+            } else if (strstr(line, "\tFWU") != nullptr) {
+                sendOffer(fd, firmware);
+            }
+        }
+        if (firmware.state() == FIRMWARE_SENDING) {
+            uint32_t offset;
+            int32_t length;
+            while ((length = firmware.next(nowMs(), &offset, chunk)) > 0) {
+                if (offset < result.firstDataOffset) {
+                    result.firstDataOffset = offset;
+                }
+                int prefixLength = snprintf(dataLine, sizeof(dataLine), "\tDEV\tCTRL\tFWU\tDATA\t%u\t", (unsigned int)offset);
+                prefixLength += dashBase64Encode(chunk, length, dataLine + prefixLength);
+                strcpy(dataLine + prefixLength, "\n");
+                writeLine(fd, dataLine);
+            }
+        } else if ((firmware.state() == FIRMWARE_SENT) && !doneSent) {
+            char hashHex[FIRMWARE_HASH_SIZE * 2 + 1];
+            dashHexEncode(firmware.hash(), FIRMWARE_HASH_SIZE, hashHex);
+            snprintf(dataLine, sizeof(dataLine), "\tDEV\tCTRL\tFWU\tDONE\t%s\n", hashHex);
+            writeLine(fd, dataLine);
+            doneSent = true;
+        }
+    }
+    result.elapsedMs = nowMs() - startMs;
+    if (result.masterExit < 0) {
+        kill(master, SIGKILL);
+        waitpid(master, &status, 0);
+    }
+    close(fd);
+    return result;
+}
+
+// ---------------------------------------- Tests ----------------------------------------
+
+static uint8_t testImage[TEST_IMAGE_SIZE];
+static uint8_t testHash[FIRMWARE_HASH_SIZE];
+
+static void makeImage() {
+    srand(1);
+    for (uint32_t i = 0; i < TEST_IMAGE_SIZE; i++) {
+        testImage[i] = rand();
+    }
+    DashSha256 sha;
+    sha.update(testImage, TEST_IMAGE_SIZE);
+    sha.finish(testHash);
+}
+
+static DashFileLogStorage *stageImage() {
+    remove(TEST_STORAGE_PATH);
+    remove(TEST_HOST_IMAGE_PATH);
+    DashFileLogStorage *storage = new DashFileLogStorage(TEST_STORAGE_PATH, (TEST_IMAGE_SIZE / LOG_SECTOR_SIZE + 2) * LOG_SECTOR_SIZE);
+    DashFirmwareTransfer firmware(storage);
+    firmware.open();
+    CHECK(firmware.begin(TEST_IMAGE_SIZE, testHash));
+    for (uint32_t offset = 0; offset < TEST_IMAGE_SIZE; offset += 700) { // As received in DATA messages
+        uint32_t length = (TEST_IMAGE_SIZE - offset < 700) ? TEST_IMAGE_SIZE - offset : 700;
+        CHECK(firmware.write(offset, testImage + offset, length));
+    }
+    CHECK(firmware.finish());
+    CHECK(firmware.state() == FIRMWARE_STAGED);
+    return storage;
+}
+
+static void testHelpers() {
+    DashSha256 sha;
+    uint8_t hash[FIRMWARE_HASH_SIZE];
+    char hashHex[FIRMWARE_HASH_SIZE * 2 + 1];
+    sha.update((const uint8_t *)"abc", 3);
+    sha.finish(hash);
+    dashHexEncode(hash, FIRMWARE_HASH_SIZE, hashHex);
+    CHECK(!strcmp(hashHex, "ba7816bf8f01cfea414140de5dae2223b00361a396177a9cb410ff61f20015ad"));
+
+    for (uint32_t length = 0; length < 40; length++) {
+        uint8_t data[40];
+        uint8_t decoded[40];
+        char text[64];
+        for (uint32_t i = 0; i < length; i++) {
+            data[i] = rand();
+        }
+        dashBase64Encode(data, length, text);
+        CHECK(dashBase64Decode(text, decoded, sizeof(decoded)) == (int32_t)length);
+        CHECK(!memcmp(data, decoded, length));
+    }
+    CHECK(dashBase64Decode("ab$=", testHash, sizeof(testHash)) < 0);
+}
+
+static void testStaging() {
+    DashFileLogStorage *storage = stageImage();
+
+    // A staged image survives a reset
+    DashFirmwareTransfer reopened(storage);
+    reopened.open();
+    CHECK(reopened.state() == FIRMWARE_STAGED);
+    CHECK(reopened.size() == TEST_IMAGE_SIZE);
+    CHECK(!memcmp(reopened.hash(), testHash, FIRMWARE_HASH_SIZE));
+
+    // Out of order data and a bad hash are rejected
+    uint8_t badHash[FIRMWARE_HASH_SIZE];
+    memcpy(badHash, testHash, FIRMWARE_HASH_SIZE);
+    badHash[0] ^= 1;
+    CHECK(reopened.begin(TEST_IMAGE_SIZE, badHash));
+    CHECK(!reopened.write(700, testImage + 700, 700));
+    for (uint32_t offset = 0; offset < TEST_IMAGE_SIZE; offset += 700) {
+        uint32_t length = (TEST_IMAGE_SIZE - offset < 700) ? TEST_IMAGE_SIZE - offset : 700;
+        reopened.write(offset, testImage + offset, length);
+    }
+    CHECK(!reopened.finish());
+    CHECK(reopened.state() == FIRMWARE_EMPTY);
+    delete storage;
+}
+
+static void testTransfer() {
+    DashFileLogStorage *storage = stageImage();
+    DashFirmwareTransfer firmware(storage);
+    firmware.open();
+
+    ModuleResult result = runTransfer(firmware, MasterScenario());
+    CHECK(result.masterExit == MASTER_DONE);
+    CHECK(firmware.state() == FIRMWARE_SENT);
+    CHECK(firmware.retransmits() == 0);
+    printf("  %u bytes in %u ms\n", (unsigned int)TEST_IMAGE_SIZE, (unsigned int)result.elapsedMs);
+    delete storage;
+}
+
+static void testLostChunk() {
+    DashFileLogStorage *storage = stageImage();
+    DashFirmwareTransfer firmware(storage);
+    firmware.open();
+    firmware.ackTimeoutMs = 5000; // Much longer than the transfer, so only repeated ACKs can make it go back in time
+
+    MasterScenario scenario;
+    scenario.dropChunk = 10;
+    ModuleResult result = runTransfer(firmware, scenario);
+    CHECK(result.masterExit == MASTER_DONE);
+    CHECK(firmware.state() == FIRMWARE_SENT);
+    CHECK(firmware.retransmits() > 0);
+    CHECK(result.elapsedMs < firmware.ackTimeoutMs);
+    printf("  %u retransmitted chunks, %u ms\n", (unsigned int)firmware.retransmits(), (unsigned int)result.elapsedMs);
+    delete storage;
+}
+
+static void testResume() {
+    DashFileLogStorage *storage = stageImage();
+    DashFirmwareTransfer firmware(storage);
+    firmware.open();
+
+    // The master resets part way through the transfer
+    MasterScenario scenario;
+    scenario.stopAfterBytes = TEST_IMAGE_SIZE / 2;
+    ModuleResult result = runTransfer(firmware, scenario);
+    CHECK(result.masterExit == MASTER_STOPPED);
+    CHECK(firmware.state() != FIRMWARE_SENT);
+    uint8_t masterImage[TEST_IMAGE_SIZE];
+    uint32_t masterHas = loadMasterImage(masterImage);
+    CHECK(masterHas >= TEST_IMAGE_SIZE / 2);
+    delete storage;
+
+    // The comms module resets too, and recovers the staged image. The master asks for the offer
+    // and acknowledges what it already has, so only the rest of the image is sent
+    storage = new DashFileLogStorage(TEST_STORAGE_PATH, (TEST_IMAGE_SIZE / LOG_SECTOR_SIZE + 2) * LOG_SECTOR_SIZE);
+    DashFirmwareTransfer resumed(storage);
+    resumed.open();
+    CHECK(resumed.state() == FIRMWARE_STAGED);
+    result = runTransfer(resumed, MasterScenario());
+    CHECK(result.masterExit == MASTER_DONE);
+    CHECK(resumed.state() == FIRMWARE_SENT);
+    CHECK(result.firstDataOffset == masterHas);
+    delete storage;
+}
+
+int main() {
+    makeImage();
+    RUN_TEST(testHelpers);
+    RUN_TEST(testStaging);
+    RUN_TEST(testTransfer);
+    RUN_TEST(testLostChunk);
+    RUN_TEST(testResume);
+    remove(TEST_STORAGE_PATH);
+    remove(TEST_HOST_IMAGE_PATH);
+    return (testFailures == 0) ? 0 : 1;
+}
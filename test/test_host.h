@@ -0,0 +1,23 @@
+#ifndef DASHIO_TEST_HOST_H
+#define DASHIO_TEST_HOST_H
+
+// Minimal checks for the host tests. Each test program returns non zero if any check fails.
+
+#include <stdio.h>
+
+static int testFailures = 0;
+
+#define CHECK(condition) do { \
+    if (!(condition)) { \
+        printf("%s:%d: CHECK(%s) failed\n", __FILE__, __LINE__, #condition); \
+        testFailures++; \
+    } \
+} while (0)
+
+#define RUN_TEST(test) do { \
+    int failuresBefore = testFailures; \
+    test(); \
+    printf("%s %s\n", (testFailures == failuresBefore) ? "PASS" : "FAIL", #test); \
+} while (0)
+
+#endif
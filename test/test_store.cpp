@@ -0,0 +1,281 @@
+// Host tests for the MQTT store ring log (DashRingLog) on file storage
+
+#include <DashioCommsStoreESP.h>
+#include "test_host.h"
+
+#define TEST_LOG_PATH "build/test_store.bin"
+#define TEST_LOG_SECTORS 3
+#define TEST_PAYLOAD_LEN 100 // Records are 124 bytes, so 33 fit in a sector
+
+static uint32_t testRecordSize() {
+    return (sizeof(DashLogRecordHeader) + TEST_PAYLOAD_LEN + 3) & ~3UL;
+}
+
+static void makePayload(char *payload, uint32_t number) {
+    memset(payload, '.', TEST_PAYLOAD_LEN);
+    snprintf(payload, TEST_PAYLOAD_LEN, "message %05u", (unsigned int)number);
+}
+
+static void appendRecord(DashRingLog& log, uint32_t number, uint32_t keyHash = 0) {
+    char payload[TEST_PAYLOAD_LEN];
+    makePayload(payload, number);
+    CHECK(log.append(payload, TEST_PAYLOAD_LEN, keyHash, 0));
+}
+
+static int32_t popRecord(DashRingLog& log) { // Number of the oldest pending record, or -1 if empty
+    char payload[TEST_PAYLOAD_LEN + 1];
+    int32_t len = log.peek(payload, TEST_PAYLOAD_LEN, 0);
+    if (len < 0) {
+        return -1;
+    }
+    CHECK(len == TEST_PAYLOAD_LEN);
+    payload[len] = '\0';
+    log.pop();
+    unsigned int number = 0;
+    CHECK(sscanf(payload, "message %05u", &number) == 1);
+    return number;
+}
+
+// File storage where writes can only clear bits, as for flash
+class FlashFileLogStorage : public DashFileLogStorage {
+public:
+    FlashFileLogStorage() : DashFileLogStorage(TEST_LOG_PATH, TEST_LOG_SECTORS * LOG_SECTOR_SIZE) {}
+
+    bool write(uint32_t offset, const void *data, uint32_t len) {
+        uint8_t programmed[LOG_SECTOR_SIZE];
+        if ((len > sizeof(programmed)) || !read(offset, programmed, len)) {
+            return false;
+        }
+        for (uint32_t i = 0; i < len; i++) {
+            programmed[i] &= ((const uint8_t *)data)[i];
+        }
+        return DashFileLogStorage::write(offset, programmed, len);
+    }
+
+    bool eraseSector(uint32_t offset) {
+        uint8_t erased[LOG_SECTOR_SIZE];
+        memset(erased, 0xFF, sizeof(erased));
+        return DashFileLogStorage::write(offset, erased, sizeof(erased));
+    }
+};
+
+static FlashFileLogStorage *newStorage() {
+    remove(TEST_LOG_PATH);
+    return new FlashFileLogStorage();
+}
+
+static void testAppendAndPop() {
+    FlashFileLogStorage *storage = newStorage();
+    DashRingLog log(storage);
+    log.format();
+
+    for (uint32_t i = 0; i < 10; i++) {
+        appendRecord(log, i);
+    }
+    CHECK(log.pending() == 10);
+    for (int32_t i = 0; i < 10; i++) {
+        CHECK(popRecord(log) == i);
+    }
+    CHECK(popRecord(log) == -1);
+    CHECK(log.pending() == 0);
+    CHECK(log.dropped() == 0);
+    delete storage;
+}
+
+static void testWrapAround() {
+    FlashFileLogStorage *storage = newStorage();
+    DashRingLog log(storage);
+    log.format();
+
+    const uint32_t numRecords = 200; // About twice the storage
+    for (uint32_t i = 0; i < numRecords; i++) {
+        appendRecord(log, i);
+    }
+    uint32_t pending = log.pending();
+    CHECK(pending < TEST_LOG_SECTORS * LOG_SECTOR_SIZE / testRecordSize());
+    CHECK(pending + log.dropped() == numRecords);
+
+    // The newest records are kept, oldest first
+    for (uint32_t i = numRecords - pending; i < numRecords; i++) {
+        CHECK(popRecord(log) == (int32_t)i);
+    }
+    CHECK(popRecord(log) == -1);
+    delete storage;
+}
+
+static void testNewestOnly() {
+    FlashFileLogStorage *storage = newStorage();
+    DashRingLog log(storage);
+    log.format();
+    log.newestOnly = true;
+
+    appendRecord(log, 1, 0xA);
+    appendRecord(log, 2, 0xB);
+    appendRecord(log, 3, 0xA); // Supersedes 1
+    appendRecord(log, 4, 0); // Never superseded
+    appendRecord(log, 5, 0);
+    CHECK(log.pending() == 4);
+    CHECK(log.dropped() == 1);
+
+    // The table is rebuilt from storage on open
+    DashRingLog reopened(storage);
+    reopened.newestOnly = true;
+    reopened.open();
+    CHECK(reopened.pending() == 4);
+    appendRecord(reopened, 6, 0xB); // Supersedes 2
+    CHECK(reopened.pending() == 4);
+
+    CHECK(popRecord(reopened) == 3);
+    CHECK(popRecord(reopened) == 4);
+    CHECK(popRecord(reopened) == 5);
+    CHECK(popRecord(reopened) == 6);
+    CHECK(popRecord(reopened) == -1);
+    delete storage;
+}
+
+static void testReopen() {
+    FlashFileLogStorage *storage = newStorage();
+    DashRingLog log(storage);
+    log.format();
+    for (uint32_t i = 0; i < 50; i++) {
+        appendRecord(log, i);
+    }
+    for (int32_t i = 0; i < 20; i++) {
+        CHECK(popRecord(log) == i);
+    }
+    delete storage;
+
+    storage = new FlashFileLogStorage(); // As after a reset, on the same file
+    DashRingLog reopened(storage);
+    reopened.open();
+    CHECK(reopened.pending() == 30);
+    appendRecord(reopened, 50);
+    for (int32_t i = 20; i <= 50; i++) {
+        CHECK(popRecord(reopened) == i);
+    }
+    CHECK(popRecord(reopened) == -1);
+    delete storage;
+}
+
+static void testReopenAfterWrap() {
+    FlashFileLogStorage *storage = newStorage();
+    DashRingLog log(storage);
+    log.format();
+    for (uint32_t i = 0; i < 150; i++) {
+        appendRecord(log, i);
+    }
+    uint32_t pending = log.pending();
+    delete storage;
+
+    storage = new FlashFileLogStorage(); // As after a reset, on the same file
+    DashRingLog reopened(storage);
+    reopened.open();
+    CHECK(reopened.pending() == pending);
+    for (uint32_t i = 150 - pending; i < 150; i++) {
+        CHECK(popRecord(reopened) == (int32_t)i);
+    }
+    CHECK(popRecord(reopened) == -1);
+    delete storage;
+}
+
+static void testTornAppend(bool withPartialHeader) {
+    FlashFileLogStorage *storage = newStorage();
+    DashRingLog log(storage);
+    log.format();
+    for (uint32_t i = 0; i < 5; i++) {
+        appendRecord(log, i);
+    }
+    delete storage;
+
+    // Power lost during the next append, after some of the payload (and header) was written
+    storage = new FlashFileLogStorage(); // As after a reset, on the same file
+    uint32_t head = 5 * testRecordSize();
+    char payload[TEST_PAYLOAD_LEN];
+    makePayload(payload, 99);
+    storage->write(head + sizeof(DashLogRecordHeader), payload, TEST_PAYLOAD_LEN / 2);
+    if (withPartialHeader) {
+        DashLogRecordHeader header;
+        memset(&header, 0xFF, sizeof(header));
+        header.magic = LOG_MAGIC;
+        header.length = TEST_PAYLOAD_LEN;
+        header.seq = 1000; // Newer than any record, but the CRC doesn't match
+        storage->write(head, &header, offsetof(DashLogRecordHeader, timestamp));
+    }
+
+    DashRingLog reopened(storage);
+    reopened.open();
+    CHECK(reopened.pending() == 5);
+    appendRecord(reopened, 5);
+    appendRecord(reopened, 6);
+    delete storage;
+
+    storage = new FlashFileLogStorage(); // As after a reset, on the same file
+    DashRingLog recovered(storage);
+    recovered.open();
+    CHECK(recovered.pending() == 7);
+    for (int32_t i = 0; i < 7; i++) {
+        CHECK(popRecord(recovered) == i);
+    }
+    CHECK(popRecord(recovered) == -1);
+    delete storage;
+}
+
+static void testTornPayload() {
+    testTornAppend(false);
+}
+
+static void testTornHeader() {
+    testTornAppend(true);
+}
+
+static void testCorruptedPayload() {
+    FlashFileLogStorage *storage = newStorage();
+    DashRingLog log(storage);
+    log.format();
+    for (uint32_t i = 0; i < 3; i++) {
+        appendRecord(log, i);
+    }
+
+    // Clear some bits of the second record's payload
+    uint8_t corrupted = 0;
+    storage->write(testRecordSize() + sizeof(DashLogRecordHeader) + 20, &corrupted, 1);
+
+    CHECK(popRecord(log) == 0);
+    CHECK(popRecord(log) == 2);
+    CHECK(popRecord(log) == -1);
+    CHECK(log.dropped() == 1);
+    delete storage;
+}
+
+static void testCorruptedPayloadReopen() {
+    FlashFileLogStorage *storage = newStorage();
+    DashRingLog log(storage);
+    log.format();
+    for (uint32_t i = 0; i < 3; i++) {
+        appendRecord(log, i);
+    }
+    uint8_t corrupted = 0;
+    storage->write(testRecordSize() + sizeof(DashLogRecordHeader) + 20, &corrupted, 1);
+
+    DashRingLog reopened(storage);
+    reopened.open();
+    CHECK(reopened.pending() == 2);
+    CHECK(popRecord(reopened) == 0);
+    CHECK(popRecord(reopened) == 2);
+    CHECK(popRecord(reopened) == -1);
+    delete storage;
+}
+
+int main() {
+    RUN_TEST(testAppendAndPop);
+    RUN_TEST(testWrapAround);
+    RUN_TEST(testNewestOnly);
+    RUN_TEST(testReopen);
+    RUN_TEST(testReopenAfterWrap);
+    RUN_TEST(testTornPayload);
+    RUN_TEST(testTornHeader);
+    RUN_TEST(testCorruptedPayload);
+    RUN_TEST(testCorruptedPayloadReopen);
+    remove(TEST_LOG_PATH);
+    return (testFailures == 0) ? 0 : 1;
+}